@@ -0,0 +1,377 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "analysis.h"
+#include "library.h"
+#include "metadata.h"
+#include "decoder.h"
+#include "loudness.h"
+#include "tempo_key.h"
+#include "fingerprint.h"
+#include "playback.h"
+#include "simd.h"
+#include "array.h"
+#include "os.h"
+#include <atomic>
+#include <math.h>
+
+#define ANALYSIS_CHUNK_FRAMES 16384
+// While music is playing, workers sleep for this long relative to the time
+// they spent working
+#define ANALYSIS_THROTTLE_RATIO 1.f
+// Tracks checked per frame when looking for work
+#define ANALYSIS_SCAN_STEP 512
+
+struct Analysis_Job {
+    Metadata_Index md_index;
+    u32 expected_duration_seconds;
+    // Results from earlier runs. Stages already in previous.flags are skipped
+    Track_Analysis previous;
+    char path[PATH_LENGTH];
+};
+
+// Decoder and analyzer state owned by one worker
+struct Analysis_Worker_Data {
+    Decoder dec;
+    Loudness_Meter meter;
+    Tempo_Key_Estimator tempo_key;
+    Fingerprinter fingerprinter;
+    Array<f32> buffer;
+};
+
+struct Analysis_Result {
+    Metadata_Index md_index;
+    Track_Analysis analysis;
+    // Only set if the fingerprint stage ran and found enough audio
+    Fingerprint fingerprint;
+};
+
+struct Analysis_State {
+    Thread workers[ANALYSIS_WORKER_COUNT];
+    Mutex lock;
+    // Guarded by lock
+    Array<Analysis_Job> jobs;
+    Array<Analysis_Result> results;
+    u32 jobs_in_flight;
+    // Entry each worker is analyzing, and whether its analysis was reset
+    // since, in which case the result is thrown away
+    Metadata_Index working[ANALYSIS_WORKER_COUNT];
+    bool working_stale[ANALYSIS_WORKER_COUNT];
+    // Jobs thrown away since the last update, to take off the progress total
+    u32 jobs_dropped;
+    // Next track to check
+    Track scan_cursor;
+    //-
+    std::atomic_bool want_quit;
+    std::atomic_bool paused;
+    std::atomic_bool throttle;
+    Analysis_Progress progress;
+};
+
+static Analysis_State g_analysis;
+
+static f32 amplitude_to_db(f64 amplitude) {
+    if (amplitude <= 0.0) return ANALYSIS_SILENCE_DB;
+    return MAX(ANALYSIS_SILENCE_DB, (f32)(20.0 * log10(amplitude)));
+}
+
+static bool pop_job(u32 worker_index, Analysis_Job *job) {
+    bool have_job = false;
+    lock_mutex(g_analysis.lock);
+    if (g_analysis.jobs.count) {
+        *job = g_analysis.jobs[0];
+        g_analysis.jobs.ordered_remove(0);
+        g_analysis.working[worker_index] = job->md_index;
+        g_analysis.working_stale[worker_index] = false;
+        have_job = true;
+    }
+    unlock_mutex(g_analysis.lock);
+    return have_job;
+}
+
+// Returns false if analysis was interrupted
+static bool analyze_track(const Analysis_Job *job, Analysis_Worker_Data *worker, Track_Analysis *out,
+                          Fingerprint *out_fingerprint) {
+    Decoder *dec = &worker->dec;
+    f32 *buffer = worker->buffer.data;
+    const u32 stages = ANALYSIS_FLAG__ALL_STAGES & ~job->previous.flags;
+    *out = job->previous;
+
+    if (!decoder_open(dec, job->path) || dec->info.channels > MAX_AUDIO_CHANNELS) {
+        decoder_close(dec);
+        *out = {};
+        out->flags = ANALYSIS_FLAG__ALL_STAGES|ANALYSIS_FLAG_OPEN_FAILED;
+        out->peak_db = ANALYSIS_SILENCE_DB;
+        out->rms_db = ANALYSIS_SILENCE_DB;
+        out->loudness = LOUDNESS_SILENCE;
+        return true;
+    }
+    defer(decoder_close(dec));
+
+    const i32 channels = dec->info.channels;
+    const i32 sample_rate = dec->info.samplerate;
+    const bool do_levels = (stages & ANALYSIS_FLAG_LEVELS) != 0;
+    const bool do_tempo_key = (stages & ANALYSIS_FLAG_TEMPO_KEY) != 0;
+    const bool do_fingerprint = (stages & ANALYSIS_FLAG_FINGERPRINT) != 0;
+    bool skipped_to_tempo_key = false;
+    f32 peak = 0.f;
+    f64 sum_of_squares = 0.0;
+    i64 frames_decoded = 0;
+    f32 work_ms = 0.f;
+
+    // Tempo and key only look at the middle of the track
+    const i64 tempo_key_length = (i64)TEMPO_KEY_MAX_SECONDS * sample_rate;
+    i64 tempo_key_first = MAX((i64)0, ((i64)dec->info.frames - tempo_key_length) / 2);
+    i64 tempo_key_last = tempo_key_first + tempo_key_length;
+
+    if (do_levels) loudness_init(&worker->meter, channels, sample_rate);
+    if (do_tempo_key) tempo_key_init(&worker->tempo_key, sample_rate);
+    if (do_fingerprint) fingerprinter_init(&worker->fingerprinter, sample_rate);
+
+    while (true) {
+        u64 start = perf_time_now();
+        i64 frame_index = dec->frame_index;
+
+        // No need to decode the whole file when levels aren't wanted. The
+        // fingerprint comes from the start of the track, tempo and key
+        // from the middle
+        if (!do_levels && (!do_fingerprint || fingerprinter_is_done(&worker->fingerprinter))) {
+            if (!do_tempo_key || frame_index >= tempo_key_last) break;
+            if (frame_index < tempo_key_first && !skipped_to_tempo_key) {
+                skipped_to_tempo_key = true;
+                if (!decoder_seek_frame(dec, tempo_key_first)) decoder_seek_frame(dec, frame_index);
+                continue;
+            }
+        }
+
+        Decode_Status status = decoder_decode(dec, buffer, ANALYSIS_CHUNK_FRAMES, channels, sample_rate);
+        u32 frame_count = (u32)(dec->frame_index - frame_index);
+        if (status == DECODE_STATUS_EOF || !frame_count) break;
+
+        if (do_levels) {
+            f32 min[MAX_AUDIO_CHANNELS], max[MAX_AUDIO_CHANNELS], sumsq[MAX_AUDIO_CHANNELS];
+            simd_interleaved_min_max_sumsq(buffer, frame_count, channels, min, max, sumsq);
+            for (i32 ch = 0; ch < channels; ++ch) {
+                peak = MAX(peak, MAX(-min[ch], max[ch]));
+                sum_of_squares += sumsq[ch];
+            }
+
+            loudness_process(&worker->meter, buffer, frame_count);
+            frames_decoded += frame_count;
+        }
+
+        if (do_tempo_key) {
+            i64 first = MAX(frame_index, tempo_key_first);
+            i64 last = MIN(frame_index + (i64)frame_count, tempo_key_last);
+            if (last > first) {
+                tempo_key_process(&worker->tempo_key, &buffer[(first - frame_index) * channels],
+                    (u32)(last - first), channels);
+            }
+        }
+
+        if (do_fingerprint) {
+            fingerprinter_process(&worker->fingerprinter, buffer, frame_count, channels);
+        }
+
+        if (status == DECODE_STATUS_PARTIAL) break;
+        if (g_analysis.want_quit) return false;
+
+        // Stay out of the way of playback
+        work_ms += perf_time_to_millis(perf_time_now() - start);
+        if (work_ms >= 10.f) {
+            if (g_analysis.throttle) sleep_milliseconds((u32)(work_ms * ANALYSIS_THROTTLE_RATIO));
+            work_ms = 0.f;
+        }
+    }
+
+    if (do_levels) {
+        out->flags &= ~(ANALYSIS_FLAG_TRUNCATED|ANALYSIS_FLAG_DURATION_MISMATCH);
+        out->flags |= ANALYSIS_FLAG_LEVELS;
+        out->peak_db = amplitude_to_db(peak);
+        out->rms_db = frames_decoded ?
+            amplitude_to_db(sqrt(sum_of_squares / (f64)(frames_decoded * channels))) : ANALYSIS_SILENCE_DB;
+        out->loudness = loudness_get_integrated(&worker->meter);
+        out->decoded_duration_ms = (u32)((frames_decoded * 1000) / sample_rate);
+
+        // Allow a second of slack for formats that only estimate their length
+        if (dec->info.frames > 0 && (frames_decoded + sample_rate) < dec->info.frames) {
+            out->flags |= ANALYSIS_FLAG_TRUNCATED;
+        }
+
+        i64 duration_difference = (i64)(out->decoded_duration_ms / 1000) - (i64)job->expected_duration_seconds;
+        if (job->expected_duration_seconds && (duration_difference > 2 || duration_difference < -2)) {
+            out->flags |= ANALYSIS_FLAG_DURATION_MISMATCH;
+        }
+    }
+
+    if (do_tempo_key) {
+        out->flags |= ANALYSIS_FLAG_TEMPO_KEY;
+        out->bpm = tempo_key_get_bpm(&worker->tempo_key);
+        out->key = tempo_key_get_key(&worker->tempo_key);
+    }
+
+    if (do_fingerprint) {
+        out->flags |= ANALYSIS_FLAG_FINGERPRINT;
+        if (worker->fingerprinter.fingerprint.frame_count >= FINGERPRINT_MIN_FRAMES) {
+            *out_fingerprint = worker->fingerprinter.fingerprint;
+        }
+    }
+
+    return true;
+}
+
+static int analysis_worker(void *index_ptr) {
+    const u32 worker_index = (u32)(uintptr_t)index_ptr;
+    Analysis_Worker_Data worker = {};
+    worker.buffer.push(ANALYSIS_CHUNK_FRAMES * MAX_AUDIO_CHANNELS);
+
+    while (!g_analysis.want_quit) {
+        Analysis_Job job;
+        Analysis_Result result = {};
+
+        if (g_analysis.paused || !pop_job(worker_index, &job)) {
+            sleep_milliseconds(100);
+            continue;
+        }
+
+        result.md_index = job.md_index;
+        bool finished = analyze_track(&job, &worker, &result.analysis, &result.fingerprint);
+
+        lock_mutex(g_analysis.lock);
+        if (g_analysis.working_stale[worker_index]) g_analysis.jobs_dropped++;
+        else if (finished) g_analysis.results.append(result);
+        g_analysis.working[worker_index] = 0;
+        g_analysis.jobs_in_flight--;
+        unlock_mutex(g_analysis.lock);
+    }
+
+    loudness_free(&worker.meter);
+    tempo_key_free(&worker.tempo_key);
+    worker.buffer.free();
+    return 0;
+}
+
+void analysis_init() {
+    g_analysis.lock = create_mutex();
+    g_analysis.scan_cursor = 1;
+    g_analysis.want_quit = false;
+
+    for (u32 i = 0; i < ANALYSIS_WORKER_COUNT; ++i) {
+        g_analysis.workers[i] = thread_create((void*)(uintptr_t)i, &analysis_worker);
+    }
+}
+
+void analysis_deinit() {
+    g_analysis.want_quit = true;
+    for (u32 i = 0; i < ANALYSIS_WORKER_COUNT; ++i) {
+        if (!g_analysis.workers[i]) continue;
+        thread_join(g_analysis.workers[i]);
+        thread_destroy(g_analysis.workers[i]);
+        g_analysis.workers[i] = NULL;
+    }
+
+    // Keep anything that finished before we stopped
+    analysis_update();
+
+    destroy_mutex(g_analysis.lock);
+    g_analysis.lock = NULL;
+    g_analysis.jobs.free();
+    g_analysis.results.free();
+}
+
+void analysis_update() {
+    Analysis_Progress *progress = &g_analysis.progress;
+    const u32 track_count = library_get_track_count();
+
+    g_analysis.throttle = playback_get_state() == PLAYBACK_STATE_PLAYING;
+
+    lock_mutex(g_analysis.lock);
+    defer(unlock_mutex(g_analysis.lock));
+
+    for (const Analysis_Result& result : g_analysis.results) {
+        set_metadata_analysis(result.md_index, &result.analysis);
+        if (result.fingerprint.frame_count) set_metadata_fingerprint(result.md_index, &result.fingerprint);
+        if (result.analysis.flags & ANALYSIS_FLAG__ERRORS) progress->errors++;
+        progress->completed++;
+    }
+    g_analysis.results.clear();
+    progress->total -= g_analysis.jobs_dropped;
+    g_analysis.jobs_dropped = 0;
+
+    if (g_analysis.want_quit) return;
+
+    // Look for tracks that still need work
+    for (u32 step = 0; step < ANALYSIS_SCAN_STEP && g_analysis.scan_cursor <= track_count; ++step) {
+        if (g_analysis.jobs_in_flight >= ANALYSIS_MAX_QUEUED_JOBS) break;
+
+        Track track = g_analysis.scan_cursor++;
+        Metadata_Index md_index = library_get_track_metadata_index(track);
+        Track_Analysis analysis;
+        retrieve_metadata_analysis(md_index, &analysis);
+
+        if ((analysis.flags & ANALYSIS_FLAG__ALL_STAGES) != ANALYSIS_FLAG__ALL_STAGES) {
+            Analysis_Job job = {};
+            Metadata md;
+            retrieve_metadata(md_index, &md);
+            job.md_index = md_index;
+            job.expected_duration_seconds = md.duration_seconds;
+            job.previous = analysis;
+            library_get_track_path(track, job.path);
+            g_analysis.jobs.append(job);
+            g_analysis.jobs_in_flight++;
+            progress->total++;
+        }
+    }
+}
+
+void analysis_invalidate(Metadata_Index md_index) {
+    if (!g_analysis.lock) return;
+    lock_mutex(g_analysis.lock);
+    defer(unlock_mutex(g_analysis.lock));
+
+    // Jobs and results from before the reset would put the old analysis back
+    for (u32 i = 0; i < g_analysis.jobs.count;) {
+        if (g_analysis.jobs[i].md_index != md_index) ++i;
+        else {
+            g_analysis.jobs.ordered_remove(i);
+            g_analysis.jobs_in_flight--;
+            g_analysis.jobs_dropped++;
+        }
+    }
+    for (u32 i = 0; i < g_analysis.results.count;) {
+        if (g_analysis.results[i].md_index != md_index) ++i;
+        else {
+            g_analysis.results.ordered_remove(i);
+            g_analysis.jobs_dropped++;
+        }
+    }
+    for (u32 i = 0; i < ANALYSIS_WORKER_COUNT; ++i) {
+        if (g_analysis.working[i] == md_index) g_analysis.working_stale[i] = true;
+    }
+
+    // The track may be behind the cursor
+    g_analysis.scan_cursor = 1;
+}
+
+void analysis_set_paused(bool paused) {
+    g_analysis.paused = paused;
+}
+
+void analysis_get_progress(Analysis_Progress *progress) {
+    *progress = g_analysis.progress;
+    progress->paused = g_analysis.paused;
+}
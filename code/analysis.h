@@ -0,0 +1,57 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+// Background analysis of every track in the library. Workers each own a
+// Decoder and only ever see copies of the paths they are given. Results
+// are committed into the metadata on the main thread by analysis_update(),
+// and stay in the metadata cache so analysis picks up where it left off
+// on the next run. Each stage sets an ANALYSIS_FLAG_* bit, and tracks are
+// only given the stages they are missing
+
+#include "defines.h"
+#include "metadata.h"
+
+#define ANALYSIS_WORKER_COUNT 2
+// Jobs are queued a few at a time so newly added tracks don't wait
+// behind the whole library
+#define ANALYSIS_MAX_QUEUED_JOBS 16
+#define ANALYSIS_SILENCE_DB -96.f
+
+struct Analysis_Progress {
+    // Tracks found to need analysis this session
+    u32 total;
+    u32 completed;
+    u32 errors;
+    bool paused;
+};
+
+void analysis_init();
+// Stops the workers. Unfinished jobs are dropped and will run again next time
+void analysis_deinit();
+// Call once per frame from the main thread
+void analysis_update();
+// Queues an entry to be analyzed again after its analysis was reset, and
+// throws away analysis of it that is still in progress. Safe to call from
+// any thread
+void analysis_invalidate(Metadata_Index md_index);
+void analysis_set_paused(bool paused);
+void analysis_get_progress(Analysis_Progress *progress);
+
+#endif //ANALYSIS_H
@@ -26,6 +26,9 @@ struct Audio_Buffer_Spec {
     i32 frame_count;
     i32 channel_count;
     i32 sample_rate;
+    // perf_time_now() time at which the first frame of the buffer
+    // will be played by the device
+    u64 dac_time;
 };
 
 typedef void Fill_Audio_Buffer_Callback(void *data, f32 *buffer, const Audio_Buffer_Spec *spec);
@@ -9,14 +9,25 @@ struct Portaudio_Data {
     Fill_Audio_Buffer_Callback *callback;
     void *callback_data;
     float volume;
+    i32 sample_rate;
+    i32 channel_count;
 };
 
 static int stream_callback(const void *input, void *output, unsigned long frames, const PaStreamCallbackTimeInfo *time_info, PaStreamCallbackFlags status_flags, void *data) {
     Portaudio_Data *stream = (Portaudio_Data*)data;
     Audio_Buffer_Spec spec;
-    spec.channel_count = 2;
+    spec.channel_count = stream->channel_count;
     spec.frame_count = frames;
-    spec.sample_rate = 44100;
+    spec.sample_rate = stream->sample_rate;
+
+    // Convert the DAC time from the stream clock to the perf clock. Some host APIs
+    // don't report a DAC time, use the stream latency for those
+    f64 dac_delay = time_info->outputBufferDacTime - time_info->currentTime;
+    if (time_info->outputBufferDacTime == 0 || dac_delay < 0) {
+        const PaStreamInfo *info = Pa_GetStreamInfo(stream->stream);
+        dac_delay = info ? info->outputLatency : 0;
+    }
+    spec.dac_time = perf_time_now() + (u64)(dac_delay * (f64)perf_time_frequency());
 
     stream->callback(stream->callback_data, (f32*)output, &spec);
 
@@ -60,6 +71,10 @@ bool open_portaudio_audio_stream(Fill_Audio_Buffer_Callback *callback, void *cal
     data->callback = callback;
     data->callback_data = callback_data;
     data->volume = 1.f;
+    data->sample_rate = 44100;
+    data->channel_count = 2;
+    stream->sample_rate = data->sample_rate;
+    stream->channel_count = data->channel_count;
 
     if (!g_initialized) {
         err = Pa_Initialize();
@@ -69,9 +84,9 @@ bool open_portaudio_audio_stream(Fill_Audio_Buffer_Callback *callback, void *cal
     err = Pa_OpenDefaultStream(
         &data->stream,
         0,
-        2,
+        data->channel_count,
         paFloat32,
-        44100,
+        data->sample_rate,
         256,
         &stream_callback,
         data
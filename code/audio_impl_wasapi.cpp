@@ -60,6 +60,7 @@ static DWORD audio_thread_entry(LPVOID user_data) {
     WASAPI_Instance *instance = (WASAPI_Instance*)user_data;
     Audio_Buffer_Spec buffer_spec = {};
     DWORD buffer_duration_ms;
+    REFERENCE_TIME stream_latency = 0;
     
     (void)CoInitialize(NULL);
     
@@ -71,6 +72,7 @@ static DWORD audio_thread_entry(LPVOID user_data) {
         
         audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, (REFERENCE_TIME)1e7, 0, format, NULL);
         audio_client->GetBufferSize(&buffer_frame_count);
+        audio_client->GetStreamLatency(&stream_latency);
         audio_client->GetService(__uuidof(IAudioRenderClient), (void**)&render_client);
         audio_client->GetService(__uuidof(IAudioStreamVolume), (void**)&instance->volume_controller);
         render_client->GetBuffer(buffer_frame_count, &buffer);
@@ -113,6 +115,11 @@ static DWORD audio_thread_entry(LPVOID user_data) {
         
         render_client->GetBuffer(available_frames, &buffer);
         buffer_spec.frame_count = available_frames;
+        // New frames go after the ones still queued on the device
+        {
+            f64 dac_delay = ((f64)frame_padding / (f64)buffer_spec.sample_rate) + ((f64)stream_latency / 1e7);
+            buffer_spec.dac_time = perf_time_now() + (u64)(dac_delay * (f64)perf_time_frequency());
+        }
         instance->callback(instance->callback_data, (f32*)buffer, &buffer_spec);
         render_client->ReleaseBuffer(available_frames, 0);
     }
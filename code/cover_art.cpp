@@ -0,0 +1,608 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "cover_art.h"
+#include "metadata.h"
+#include "platform.h"
+#include "array.h"
+#include "os.h"
+#include "hash_index.h"
+#include <xxhash.h>
+#include <stdio.h>
+#include <stb_image_write.h>
+#include <atomic>
+
+#define COVER_ART_JPEG_QUALITY 90
+// How long the worker sleeps when there is nothing to load
+#define COVER_ART_IDLE_SLEEP_MS 10
+
+static const i32 THUMBNAIL_PIXEL_SIZES[COVER_ART_SIZE__COUNT] = {64, 192, 512};
+
+enum {
+    THUMBNAIL_STATE_LOADING,
+    // Pixels are waiting to be uploaded
+    THUMBNAIL_STATE_DECODED,
+    THUMBNAIL_STATE_READY,
+    THUMBNAIL_STATE_FAILED,
+};
+
+// One per picture and size, shared by every request for it
+struct Thumbnail {
+    u64 picture_hash;
+    Cover_Art_Size size;
+    u32 state;
+    // Requests using the thumbnail. It's freed when this drops to 0
+    u32 refs;
+    Image image;
+    // Own texture, unless the thumbnail is in the atlas
+    Texture *texture;
+    u32 page;
+    u32 cell;
+    // Frame the thumbnail was last drawn on. The least recently drawn
+    // unreferenced thumbnail gives up its atlas cell first
+    u64 last_used_frame;
+    bool in_atlas;
+    bool in_use;
+};
+
+// Square cells of one thumbnail size
+struct Atlas_Page {
+    Texture *texture;
+    Cover_Art_Size size;
+    u32 cells_per_row;
+    // Thumbnail index+1 in each cell, 0 if the cell is free
+    Array<u32> cells;
+};
+
+// Which picture a file has, so art that is already loaded can be used
+// without reading the file again. Kept for the session
+struct Picture_Memo {
+    u64 path_hash;
+    u64 picture_hash;
+    bool has_picture;
+};
+
+struct Cover_Art_Request {
+    Cover_Art_Size size;
+    // Index+1 into thumbnails. 0 until the picture has been read, or if
+    // the file has none
+    u32 thumbnail;
+    bool pending;
+    // Released while pending. The worker frees it once it's done with it
+    bool released;
+    bool in_use;
+};
+
+struct Cover_Art_Job {
+    u32 request;
+    char path[PATH_LENGTH];
+};
+
+struct Cover_Art_State {
+    Thread worker;
+    Mutex lock;
+    // Guarded by lock
+    Array<Cover_Art_Request> requests;
+    Array<Thumbnail> thumbnails;
+    Array<Cover_Art_Job> jobs;
+    Array<Picture_Memo> memos;
+    // Memos by the low 32 bits of path_hash
+    Hash_Index memo_index;
+    //-
+    // Only touched on the main thread
+    Array<Atlas_Page> pages;
+    u64 frame;
+    std::atomic_bool want_quit;
+};
+
+static Cover_Art_State g_cover_art;
+
+static void get_thumbnail_path(u64 picture_hash, Cover_Art_Size size, char *buffer) {
+    snprintf(buffer, PATH_LENGTH-1, "%s" PATH_SEP_STR "covers" PATH_SEP_STR "%016llx_%d.jpg",
+        PLATFORM_DATA_PATH, (unsigned long long)picture_hash, THUMBNAIL_PIXEL_SIZES[size]);
+}
+
+// Box filter. Every output pixel is the average of the source pixels it
+// covers. Images smaller than max_size are copied as they are
+static void downscale_image(const Image *src, i32 max_size, Image *dst) {
+    const f32 scale = MIN(1.f, (f32)max_size / (f32)MAX(src->width, src->height));
+    dst->width = MAX(1, (i32)((f32)src->width * scale + 0.5f));
+    dst->height = MAX(1, (i32)((f32)src->height * scale + 0.5f));
+    dst->format = IMAGE_FORMAT_R8G8B8A8;
+    dst->flags = 0;
+    dst->data = (u8*)malloc((size_t)dst->width * dst->height * 4);
+
+    for (i32 y = 0; y < dst->height; ++y) {
+        const i32 y0 = (i32)((i64)y * src->height / dst->height);
+        const i32 y1 = MAX(y0 + 1, (i32)((i64)(y + 1) * src->height / dst->height));
+        for (i32 x = 0; x < dst->width; ++x) {
+            const i32 x0 = (i32)((i64)x * src->width / dst->width);
+            const i32 x1 = MAX(x0 + 1, (i32)((i64)(x + 1) * src->width / dst->width));
+            const u32 count = (u32)((y1 - y0) * (x1 - x0));
+            u32 sum[4] = {};
+
+            for (i32 sy = y0; sy < y1; ++sy) {
+                const u8 *p = &src->data[((size_t)sy * src->width + x0) * 4];
+                for (i32 sx = x0; sx < x1; ++sx, p += 4) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    sum[3] += p[3];
+                }
+            }
+
+            u8 *out = &dst->data[((size_t)y * dst->width + x) * 4];
+            for (i32 c = 0; c < 4; ++c) out[c] = (u8)((sum[c] + (count / 2)) / count);
+        }
+    }
+}
+
+static void append_to_buffer(void *buffer, void *data, int size) {
+    ((Array<u8>*)buffer)->append_array((const u8*)data, (u32)size);
+}
+
+static void save_thumbnail(const char *path, const Image *image) {
+    Array<u8> jpeg = {};
+    defer(jpeg.free());
+
+    if (!stbi_write_jpg_to_func(&append_to_buffer, &jpeg, image->width, image->height, 4,
+                                image->data, COVER_ART_JPEG_QUALITY)) {
+        return;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) return;
+    const bool written = fwrite(jpeg.data, 1, jpeg.count, f) == jpeg.count;
+    fclose(f);
+    // Don't leave a truncated thumbnail behind
+    if (!written) delete_file(path);
+}
+
+// Loads the thumbnail from disk, or makes it from the full picture. The
+// picture is read from file_path if it hasn't been already
+static bool load_thumbnail(u64 picture_hash, Cover_Art_Size size, const char *file_path,
+                           Array<u8>& picture, Image *image) {
+    char path[PATH_LENGTH] = {};
+    Image full = {};
+
+    get_thumbnail_path(picture_hash, size, path);
+    if (load_image_from_file(path, image)) return true;
+
+    if (!picture.count && !read_file_picture(file_path, &picture)) return false;
+    if (!load_image_from_memory(picture.data, picture.count, &full)) {
+        log_warning("Failed to decode cover art (%016llx)\n", (unsigned long long)picture_hash);
+        return false;
+    }
+
+    downscale_image(&full, THUMBNAIL_PIXEL_SIZES[size], image);
+    free_image(&full);
+    // The picture may have changed since it was first read
+    if (XXH64(picture.data, picture.count, 0) == picture_hash) save_thumbnail(path, image);
+    return true;
+}
+
+static bool uses_atlas(Cover_Art_Size size) {
+    return size != COVER_ART_SIZE_LARGE;
+}
+
+static u64 hash_path(const char *path) {
+    return XXH64(path, strlen(path), 0);
+}
+
+// Call with the lock held
+static const Picture_Memo *find_memo(u64 path_hash) {
+    u32 index = g_cover_art.memo_index.find((u32)path_hash, [path_hash](u32 i) {
+        return g_cover_art.memos[i].path_hash == path_hash;
+    });
+    return index == Hash_Index::NOT_FOUND ? NULL : &g_cover_art.memos[index];
+}
+
+// Call with the lock held
+static void free_request(u32 index) {
+    Cover_Art_Request& request = g_cover_art.requests[index];
+    if (request.thumbnail) g_cover_art.thumbnails[request.thumbnail - 1].refs--;
+    request.in_use = false;
+}
+
+// Call with the lock held
+static u32 find_thumbnail(u64 picture_hash, Cover_Art_Size size) {
+    for (u32 i = 0; i < g_cover_art.thumbnails.count; ++i) {
+        const Thumbnail& t = g_cover_art.thumbnails[i];
+        if (t.in_use && t.picture_hash == picture_hash && t.size == size) return i;
+    }
+    return UINT32_MAX;
+}
+
+// Call with the lock held
+static u32 find_or_add_thumbnail(u64 picture_hash, Cover_Art_Size size, bool *added) {
+    u32 free_slot = find_thumbnail(picture_hash, size);
+    if (free_slot != UINT32_MAX) {
+        *added = false;
+        return free_slot;
+    }
+
+    for (u32 i = 0; i < g_cover_art.thumbnails.count; ++i) {
+        if (!g_cover_art.thumbnails[i].in_use) {
+            free_slot = i;
+            break;
+        }
+    }
+
+    if (free_slot == UINT32_MAX) free_slot = g_cover_art.thumbnails.push();
+    Thumbnail& t = g_cover_art.thumbnails[free_slot];
+    t = Thumbnail{};
+    t.picture_hash = picture_hash;
+    t.size = size;
+    t.state = THUMBNAIL_STATE_LOADING;
+    t.in_use = true;
+    *added = true;
+    return free_slot;
+}
+
+// Call with the lock held, on the main thread
+static void free_thumbnail(u32 index) {
+    Thumbnail& t = g_cover_art.thumbnails[index];
+    if (t.in_atlas) g_cover_art.pages[t.page].cells[t.cell] = 0;
+    if (t.texture) destroy_texture(&t.texture);
+    if (t.state == THUMBNAIL_STATE_DECODED) free_image(&t.image);
+    t.texture = NULL;
+    t.in_use = false;
+}
+
+// Call with the lock held, on the main thread. Finds a cell for the
+// thumbnail, adding a page or evicting the least recently drawn
+// unreferenced thumbnail if there are no free ones
+static bool add_to_atlas(u32 index) {
+    Thumbnail& t = g_cover_art.thumbnails[index];
+    const i32 cell_size = THUMBNAIL_PIXEL_SIZES[t.size];
+    u32 page_index = UINT32_MAX;
+    u32 cell = UINT32_MAX;
+
+    if (t.image.width > cell_size || t.image.height > cell_size) return false;
+
+    for (u32 p = 0; p < g_cover_art.pages.count && cell == UINT32_MAX; ++p) {
+        const Atlas_Page& page = g_cover_art.pages[p];
+        if (page.size != t.size) continue;
+        for (u32 c = 0; c < page.cells.count; ++c) {
+            if (!page.cells[c]) {
+                page_index = p;
+                cell = c;
+                break;
+            }
+        }
+    }
+
+    if (cell == UINT32_MAX && g_cover_art.pages.count < COVER_ART_ATLAS_MAX_PAGES) {
+        Atlas_Page page = {};
+        page.texture = create_streaming_texture(COVER_ART_ATLAS_SIZE, COVER_ART_ATLAS_SIZE);
+        if (page.texture) {
+            page.size = t.size;
+            page.cells_per_row = COVER_ART_ATLAS_SIZE / cell_size;
+            for (u32 c = 0; c < page.cells_per_row * page.cells_per_row; ++c) page.cells.append(0);
+            page_index = g_cover_art.pages.append(page);
+            cell = 0;
+        }
+    }
+
+    if (cell == UINT32_MAX) {
+        u32 victim = UINT32_MAX;
+        for (u32 i = 0; i < g_cover_art.thumbnails.count; ++i) {
+            const Thumbnail& v = g_cover_art.thumbnails[i];
+            if (!v.in_use || !v.in_atlas || v.refs || v.size != t.size) continue;
+            if (victim == UINT32_MAX || v.last_used_frame < g_cover_art.thumbnails[victim].last_used_frame) {
+                victim = i;
+            }
+        }
+        if (victim == UINT32_MAX) return false;
+
+        page_index = g_cover_art.thumbnails[victim].page;
+        cell = g_cover_art.thumbnails[victim].cell;
+        free_thumbnail(victim);
+    }
+
+    g_cover_art.pages[page_index].cells[cell] = index + 1;
+    t.page = page_index;
+    t.cell = cell;
+    t.in_atlas = true;
+    return true;
+}
+
+static bool pop_job(Cover_Art_Job *job) {
+    bool have_job = false;
+    lock_mutex(g_cover_art.lock);
+    if (g_cover_art.jobs.count) {
+        *job = g_cover_art.jobs[0];
+        g_cover_art.jobs.ordered_remove(0);
+        have_job = true;
+    }
+    unlock_mutex(g_cover_art.lock);
+    return have_job;
+}
+
+static void run_job(const Cover_Art_Job *job, Array<u8>& picture) {
+    const u64 path_hash = hash_path(job->path);
+    Picture_Memo memo = {};
+    Cover_Art_Size size;
+    u32 thumbnail;
+    bool have_memo;
+    bool added;
+
+    lock_mutex(g_cover_art.lock);
+    if (g_cover_art.requests[job->request].released) {
+        free_request(job->request);
+        unlock_mutex(g_cover_art.lock);
+        return;
+    }
+    size = g_cover_art.requests[job->request].size;
+    {
+        const Picture_Memo *found = find_memo(path_hash);
+        have_memo = found != NULL;
+        if (found) memo = *found;
+    }
+    unlock_mutex(g_cover_art.lock);
+
+    // Only the hash is needed if the thumbnail is already on disk
+    picture.clear();
+    if (!have_memo) {
+        memo.path_hash = path_hash;
+        memo.has_picture = read_file_picture(job->path, &picture);
+        if (memo.has_picture) memo.picture_hash = XXH64(picture.data, picture.count, 0);
+    }
+
+    lock_mutex(g_cover_art.lock);
+    {
+        if (!have_memo && !find_memo(path_hash)) {
+            g_cover_art.memo_index.insert((u32)path_hash, g_cover_art.memos.append(memo));
+        }
+        
+        Cover_Art_Request& request = g_cover_art.requests[job->request];
+        request.pending = false;
+        if (request.released) {
+            free_request(job->request);
+            unlock_mutex(g_cover_art.lock);
+            return;
+        }
+        if (!memo.has_picture) {
+            unlock_mutex(g_cover_art.lock);
+            return;
+        }
+
+        thumbnail = find_or_add_thumbnail(memo.picture_hash, size, &added);
+        g_cover_art.thumbnails[thumbnail].refs++;
+        request.thumbnail = thumbnail + 1;
+    }
+    unlock_mutex(g_cover_art.lock);
+
+    // Someone else already has the picture
+    if (!added) return;
+
+    Image image = {};
+    const bool loaded = load_thumbnail(memo.picture_hash, size, job->path, picture, &image);
+
+    lock_mutex(g_cover_art.lock);
+    Thumbnail& t = g_cover_art.thumbnails[thumbnail];
+    t.image = image;
+    t.state = loaded ? THUMBNAIL_STATE_DECODED : THUMBNAIL_STATE_FAILED;
+    unlock_mutex(g_cover_art.lock);
+}
+
+static int cover_art_worker(void *dont_care) {
+    Array<u8> picture = {};
+
+    while (!g_cover_art.want_quit) {
+        Cover_Art_Job job;
+        if (!pop_job(&job)) {
+            sleep_milliseconds(COVER_ART_IDLE_SLEEP_MS);
+            continue;
+        }
+        run_job(&job, picture);
+    }
+
+    picture.free();
+    return 0;
+}
+
+void cover_art_init() {
+    char path[PATH_LENGTH] = {};
+    snprintf(path, PATH_LENGTH-1, "%s" PATH_SEP_STR "covers", PLATFORM_DATA_PATH);
+    if (!does_file_exist(path)) create_directory(path);
+
+    g_cover_art.lock = create_mutex();
+    g_cover_art.want_quit = false;
+    g_cover_art.worker = thread_create(NULL, &cover_art_worker);
+}
+
+void cover_art_deinit() {
+    g_cover_art.want_quit = true;
+    if (g_cover_art.worker) {
+        thread_join(g_cover_art.worker);
+        thread_destroy(g_cover_art.worker);
+        g_cover_art.worker = NULL;
+    }
+
+    for (Thumbnail& t : g_cover_art.thumbnails) {
+        if (!t.in_use) continue;
+        if (t.texture) destroy_texture(&t.texture);
+        if (t.state == THUMBNAIL_STATE_DECODED) free_image(&t.image);
+    }
+
+    for (Atlas_Page& page : g_cover_art.pages) {
+        destroy_texture(&page.texture);
+        page.cells.free();
+    }
+
+    destroy_mutex(g_cover_art.lock);
+    g_cover_art.requests.free();
+    g_cover_art.thumbnails.free();
+    g_cover_art.jobs.free();
+    g_cover_art.memos.free();
+    g_cover_art.memo_index.free();
+    g_cover_art.pages.free();
+}
+
+void cover_art_update() {
+    u32 uploads = 0;
+
+    lock_mutex(g_cover_art.lock);
+    defer(unlock_mutex(g_cover_art.lock));
+    g_cover_art.frame++;
+
+    for (u32 i = 0; i < g_cover_art.thumbnails.count; ++i) {
+        Thumbnail& t = g_cover_art.thumbnails[i];
+        if (!t.in_use) continue;
+
+        // Thumbnails still being loaded are freed once the worker is done.
+        // Ones in the atlas are kept until their cell is needed
+        if (!t.refs && t.state != THUMBNAIL_STATE_LOADING) {
+            if (!(t.in_atlas && t.state == THUMBNAIL_STATE_READY)) free_thumbnail(i);
+            continue;
+        }
+
+        if (t.state != THUMBNAIL_STATE_DECODED) continue;
+        if (uploads >= COVER_ART_MAX_UPLOADS_PER_FRAME) continue;
+        uploads++;
+
+        // Falls back to a texture of its own if every cell is in use
+        if (uses_atlas(t.size) && add_to_atlas(i)) {
+            const Atlas_Page& page = g_cover_art.pages[t.page];
+            const i32 cell_size = THUMBNAIL_PIXEL_SIZES[t.size];
+            update_texture_region(page.texture,
+                (i32)(t.cell % page.cells_per_row) * cell_size, (i32)(t.cell / page.cells_per_row) * cell_size,
+                t.image.width, t.image.height, t.image.data, t.image.width * 4);
+        }
+        else {
+            t.texture = create_texture_from_image(&t.image);
+        }
+
+        free_image(&t.image);
+        t.image.data = NULL;
+        t.last_used_frame = g_cover_art.frame;
+        t.state = (t.in_atlas || t.texture) ? THUMBNAIL_STATE_READY : THUMBNAIL_STATE_FAILED;
+    }
+}
+
+Cover_Art cover_art_request(const char *path, Cover_Art_Size size) {
+    Cover_Art_Job job;
+    u32 index = UINT32_MAX;
+
+    strncpy0(job.path, path, PATH_LENGTH);
+
+    lock_mutex(g_cover_art.lock);
+    defer(unlock_mutex(g_cover_art.lock));
+
+    for (u32 i = 0; i < g_cover_art.requests.count; ++i) {
+        if (!g_cover_art.requests[i].in_use) {
+            index = i;
+            break;
+        }
+    }
+    if (index == UINT32_MAX) index = g_cover_art.requests.push();
+
+    Cover_Art_Request& request = g_cover_art.requests[index];
+    request = Cover_Art_Request{};
+    request.size = size;
+    request.in_use = true;
+
+    // Use what's already loaded if we know which picture the file has
+    const Picture_Memo *memo = find_memo(hash_path(path));
+    if (memo && !memo->has_picture) return index + 1;
+    if (memo) {
+        const u32 thumbnail = find_thumbnail(memo->picture_hash, size);
+        if (thumbnail != UINT32_MAX) {
+            g_cover_art.thumbnails[thumbnail].refs++;
+            request.thumbnail = thumbnail + 1;
+            return index + 1;
+        }
+    }
+
+    request.pending = true;
+    job.request = index;
+    g_cover_art.jobs.append(job);
+    return index + 1;
+}
+
+void cover_art_release(Cover_Art *art) {
+    if (!*art) return;
+    lock_mutex(g_cover_art.lock);
+    Cover_Art_Request& request = g_cover_art.requests[*art - 1];
+    if (request.pending) request.released = true;
+    else free_request(*art - 1);
+    unlock_mutex(g_cover_art.lock);
+    *art = 0;
+}
+
+bool cover_art_get_image(Cover_Art art, Cover_Art_Image *image) {
+    if (!art) return false;
+    lock_mutex(g_cover_art.lock);
+    defer(unlock_mutex(g_cover_art.lock));
+
+    const Cover_Art_Request& request = g_cover_art.requests[art - 1];
+    if (!request.thumbnail) return false;
+    Thumbnail& t = g_cover_art.thumbnails[request.thumbnail - 1];
+    if (t.state != THUMBNAIL_STATE_READY) return false;
+
+    t.last_used_frame = g_cover_art.frame;
+    image->width = t.image.width;
+    image->height = t.image.height;
+
+    if (t.in_atlas) {
+        const Atlas_Page& page = g_cover_art.pages[t.page];
+        const f32 cell_size = (f32)THUMBNAIL_PIXEL_SIZES[t.size];
+        const f32 x = (f32)(t.cell % page.cells_per_row) * cell_size;
+        const f32 y = (f32)(t.cell / page.cells_per_row) * cell_size;
+        // Inset by half a texel so filtering doesn't pick up the next cell
+        image->texture = page.texture;
+        image->u0 = (x + 0.5f) / COVER_ART_ATLAS_SIZE;
+        image->v0 = (y + 0.5f) / COVER_ART_ATLAS_SIZE;
+        image->u1 = (x + (f32)t.image.width - 0.5f) / COVER_ART_ATLAS_SIZE;
+        image->v1 = (y + (f32)t.image.height - 0.5f) / COVER_ART_ATLAS_SIZE;
+    }
+    else {
+        image->texture = t.texture;
+        image->u0 = 0.f;
+        image->v0 = 0.f;
+        image->u1 = 1.f;
+        image->v1 = 1.f;
+    }
+
+    return true;
+}
+
+Texture *cover_art_get_texture(Cover_Art art) {
+    Cover_Art_Image image;
+    if (!cover_art_get_image(art, &image)) return NULL;
+    ASSERT(image.u0 == 0.f && image.u1 == 1.f);
+    return image.texture;
+}
+
+bool cover_art_is_loading(Cover_Art art) {
+    bool loading = false;
+    if (!art) return false;
+    lock_mutex(g_cover_art.lock);
+    const Cover_Art_Request& request = g_cover_art.requests[art - 1];
+    if (request.pending) loading = true;
+    else if (request.thumbnail) {
+        const u32 state = g_cover_art.thumbnails[request.thumbnail - 1].state;
+        loading = state == THUMBNAIL_STATE_LOADING || state == THUMBNAIL_STATE_DECODED;
+    }
+    unlock_mutex(g_cover_art.lock);
+    return loading;
+}
+
+i32 cover_art_get_pixel_size(Cover_Art_Size size) {
+    return THUMBNAIL_PIXEL_SIZES[size];
+}
@@ -0,0 +1,77 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef COVER_ART_H
+#define COVER_ART_H
+
+// Cover art thumbnails. Pictures are identified by a hash of the embedded
+// picture's bytes, so tracks that share art share one thumbnail. Each
+// picture is downscaled once per size and the result is kept on disk.
+// Reading and decoding happen on a worker, uploading is done by
+// cover_art_update() on the main thread.
+//
+// Small and medium thumbnails are packed into shared atlas textures so
+// grids of covers draw with few texture binds. Unreferenced thumbnails
+// stay in the atlas until their cell is needed for another one
+
+#include "defines.h"
+#include "video.h"
+
+#define COVER_ART_ATLAS_SIZE 2048
+// Limits atlas memory to 16MB per page
+#define COVER_ART_ATLAS_MAX_PAGES 4
+// Keeps the cost of a burst of finished thumbnails off any one frame
+#define COVER_ART_MAX_UPLOADS_PER_FRAME 16
+
+enum Cover_Art_Size {
+    COVER_ART_SIZE_SMALL,
+    COVER_ART_SIZE_MEDIUM,
+    // Gets its own texture
+    COVER_ART_SIZE_LARGE,
+    COVER_ART_SIZE__COUNT,
+};
+
+// 0 is no cover art
+typedef u32 Cover_Art;
+
+struct Cover_Art_Image {
+    Texture *texture;
+    // Corners of the thumbnail within the texture
+    f32 u0, v0, u1, v1;
+    i32 width, height;
+};
+
+void cover_art_init();
+void cover_art_deinit();
+// Call once per frame from the main thread, before any cover art is drawn.
+// Uploads finished thumbnails and frees unreferenced ones
+void cover_art_update();
+// Starts loading the cover art of the file at path in the background.
+// Art that is already loaded is available straight away
+Cover_Art cover_art_request(const char *path, Cover_Art_Size size);
+// Sets art to 0. The texture stays valid until the next cover_art_update()
+void cover_art_release(Cover_Art *art);
+// Returns false while loading or if the file has no cover art
+bool cover_art_get_image(Cover_Art art, Cover_Art_Image *image);
+// For COVER_ART_SIZE_LARGE, where the thumbnail is the whole texture.
+// NULL while loading or if the file has no cover art
+Texture *cover_art_get_texture(Cover_Art art);
+bool cover_art_is_loading(Cover_Art art);
+// Width and height that thumbnails of a size fit in
+i32 cover_art_get_pixel_size(Cover_Art_Size size);
+
+#endif //COVER_ART_H
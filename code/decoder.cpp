@@ -92,13 +92,21 @@ void decoder_seek_millis(Decoder *dec, i64 millis) {
     dec->frame_index = sf_seek(dec->file, frame, SEEK_SET);
 }
 
+bool decoder_seek_frame(Decoder *dec, i64 frame) {
+    if (!dec->file) return false;
+    sf_count_t result = sf_seek(dec->file, frame, SEEK_SET);
+    if (result < 0) return false;
+    dec->frame_index = result;
+    return true;
+}
+
 int decoder_get_bitrate(Decoder *dec) {
     if (!dec->file) return 0;
     return sf_current_byterate(dec->file) * 8;
 }
 
 i64 decoder_get_position_millis(Decoder *dec) {
-    return (i64)(dec->frame_index / dec->info.samplerate) * 1000;
+    return (dec->frame_index * 1000) / dec->info.samplerate;
 }
     
     
\ No newline at end of file
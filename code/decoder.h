@@ -42,6 +42,8 @@ void decoder_close(Decoder *dec);
 Decode_Status decoder_decode(Decoder *dec, f32 *buffer, i32 frames, i32 channels, i32 samplerate);
 int decoder_get_bitrate(Decoder *dec);
 void decoder_seek_millis(Decoder *dec, i64 millis);
+// Returns false if the decoder could not seek to the frame
+bool decoder_seek_frame(Decoder *dec, i64 frame);
 i64 decoder_get_position_millis(Decoder *dec);
 
 #endif //DECODER_H
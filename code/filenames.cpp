@@ -17,51 +17,82 @@
 */
 #include "filenames.h"
 #include "array.h"
+#include "platform.h"
 #include <xxhash.h>
 
-static u32 push_string(Array<char>& pool, const char *string, u32 length = 0) {
-    if (length == 0) length = (u32)strlen(string);
+static u32 push_string(Array<char>& pool, const char *string, u32 length = UINT32_MAX) {
+    if (length == UINT32_MAX) length = (u32)strlen(string);
     u32 offset = pool.push(length+1);
     memcpy(&pool[offset], string, length);
     pool[offset+length] = 0;
     return offset;
 }
 
-static i32 lookup_path(const Path_Pool& pool, u32 hash) {
-    for (u32 i = 0; i < pool.files.count; ++i) {
-        if (pool.files[i].hash == hash) return i;
-    }
+// Compares the first length characters of string with the whole of
+// the pooled string
+static bool pooled_string_equals(const Path_Pool& pool, u32 offset, const char *string, u32 length) {
+    const char *pooled = &pool.string_pool[offset];
+    return !strncmp(pooled, string, length) && !pooled[length];
+}
+
+// Hashes can collide, so lookups check the full path
+static u32 find_file(const Path_Pool& pool, const char *full_path, u32 full_hash) {
+    const char *filename = get_file_name(full_path);
+    u32 base_path_length = (u32)(filename - full_path);
     
-    return -1;
+    return pool.file_lookup.find(full_hash, [&](u32 index) {
+        const File_Entry& file = pool.files[index];
+        const Folder_Entry& folder = pool.folders[file.folder_index];
+        return pooled_string_equals(pool, folder.name, full_path, base_path_length) &&
+            !strcmp(&pool.string_pool[file.name], filename);
+    });
 }
 
-Path_Index store_file_path(Path_Pool& pool, const char *full_path) {
-    u32 full_hash = hash_string(full_path);
+// folder_path must include the trailing separator
+static u32 find_folder(const Path_Pool& pool, const char *folder_path, u32 length) {
+    u32 folder_hash = XXH32(folder_path, length, 0);
+    return pool.folder_lookup.find(folder_hash, [&](u32 index) {
+        return pooled_string_equals(pool, pool.folders[index].name, folder_path, length);
+    });
+}
+
+i32 lookup_file_path(const Path_Pool& pool, const char *path) {
+    u32 index = find_file(pool, path, hash_string(path));
+    return index == Hash_Index::NOT_FOUND ? -1 : (i32)index;
+}
+
+i32 lookup_folder_path(const Path_Pool& pool, const char *path) {
+    char folder_path[PATH_LENGTH];
+    u32 length = (u32)strlen(path);
+    strncpy0(folder_path, path, PATH_LENGTH - 1);
+    length = MIN(length, (u32)PATH_LENGTH - 2);
     
-    {
-        i32 index = lookup_path(pool, full_hash);
-        if (index >= 0)
-            return index;
+    if (length && folder_path[length - 1] != '/' && folder_path[length - 1] != '\\') {
+        folder_path[length++] = PATH_SEP;
+        folder_path[length] = 0;
     }
     
+    u32 index = find_folder(pool, folder_path, length);
+    return index == Hash_Index::NOT_FOUND ? -1 : (i32)index;
+}
+
+Path_Index store_file_path(Path_Pool& pool, const char *full_path) {
+    u32 full_hash = hash_string(full_path);
     const char *filename = get_file_name(full_path);
     ptrdiff_t base_path_length = filename - full_path;
     ASSERT(base_path_length >= 0);
-    u32 folder_hash = XXH32(full_path, base_path_length, 0);
-    i32 folder_index = -1;
     
-    for (u32 i = 0; i < pool.folders.count; ++i) {
-        if (pool.folders[i].hash == folder_hash) {
-            folder_index = i;
-            break;
-        }
-    }
+    u32 existing_index = find_file(pool, full_path, full_hash);
+    if (existing_index != Hash_Index::NOT_FOUND) return existing_index;
+    
+    u32 folder_index = find_folder(pool, full_path, (u32)base_path_length);
     
-    if (folder_index < 0) {
+    if (folder_index == Hash_Index::NOT_FOUND) {
         Folder_Entry folder = {};
         folder.name = push_string(pool.string_pool, full_path, (u32)base_path_length);
-        folder.hash = folder_hash;
+        folder.hash = XXH32(full_path, base_path_length, 0);
         folder_index = pool.folders.append(folder);
+        pool.folder_lookup.insert(folder.hash, folder_index);
     }
     
     File_Entry file = {};
@@ -70,7 +101,9 @@ Path_Index store_file_path(Path_Pool& pool, const char *full_path) {
     file.folder_index = folder_index;
     pool.folders[file.folder_index].file_count++;
     
-    return pool.files.append(file);
+    Path_Index index = pool.files.append(file);
+    pool.file_lookup.insert(full_hash, index);
+    return index;
 }
 
 Path_Index store_file_path(Path_Pool& pool, const wchar_t *path) {
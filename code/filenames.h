@@ -20,6 +20,7 @@
 
 #include "defines.h"
 #include "array.h"
+#include "hash_index.h"
 #include <string.h>
 
 typedef u32 Path_Index;
@@ -42,10 +43,18 @@ struct Path_Pool {
     Array<Folder_Entry> folders;
     Array<File_Entry> files;
     Array<char> string_pool;
+    // Hash of the full path to file index, and hash of the folder to
+    // folder index
+    Hash_Index file_lookup;
+    Hash_Index folder_lookup;
 };
 
 Path_Index store_file_path(Path_Pool& pool, const char *path);
 Path_Index store_file_path(Path_Pool& pool, const wchar_t *path);
+// Return -1 if the path isn't in the pool. Folder paths may leave out the
+// trailing separator
+i32 lookup_file_path(const Path_Pool& pool, const char *path);
+i32 lookup_folder_path(const Path_Pool& pool, const char *path);
 void retrieve_file_path(const Path_Pool& pool, Path_Index index, char *buffer, u32 buffer_size);
 void retrieve_file_path(const Path_Pool& pool, Path_Index index, wchar_t *buffer, u32 buffer_size);
 
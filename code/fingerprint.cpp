@@ -0,0 +1,280 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fingerprint.h"
+#include "metadata.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define LOWEST_BAND_HZ 300.f
+#define HIGHEST_BAND_HZ 2000.f
+#define HOP_SECONDS 0.186f
+// Samples quieter than this before the start of the track are skipped
+#define SILENCE_THRESHOLD 0.001f
+// Largest misalignment in frames tried when comparing fingerprints
+#define MAX_ALIGNMENT_OFFSET 2
+// Sub-fingerprints found in more tracks than this say nothing about
+// which track they came from
+#define MAX_BUCKET_SIZE 32
+
+static inline u32 count_bits(u32 v) {
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+void fingerprinter_init(Fingerprinter *fp, i32 sample_rate) {
+    *fp = {};
+    fp->decimation = MAX(1, sample_rate / FINGERPRINT_TARGET_SAMPLE_RATE);
+    fp->sample_rate = sample_rate / (i32)fp->decimation;
+    fp->hop_size = (u32)((f32)fp->sample_rate * HOP_SECONDS);
+
+    // Log spaced bands with edges from LOWEST_BAND_HZ to HIGHEST_BAND_HZ
+    const f32 ratio = powf(HIGHEST_BAND_HZ / LOWEST_BAND_HZ, 1.f / (f32)FINGERPRINT_BANDS);
+    for (u32 band = 0; band < FINGERPRINT_BANDS; ++band) {
+        f32 low = LOWEST_BAND_HZ * powf(ratio, (f32)band);
+        f32 high = low * ratio;
+        f32 center = sqrtf(low * high);
+        f32 q = center / (high - low);
+        f32 w0 = 2.f * PI * center / (f32)fp->sample_rate;
+        f32 alpha = sinf(w0) / (2.f * q);
+        f32 a0 = 1.f + alpha;
+
+        fp->b0[band] = alpha / a0;
+        fp->a1[band] = (2.f * cosf(w0)) / a0;
+        fp->a2[band] = -(1.f - alpha) / a0;
+    }
+}
+
+static void end_hop(Fingerprinter *fp) {
+    f32 diff[FINGERPRINT_BANDS - 1];
+    f32 frame_energy[FINGERPRINT_BANDS];
+
+    for (u32 band = 0; band < FINGERPRINT_BANDS; ++band) {
+        frame_energy[band] = fp->hop_energy[band] + fp->prev_hop_energy[band];
+    }
+
+    for (u32 band = 0; band + 1 < FINGERPRINT_BANDS; ++band) {
+        diff[band] = frame_energy[band] - frame_energy[band + 1];
+    }
+
+    // The first hop only fills the first frame, and the first frame only
+    // gives the second something to compare against
+    if (fp->hop_count >= 2) {
+        u32 bits = 0;
+        for (u32 band = 0; band + 1 < FINGERPRINT_BANDS; ++band) {
+            if (diff[band] > fp->prev_frame_diff[band]) bits |= 1u << band;
+        }
+        fp->fingerprint.frames[fp->fingerprint.frame_count++] = bits;
+    }
+
+    memcpy(fp->prev_frame_diff, diff, sizeof(diff));
+    memcpy(fp->prev_hop_energy, fp->hop_energy, sizeof(fp->hop_energy));
+    zero_array(fp->hop_energy, FINGERPRINT_BANDS);
+    fp->hop_fill = 0;
+    fp->hop_count++;
+}
+
+static void process_sample(Fingerprinter *fp, f32 x) {
+    if (!fp->started) {
+        if (fabsf(x) < SILENCE_THRESHOLD) return;
+        fp->started = true;
+    }
+
+    for (u32 band = 0; band < FINGERPRINT_BANDS; ++band) {
+        f32 y = (fp->b0[band] * x) + fp->z1[band];
+        fp->z1[band] = (fp->a1[band] * y) + fp->z2[band];
+        fp->z2[band] = (fp->a2[band] * y) - (fp->b0[band] * x);
+        fp->hop_energy[band] += y * y;
+    }
+
+    if (++fp->hop_fill == fp->hop_size) end_hop(fp);
+}
+
+void fingerprinter_process(Fingerprinter *fp, const f32 *samples, u32 frame_count, i32 channels) {
+    const f32 channel_scale = 1.f / (f32)channels;
+    const f32 decimation_scale = 1.f / (f32)fp->decimation;
+
+    for (u32 i = 0; i < frame_count && !fingerprinter_is_done(fp); ++i) {
+        const f32 *frame = &samples[i * channels];
+        f32 mono = 0.f;
+        for (i32 ch = 0; ch < channels; ++ch) mono += frame[ch];
+
+        fp->decimation_sum += mono * channel_scale;
+        if (++fp->decimation_fill == fp->decimation) {
+            process_sample(fp, fp->decimation_sum * decimation_scale);
+            fp->decimation_sum = 0.f;
+            fp->decimation_fill = 0;
+        }
+    }
+}
+
+f32 compare_fingerprints(const Fingerprint *a, const Fingerprint *b) {
+    f32 best = 1.f;
+
+    for (i32 offset = -MAX_ALIGNMENT_OFFSET; offset <= MAX_ALIGNMENT_OFFSET; ++offset) {
+        // Frame i of a lines up with frame i + offset of b
+        i32 first = MAX(0, -offset);
+        i32 last = MIN((i32)a->frame_count, (i32)b->frame_count - offset);
+        if (last - first < FINGERPRINT_MIN_FRAMES) continue;
+
+        u32 differing_bits = 0;
+        for (i32 i = first; i < last; ++i) {
+            differing_bits += count_bits(a->frames[i] ^ b->frames[i + offset]);
+        }
+
+        best = MIN(best, (f32)differing_bits / (f32)((last - first) * (FINGERPRINT_BANDS - 1)));
+    }
+
+    return best;
+}
+
+void fingerprint_index_add(Fingerprint_Index *index, u32 id, const Fingerprint *fp) {
+    for (u32 i = 0; i < fp->frame_count; ++i) {
+        // Silence sets no bits
+        if (!fp->frames[i]) continue;
+        Fingerprint_Index_Entry entry = {fp->frames[i], id};
+        index->entries.append(entry);
+    }
+}
+
+static int compare_index_entries(const void *lhs, const void *rhs) {
+    const Fingerprint_Index_Entry *a = (const Fingerprint_Index_Entry*)lhs;
+    const Fingerprint_Index_Entry *b = (const Fingerprint_Index_Entry*)rhs;
+    if (a->sub_fingerprint != b->sub_fingerprint) return a->sub_fingerprint < b->sub_fingerprint ? -1 : 1;
+    if (a->id != b->id) return a->id < b->id ? -1 : 1;
+    return 0;
+}
+
+void fingerprint_index_finalize(Fingerprint_Index *index) {
+    qsort(index->entries.data, index->entries.count, sizeof(Fingerprint_Index_Entry), &compare_index_entries);
+}
+
+// Index of the first entry with the sub-fingerprint, or the entry count
+static u32 find_first_entry(const Fingerprint_Index *index, u32 sub_fingerprint) {
+    u32 low = 0;
+    u32 high = index->entries.count;
+    while (low < high) {
+        u32 mid = low + (high - low) / 2;
+        if (index->entries.data[mid].sub_fingerprint < sub_fingerprint) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+void fingerprint_index_lookup(const Fingerprint_Index *index, const Fingerprint *fp, Array<u32>& candidates) {
+    const u32 entry_count = index->entries.count;
+    const Fingerprint_Index_Entry *entries = index->entries.data;
+
+    for (u32 i = 0; i < fp->frame_count; ++i) {
+        const u32 sub_fingerprint = fp->frames[i];
+        if (!sub_fingerprint) continue;
+
+        u32 first = find_first_entry(index, sub_fingerprint);
+        u32 last = first;
+        while (last < entry_count && entries[last].sub_fingerprint == sub_fingerprint) last++;
+        if (last - first > MAX_BUCKET_SIZE) continue;
+
+        for (u32 e = first; e < last; ++e) candidates.append_unique(entries[e].id);
+    }
+}
+
+void fingerprint_index_free(Fingerprint_Index *index) {
+    index->entries.free();
+}
+
+static u32 find_group(Array<u32>& parents, u32 i) {
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+static int compare_u64(const void *lhs, const void *rhs) {
+    u64 a = *(const u64*)lhs;
+    u64 b = *(const u64*)rhs;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+void find_duplicate_tracks(Array<Track>& out_tracks, Array<u32>& out_group_starts) {
+    const u32 track_count = library_get_track_count();
+    Array<Fingerprint> fingerprints = {};
+    Array<Track> owners = {};
+    Array<u32> parents = {};
+    Array<u32> candidates = {};
+    Array<u64> sorted = {};
+    Fingerprint_Index index = {};
+    defer(fingerprints.free());
+    defer(owners.free());
+    defer(parents.free());
+    defer(candidates.free());
+    defer(sorted.free());
+    defer(fingerprint_index_free(&index));
+
+    out_tracks.clear();
+    out_group_starts.clear();
+
+    START_TIMER(find_duplicates, "Find duplicate tracks");
+
+    for (Track track = 1; track <= track_count; ++track) {
+        Fingerprint fp;
+        if (!retrieve_metadata_fingerprint(library_get_track_metadata_index(track), &fp)) continue;
+        if (fp.frame_count < FINGERPRINT_MIN_FRAMES) continue;
+        u32 id = fingerprints.append(fp);
+        owners.append(track);
+        parents.append(id);
+        fingerprint_index_add(&index, id, &fp);
+    }
+
+    fingerprint_index_finalize(&index);
+
+    // Only compare each pair once, from the lower ID
+    for (u32 id = 0; id < fingerprints.count; ++id) {
+        candidates.clear();
+        fingerprint_index_lookup(&index, &fingerprints[id], candidates);
+        for (u32 other : candidates) {
+            if (other <= id) continue;
+            if (compare_fingerprints(&fingerprints[id], &fingerprints[other]) > FINGERPRINT_MATCH_THRESHOLD) continue;
+            u32 a = find_group(parents, id);
+            u32 b = find_group(parents, other);
+            if (a != b) parents[MAX(a, b)] = MIN(a, b);
+        }
+    }
+
+    // Sort by group, then by ID so groups stay in library order
+    for (u32 id = 0; id < fingerprints.count; ++id) {
+        sorted.append(((u64)find_group(parents, id) << 32) | id);
+    }
+    qsort(sorted.data, sorted.count, sizeof(u64), &compare_u64);
+
+    for (u32 first = 0; first < sorted.count;) {
+        u32 group = (u32)(sorted[first] >> 32);
+        u32 last = first + 1;
+        while (last < sorted.count && (u32)(sorted[last] >> 32) == group) last++;
+
+        if (last - first > 1) {
+            out_group_starts.append(out_tracks.count);
+            for (u32 i = first; i < last; ++i) out_tracks.append(owners[(u32)sorted[i]]);
+        }
+
+        first = last;
+    }
+
+    STOP_TIMER(find_duplicates);
+    log_info("Found %u groups of duplicate tracks\n", out_group_starts.count);
+}
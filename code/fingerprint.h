@@ -0,0 +1,113 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+// Compact acoustic fingerprints for finding the same recording under
+// different paths, formats or tags. Audio is mixed down to mono and
+// decimated to around 11kHz, then split into bands between 300Hz and 2kHz.
+// Each sub-fingerprint holds one bit per pair of neighbouring bands: whether
+// the energy difference between them grew since the previous frame.
+// Fingerprinting starts at the first audible sample so leading silence and
+// encoder delay don't throw off the alignment
+
+#include "defines.h"
+#include "array.h"
+#include "library.h"
+
+#define FINGERPRINT_TARGET_SAMPLE_RATE 11025
+#define FINGERPRINT_FRAMES 128
+#define FINGERPRINT_BANDS 33
+// Fingerprints shorter than this aren't reliable enough to match
+#define FINGERPRINT_MIN_FRAMES 16
+// Fraction of bits that can differ between two fingerprints of the same
+// recording. Unrelated audio differs in about half
+#define FINGERPRINT_MATCH_THRESHOLD 0.25f
+
+struct Fingerprint {
+    u32 frame_count;
+    u32 frames[FINGERPRINT_FRAMES];
+};
+
+struct Fingerprinter {
+    i32 sample_rate;
+    // Input frames averaged into each mono sample
+    u32 decimation;
+    u32 decimation_fill;
+    f32 decimation_sum;
+    bool started;
+
+    // Band-pass biquads, a1 and a2 are negated
+    f32 b0[FINGERPRINT_BANDS];
+    f32 a1[FINGERPRINT_BANDS];
+    f32 a2[FINGERPRINT_BANDS];
+    f32 z1[FINGERPRINT_BANDS];
+    f32 z2[FINGERPRINT_BANDS];
+
+    // Each frame overlaps the previous one by a hop
+    u32 hop_size;
+    u32 hop_fill;
+    u32 hop_count;
+    f32 hop_energy[FINGERPRINT_BANDS];
+    f32 prev_hop_energy[FINGERPRINT_BANDS];
+    f32 prev_frame_diff[FINGERPRINT_BANDS - 1];
+
+    Fingerprint fingerprint;
+};
+
+// sample_rate is the rate of the audio that will be passed to fingerprinter_process
+void fingerprinter_init(Fingerprinter *fp, i32 sample_rate);
+// Feeds interleaved samples into the fingerprinter
+void fingerprinter_process(Fingerprinter *fp, const f32 *samples, u32 frame_count, i32 channels);
+static inline bool fingerprinter_is_done(const Fingerprinter *fp) {
+    return fp->fingerprint.frame_count == FINGERPRINT_FRAMES;
+}
+
+// Fraction of differing bits at the best alignment of a against b.
+// Returns 1 if the fingerprints are too short to compare
+f32 compare_fingerprints(const Fingerprint *a, const Fingerprint *b);
+
+// Maps sub-fingerprints to the fingerprints they appear in, by an ID chosen
+// by the caller. Two fingerprints of
+// the same recording almost always share at least one sub-fingerprint
+// exactly, so candidates are found by exact lookup and then confirmed
+// with compare_fingerprints
+struct Fingerprint_Index_Entry {
+    u32 sub_fingerprint;
+    u32 id;
+};
+
+struct Fingerprint_Index {
+    // Sorted by sub-fingerprint once fingerprint_index_finalize is called
+    Array<Fingerprint_Index_Entry> entries;
+};
+
+void fingerprint_index_add(Fingerprint_Index *index, u32 id, const Fingerprint *fp);
+// Call after adding fingerprints and before lookups
+void fingerprint_index_finalize(Fingerprint_Index *index);
+// Appends the ID of every fingerprint sharing a sub-fingerprint with fp.
+// Candidates are unique but may include fp's own ID
+void fingerprint_index_lookup(const Fingerprint_Index *index, const Fingerprint *fp, Array<u32>& candidates);
+void fingerprint_index_free(Fingerprint_Index *index);
+
+// Groups library tracks with matching fingerprints. out_tracks is filled
+// group by group, out_group_starts with the index of each group's first
+// track in out_tracks. Tracks without a fingerprint are ignored
+void find_duplicate_tracks(Array<Track>& out_tracks, Array<u32>& out_group_starts);
+
+#endif //FINGERPRINT_H
@@ -0,0 +1,112 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+// Open addressing index from 32-bit hashes to u32 values, with linear
+// probing. Keys aren't stored, so every value with a matching hash is
+// offered to the caller's predicate to compare the full key. Zero
+// initialized is an empty index
+
+#include "defines.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct Hash_Index {
+    static constexpr u32 NOT_FOUND = UINT32_MAX;
+    static constexpr u32 MIN_CAPACITY = 256;
+    // Slots are empty when their value is NOT_FOUND
+    u32 *hashes;
+    u32 *values;
+    u32 capacity;
+    u32 count;
+
+    // Returns the first value with a matching hash that pred(value) accepts,
+    // or NOT_FOUND
+    template<typename Pred>
+    INLINE u32 find(u32 hash, Pred pred) const {
+        if (!capacity) return NOT_FOUND;
+        const u32 mask = capacity - 1;
+        for (u32 slot = hash & mask; values[slot] != NOT_FOUND; slot = (slot + 1) & mask) {
+            if (hashes[slot] == hash && pred(values[slot])) return values[slot];
+        }
+        return NOT_FOUND;
+    }
+
+    // Doesn't check whether the key is already present
+    INLINE void insert(u32 hash, u32 value) {
+        ASSERT(value != NOT_FOUND);
+        // Keep the load factor at or below 1/2 so probe chains stay short
+        if ((count + 1) * 2 > capacity) grow();
+        const u32 mask = capacity - 1;
+        u32 slot = hash & mask;
+        while (values[slot] != NOT_FOUND) slot = (slot + 1) & mask;
+        hashes[slot] = hash;
+        values[slot] = value;
+        count++;
+    }
+
+    INLINE void clear() {
+        for (u32 i = 0; i < capacity; ++i) values[i] = NOT_FOUND;
+        count = 0;
+    }
+
+    // Replaces the index with a copy of slots saved from another index.
+    // capacity must be a power of 2
+    INLINE void load(const u32 *saved_hashes, const u32 *saved_values, u32 saved_capacity, u32 saved_count) {
+        free();
+        if (!saved_capacity) return;
+        hashes = (u32*)malloc(saved_capacity * sizeof(u32));
+        values = (u32*)malloc(saved_capacity * sizeof(u32));
+        memcpy(hashes, saved_hashes, saved_capacity * sizeof(u32));
+        memcpy(values, saved_values, saved_capacity * sizeof(u32));
+        capacity = saved_capacity;
+        count = saved_count;
+    }
+
+    INLINE void free() {
+        ::free(hashes);
+        ::free(values);
+        hashes = NULL;
+        values = NULL;
+        capacity = 0;
+        count = 0;
+    }
+
+private:
+    void grow() {
+        u32 *old_hashes = hashes;
+        u32 *old_values = values;
+        u32 old_capacity = capacity;
+
+        capacity = capacity ? capacity * 2 : MIN_CAPACITY;
+        hashes = (u32*)malloc(capacity * sizeof(u32));
+        values = (u32*)malloc(capacity * sizeof(u32));
+        count = 0;
+        clear();
+
+        for (u32 i = 0; i < old_capacity; ++i) {
+            if (old_values[i] != NOT_FOUND) insert(old_hashes[i], old_values[i]);
+        }
+
+        ::free(old_hashes);
+        ::free(old_values);
+    }
+};
+
+#endif //HASH_INDEX_H
@@ -18,34 +18,432 @@
 #include "library.h"
 #include "filenames.h"
 #include "array.h"
+#include "os.h"
+#include "hash_index.h"
+#include <atomic>
+#include <xxhash.h>
+
+#define IMPORT_WORKER_COUNT 8
+// Workers can read this many files ahead of the files being added
+#define IMPORT_WINDOW 1024
 
 struct Library {
     Array<Path_Index> paths;
     Array<Metadata_Index> metadata;
+    // Track for each path in g_path_pool, 0 if the path isn't in the library
+    Array<Track> tracks_by_path;
+};
+
+struct Library_Watch {
+    Folder_Watcher watcher;
+    // Folders being watched, to tell if they changed
+    Array<char> folders;
+    Mutex lock;
+    // Guarded by lock. One entry per path, with the latest event for it
+    Array<char> string_pool;
+    Array<u32> paths;
+    Array<int> events;
+    Hash_Index lookup;
+    u64 last_event_time;
+    bool overflowed;
+};
+
+// Tags of files from watched folders, read on a worker
+struct File_Updates {
+    Thread worker;
+    std::atomic_bool done;
+    std::atomic_bool want_cancel;
+    // Left to the worker while it runs
+    Array<char> string_pool;
+    Array<u32> paths;
+    // 0 for files that aren't in the library yet
+    Array<Track> tracks;
+    Array<Metadata> tags;
 };
 
 static Library g_library;
 static Path_Pool g_path_pool;
+static Library_Watch g_watch;
+static File_Updates g_file_updates;
+
+struct Import_Slot {
+    Metadata md;
+    std::atomic_bool ready;
+};
+
+struct Import_State {
+    const char *string_pool;
+    const u32 *paths;
+    u32 count;
+    // Paths whose metadata is already known don't need their tags read
+    Array<bool> need_tags;
+    // IMPORT_WINDOW slots, file i goes in slot i % IMPORT_WINDOW
+    Import_Slot *slots;
+    std::atomic_uint32_t next;
+    std::atomic_uint32_t committed;
+};
 
-Track library_add_track(const char *path) {
+Track library_add_track(const char *path, const Metadata *md) {
     if (!is_supported_file(path)) return 0;
 
     Path_Index path_index = store_file_path(g_path_pool, path);
-    i32 existing_index = g_library.paths.lookup(path_index);
-    if (existing_index >= 0) return existing_index+1;
-    Metadata_Index md_index = read_file_metadata(path);
+    Track existing = library_get_track_from_path_index(path_index);
+    if (existing) return existing;
+    Metadata_Index md_index = md ? add_file_metadata(path, md) : read_file_metadata(path);
 
     u32 index = g_library.paths.append(path_index);
     g_library.metadata.append(md_index);
 
+    while (g_library.tracks_by_path.count <= path_index) g_library.tracks_by_path.append(0);
+    g_library.tracks_by_path[path_index] = index + 1;
+
     return index + 1;
 }
 
+static int import_worker(void *data) {
+    Import_State *state = (Import_State*)data;
+
+    while (true) {
+        u32 i = state->next++;
+        if (i >= state->count) break;
+
+        // Wait for the slot to be free
+        while (i >= state->committed + IMPORT_WINDOW) sleep_milliseconds(1);
+
+        Import_Slot *slot = &state->slots[i % IMPORT_WINDOW];
+        if (state->need_tags[i]) read_file_tags(&state->string_pool[state->paths[i]], &slot->md);
+        slot->ready = true;
+    }
+
+    return 0;
+}
+
+void library_import_files(const char *string_pool, const u32 *paths, u32 count,
+                          Library_Import_Callback *callback, void *user_data) {
+    Import_State state;
+    Thread workers[IMPORT_WORKER_COUNT] = {};
+    state.string_pool = string_pool;
+    state.paths = paths;
+    state.count = count;
+    state.need_tags = {};
+    state.slots = (Import_Slot*)calloc(IMPORT_WINDOW, sizeof(Import_Slot));
+    state.next = 0;
+    state.committed = 0;
+    defer(state.need_tags.free());
+    defer(free(state.slots));
+
+    for (u32 i = 0; i < count; ++i) {
+        const char *path = &string_pool[paths[i]];
+        state.need_tags.append(is_supported_file(path) && !find_file_metadata(path));
+    }
+
+    for (u32 i = 0; i < IMPORT_WORKER_COUNT && i < count; ++i) {
+        workers[i] = thread_create(&state, &import_worker);
+    }
+
+    // Files are added here, in order, as soon as their tags are read
+    for (u32 i = 0; i < count; ++i) {
+        Import_Slot *slot = &state.slots[i % IMPORT_WINDOW];
+        while (!slot->ready) sleep_milliseconds(1);
+
+        Track track = library_add_track(&string_pool[paths[i]], state.need_tags[i] ? &slot->md : NULL);
+        slot->ready = false;
+        state.committed = i + 1;
+        callback(user_data, track);
+    }
+
+    for (u32 i = 0; i < IMPORT_WORKER_COUNT; ++i) {
+        if (!workers[i]) continue;
+        thread_join(workers[i]);
+        thread_destroy(workers[i]);
+    }
+}
+
+struct Rescan_Files {
+    Array<char> string_pool;
+    Array<u32> paths;
+};
+
+static Recurse_Command new_file_iterator(void *files_ptr, const char *path, bool is_folder) {
+    Rescan_Files *files = (Rescan_Files*)files_ptr;
+
+    if (is_folder) {
+        // Known folders are visited on their own
+        if (lookup_folder_path(g_path_pool, path) < 0) for_each_file_in_folder(path, &new_file_iterator, files);
+    }
+    else if (is_supported_file(path) && !library_find_track(path)) {
+        u32 length = (u32)strlen(path);
+        u32 offset = files->string_pool.push(length + 1);
+        memcpy(&files->string_pool[offset], path, length + 1);
+        files->paths.append(offset);
+    }
+
+    return RECURSE_CONTINUE;
+}
+
+static void reread_track_tags(Library_Rescan *rescan, Track track, const char *path, const Metadata& old_md) {
+    const Metadata_Index md_index = g_library.metadata[track-1];
+    Library_Track_Update update;
+    Metadata md;
+
+    update.track = track;
+    update.old_md = old_md;
+    read_file_tags(path, &md);
+    refresh_metadata(md_index, &md);
+    retrieve_metadata(md_index, &update.new_md);
+    rescan->updated.append(update);
+}
+
+void library_rescan(Library_Rescan *rescan, Library_Import_Callback *callback, void *user_data) {
+    const u32 track_count = g_library.paths.count;
+    const u32 folder_count = g_path_pool.folders.count;
+    Rescan_Files new_files = {};
+    defer(new_files.string_pool.free());
+    defer(new_files.paths.free());
+
+    rescan->missing.clear();
+    rescan->updated.clear();
+    rescan->added_count = 0;
+
+    START_TIMER(rescan, "Rescan library");
+
+    for (Track track = 1; track <= track_count; ++track) {
+        Metadata_Index md_index = g_library.metadata[track-1];
+        char path[PATH_LENGTH];
+        Metadata md;
+        File_Stat stat;
+
+        library_get_track_path(track, path);
+        retrieve_metadata(md_index, &md);
+
+        if (!get_file_stat(path, &stat)) {
+            rescan->missing.append(track);
+        }
+        else if (!(md.flags & METADATA_FLAG_EXTENDED_TAGS)) {
+            // Stored before the extended tags were. Reading sets the flag
+            // whether or not it works, so this happens once
+            reread_track_tags(rescan, track, path, md);
+        }
+        else if (!md.file_size && !md.modified_time) {
+            // Stored before sizes were tracked, assume nothing changed
+            set_metadata_file_stat(md_index, stat.size, stat.modified_time);
+        }
+        else if (stat.size != md.file_size || stat.modified_time != md.modified_time) {
+            reread_track_tags(rescan, track, path, md);
+        }
+    }
+
+    // Look for new files in every folder the library has files in
+    for (u32 folder_index = 0; folder_index < folder_count; ++folder_index) {
+        char folder[PATH_LENGTH];
+        strncpy0(folder, &g_path_pool.string_pool[g_path_pool.folders[folder_index].name], PATH_LENGTH);
+        u32 length = (u32)strlen(folder);
+        // Folders are stored with a trailing separator
+        if (length > 1) folder[length - 1] = 0;
+        for_each_file_in_folder(folder, &new_file_iterator, &new_files);
+    }
+
+    rescan->added_count = new_files.paths.count;
+    library_import_files(new_files.string_pool.data, new_files.paths.data, new_files.paths.count,
+                         callback, user_data);
+
+    STOP_TIMER(rescan);
+    log_info("Rescan found %u missing, %u changed and %u new files\n",
+             rescan->missing.count, rescan->updated.count, rescan->added_count);
+}
+
+static int file_update_worker(void *dont_care) {
+    File_Updates *updates = &g_file_updates;
+
+    for (u32 i = 0; i < updates->paths.count && !updates->want_cancel; ++i) {
+        read_file_tags(&updates->string_pool[updates->paths[i]], &updates->tags[i]);
+    }
+
+    updates->done = true;
+    return 0;
+}
+
+bool library_begin_file_updates(const char *string_pool, const u32 *paths, u32 count) {
+    File_Updates *updates = &g_file_updates;
+    ASSERT(!updates->worker);
+
+    updates->string_pool.clear();
+    updates->paths.clear();
+    updates->tracks.clear();
+    updates->tags.clear();
+
+    for (u32 i = 0; i < count; ++i) {
+        const char *path = &string_pool[paths[i]];
+        if (!is_supported_file(path)) continue;
+
+        Track track = library_find_track(path);
+        if (track) {
+            Metadata md;
+            File_Stat stat;
+            library_get_track_metadata(track, &md);
+            if (!get_file_stat(path, &stat)) continue;
+            if (stat.size == md.file_size && stat.modified_time == md.modified_time) continue;
+        }
+
+        updates->paths.append(updates->string_pool.append_array(path, (u32)strlen(path) + 1));
+        updates->tracks.append(track);
+    }
+
+    if (!updates->paths.count) return false;
+    updates->tags.push(updates->paths.count);
+    updates->done = false;
+    updates->want_cancel = false;
+    updates->worker = thread_create(NULL, &file_update_worker);
+    return true;
+}
+
+bool library_is_updating_files() {
+    return g_file_updates.worker != NULL;
+}
+
+bool library_finish_file_updates(Library_Update_Callback *updated, Library_Import_Callback *added,
+                                 void *user_data) {
+    File_Updates *updates = &g_file_updates;
+    if (!updates->worker || !updates->done) return false;
+
+    thread_join(updates->worker);
+    thread_destroy(updates->worker);
+    updates->worker = NULL;
+
+    for (u32 i = 0; i < updates->paths.count; ++i) {
+        const char *path = &updates->string_pool[updates->paths[i]];
+        const Track track = updates->tracks[i];
+
+        if (track) {
+            const Metadata_Index md_index = g_library.metadata[track-1];
+            Metadata old_md, new_md;
+            retrieve_metadata(md_index, &old_md);
+            refresh_metadata(md_index, &updates->tags[i]);
+            retrieve_metadata(md_index, &new_md);
+            updated(user_data, track, &old_md, &new_md);
+        }
+        else {
+            added(user_data, library_add_track(path, &updates->tags[i]));
+        }
+    }
+
+    log_info("Updated %u files from watched folders\n", updates->paths.count);
+    return true;
+}
+
+void library_cancel_file_updates() {
+    File_Updates *updates = &g_file_updates;
+    if (!updates->worker) return;
+
+    updates->want_cancel = true;
+    thread_join(updates->worker);
+    thread_destroy(updates->worker);
+    updates->worker = NULL;
+    updates->string_pool.free();
+    updates->paths.free();
+    updates->tracks.free();
+    updates->tags.free();
+}
+
+// Called on the watcher thread
+static void on_folder_event(void *dont_care, const char *path, int event) {
+    lock_mutex(g_watch.lock);
+    defer(unlock_mutex(g_watch.lock));
+
+    g_watch.last_event_time = perf_time_now();
+
+    if (event == FOLDER_EVENT_OVERFLOW) {
+        g_watch.overflowed = true;
+        return;
+    }
+
+    u32 hash = hash_string(path);
+    u32 index = g_watch.lookup.find(hash, [path](u32 candidate) {
+        return !strcmp(&g_watch.string_pool[g_watch.paths[candidate]], path);
+    });
+
+    if (index == Hash_Index::NOT_FOUND) {
+        u32 length = (u32)strlen(path);
+        u32 offset = g_watch.string_pool.push(length + 1);
+        memcpy(&g_watch.string_pool[offset], path, length + 1);
+        index = g_watch.paths.append(offset);
+        g_watch.events.append(event);
+        g_watch.lookup.insert(hash, index);
+    }
+    else {
+        g_watch.events[index] = event;
+    }
+}
+
+void library_watch_folders(const char *const *folders, u32 count) {
+    Array<char> folder_list = {};
+    for (u32 i = 0; i < count; ++i) {
+        folder_list.append_array(folders[i], (u32)strlen(folders[i]) + 1);
+    }
+
+    if (folder_list.count == g_watch.folders.count &&
+        (!folder_list.count || !memcmp(folder_list.data, g_watch.folders.data, folder_list.count))) {
+        folder_list.free();
+        return;
+    }
+
+    if (!g_watch.lock) g_watch.lock = create_mutex();
+    if (g_watch.watcher) destroy_folder_watcher(g_watch.watcher);
+    g_watch.watcher = NULL;
+    g_watch.folders.free();
+    g_watch.folders = folder_list;
+
+    if (count) {
+        g_watch.watcher = create_folder_watcher(folders, count, &on_folder_event, NULL);
+        if (!g_watch.watcher) log_warning("Watching folders isn't supported on this platform\n");
+    }
+}
+
+bool library_take_folder_changes(Library_Changes *changes) {
+    if (!g_watch.lock) return false;
+    lock_mutex(g_watch.lock);
+    defer(unlock_mutex(g_watch.lock));
+
+    if (!g_watch.paths.count && !g_watch.overflowed) return false;
+    if (perf_time_to_millis(perf_time_now() - g_watch.last_event_time) < LIBRARY_WATCH_DEBOUNCE_MS) return false;
+
+    changes->string_pool.clear();
+    changes->changed.clear();
+    changes->removed_files.clear();
+    changes->removed_folders.clear();
+    changes->need_rescan = g_watch.overflowed;
+
+    for (u32 i = 0; i < g_watch.paths.count; ++i) {
+        const char *path = &g_watch.string_pool[g_watch.paths[i]];
+        u32 length = (u32)strlen(path);
+        u32 offset = changes->string_pool.push(length + 1);
+        memcpy(&changes->string_pool[offset], path, length + 1);
+
+        switch (g_watch.events[i]) {
+            case FOLDER_EVENT_CHANGED: changes->changed.append(offset); break;
+            case FOLDER_EVENT_REMOVED: changes->removed_files.append(offset); break;
+            case FOLDER_EVENT_FOLDER_REMOVED: changes->removed_folders.append(offset); break;
+        }
+    }
+
+    g_watch.string_pool.clear();
+    g_watch.paths.clear();
+    g_watch.events.clear();
+    g_watch.lookup.clear();
+    g_watch.overflowed = false;
+
+    return true;
+}
+
+Track library_find_track(const char *path) {
+    i32 path_index = lookup_file_path(g_path_pool, path);
+    if (path_index < 0) return 0;
+    return library_get_track_from_path_index(path_index);
+}
 
 Track library_get_track_from_path_index(Path_Index path_index) {
-    i32 index = g_library.paths.lookup(path_index);
-    if (index < 0) return 0;
-    return index + 1;
+    if (path_index >= g_library.tracks_by_path.count) return 0;
+    return g_library.tracks_by_path[path_index];
 }
 
 void library_get_track_metadata(Track track, Metadata *md) {
@@ -59,6 +457,10 @@ Metadata_Index library_get_track_metadata_index(Track track) {
     return g_library.metadata[track-1];
 }
 
+const Metadata_Index *library_get_metadata_indices() {
+    return g_library.metadata.data;
+}
+
 void library_get_track_path(Track track, char *buffer) {
     ASSERT(track != 0);
     u32 path_index = g_library.paths[track-1];
@@ -68,3 +470,7 @@ void library_get_track_path(Track track, char *buffer) {
 const Path_Pool& library_get_path_pool() {
     return g_path_pool;
 }
+
+u32 library_get_track_count() {
+    return g_library.paths.count;
+}
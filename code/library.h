@@ -22,6 +22,10 @@
 #include "util.h"
 #include "filenames.h"
 
+// Changes in watched folders are held back until they have stopped for this
+// long, so copying in a whole album is imported in one go
+#define LIBRARY_WATCH_DEBOUNCE_MS 1000
+
 // 0 means invalid track
 typedef u32 Track;
 struct Path_Pool;
@@ -41,12 +45,82 @@ static inline bool is_supported_file(const char *path) {
         string_equal_ignoring_case(extension, ".wav");
 }
 
-Track library_add_track(const char *path);
+// If md is given it is used as the track's metadata instead of reading the tags
+Track library_add_track(const char *path, const Metadata *md = NULL);
+// Called for each imported file, in order. track is 0 if the file couldn't be added
+typedef void Library_Import_Callback(void *user_data, Track track);
+// Adds many files at once, reading their tags on a pool of workers. The files
+// are added to the library and passed to callback on the calling thread.
+// paths holds count offsets into string_pool
+void library_import_files(const char *string_pool, const u32 *paths, u32 count,
+                          Library_Import_Callback *callback, void *user_data);
+
+// A track whose tags were read again
+struct Library_Track_Update {
+    Track track;
+    Metadata old_md;
+    Metadata new_md;
+};
+
+struct Library_Rescan {
+    // Tracks whose files no longer exist. They stay in the library, it's
+    // up to the caller to take them out of playlists
+    Array<Track> missing;
+    // For the caller to regroup albums and re-sort playlists
+    Array<Library_Track_Update> updated;
+    u32 added_count;
+};
+// Checks the size and modification time of every track and reads the tags
+// again of files that changed or have no extended tags yet. New files in the library's folders are
+// imported and passed to callback like library_import_files
+void library_rescan(Library_Rescan *rescan, Library_Import_Callback *callback, void *user_data);
+// Called with a track's metadata before and after its tags were read again
+typedef void Library_Update_Callback(void *user_data, Track track, const Metadata *old_md,
+                                     const Metadata *new_md);
+// Starts reading the tags of changed files on a worker, without touching the
+// library. Library files whose size and modification time match the stored
+// ones are skipped, which includes files the tag writer just saved. Returns
+// false if there's nothing to read. Only one update can run at a time
+bool library_begin_file_updates(const char *string_pool, const u32 *paths, u32 count);
+bool library_is_updating_files();
+// Call from the main thread. Once the worker is done, refreshes the tracks
+// already in the library, passing each to updated, and adds the new files,
+// passing each to added. Returns true when that happened
+bool library_finish_file_updates(Library_Update_Callback *updated, Library_Import_Callback *added,
+                                 void *user_data);
+// Waits for the worker and throws away the tags it read
+void library_cancel_file_updates();
+
+// Changes seen in watched folders. Paths are offsets into string_pool
+struct Library_Changes {
+    Array<char> string_pool;
+    Array<u32> changed;
+    Array<u32> removed_files;
+    Array<u32> removed_folders;
+    // Events were dropped, only a full rescan will catch everything
+    bool need_rescan;
+};
+// Watches folders for files changing, replacing the folders watched before.
+// Does nothing if the folders are the same as last time
+void library_watch_folders(const char *const *folders, u32 count);
+// Once no new events have come in for LIBRARY_WATCH_DEBOUNCE_MS, moves
+// everything seen since the last call into changes. Events for the same
+// path are merged. Returns false if there's nothing to take yet
+bool library_take_folder_changes(Library_Changes *changes);
+
+// Returns 0 if the path isn't in the library
+Track library_find_track(const char *path);
 Track library_get_track_from_path_index(Path_Index path_index);
 void library_get_track_metadata(Track track, Metadata *md);
 Metadata_Index library_get_track_metadata_index(Track track);
+// Metadata index of every track, indexed by track-1. Use with
+// get_metadata_columns to read one field of many tracks. Only valid until
+// a track is next added
+const Metadata_Index *library_get_metadata_indices();
 // Buffer must be at least PATH_LENGTH characters
 void library_get_track_path(Track track, char *buffer);
 const Path_Pool& library_get_path_pool();
+// Tracks are numbered 1 to library_get_track_count() inclusive
+u32 library_get_track_count();
 
 #endif
@@ -0,0 +1,202 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "loudness.h"
+#include "simd.h"
+#include <math.h>
+
+// 4x oversampling FIR from BS.1770-4 Annex 2, transposed to 4 phases per tap
+static const f32 TRUE_PEAK_COEFS[TRUE_PEAK_TAPS][4] = {
+    { 0.0017089843750f, -0.0291748046875f, -0.0189208984375f, -0.0083007812500f},
+    { 0.0109863281250f,  0.0292968750000f,  0.0330810546875f,  0.0148925781250f},
+    {-0.0196533203125f, -0.0517578125000f, -0.0582275390625f, -0.0266113281250f},
+    { 0.0332031250000f,  0.0891113281250f,  0.1015625000000f,  0.0476074218750f},
+    {-0.0594482421875f, -0.1665039062500f, -0.2003173828125f, -0.1022949218750f},
+    { 0.1373291015625f,  0.4650878906250f,  0.7797851562500f,  0.9721679687500f},
+    { 0.9721679687500f,  0.7797851562500f,  0.4650878906250f,  0.1373291015625f},
+    {-0.1022949218750f, -0.2003173828125f, -0.1665039062500f, -0.0594482421875f},
+    { 0.0476074218750f,  0.1015625000000f,  0.0891113281250f,  0.0332031250000f},
+    {-0.0266113281250f, -0.0582275390625f, -0.0517578125000f, -0.0196533203125f},
+    { 0.0148925781250f,  0.0330810546875f,  0.0292968750000f,  0.0109863281250f},
+    {-0.0083007812500f, -0.0189208984375f, -0.0291748046875f,  0.0017089843750f},
+};
+
+static void set_biquad(Loudness_Biquad *f, f64 b0, f64 b1, f64 b2, f64 a0, f64 a1, f64 a2) {
+    f->b0 = b0 / a0;
+    f->b1 = b1 / a0;
+    f->b2 = b2 / a0;
+    f->a1 = a1 / a0;
+    f->a2 = a2 / a0;
+    zero_array(f->z1, MAX_AUDIO_CHANNELS);
+    zero_array(f->z2, MAX_AUDIO_CHANNELS);
+}
+
+static INLINE f64 run_biquad(Loudness_Biquad *f, i32 ch, f64 x) {
+    f64 y = f->b0 * x + f->z1[ch];
+    f->z1[ch] = f->b1 * x - f->a1 * y + f->z2[ch];
+    f->z2[ch] = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+void loudness_init(Loudness_Meter *meter, i32 channels, i32 sample_rate, bool keep_blocks) {
+    loudness_free(meter);
+    ASSERT(channels <= MAX_AUDIO_CHANNELS);
+    meter->channels = channels;
+    meter->sample_rate = sample_rate;
+    meter->step_frames = MAX(1, sample_rate / 10);
+    meter->frames_in_step = 0;
+    meter->step_sum = 0.0;
+    meter->step_count = 0;
+    meter->keep_blocks = keep_blocks;
+
+    // 5.1 is L, R, C, LFE, Ls, Rs. The LFE isn't counted and the surrounds
+    // are weighted up
+    for (i32 ch = 0; ch < MAX_AUDIO_CHANNELS; ++ch) meter->channel_weights[ch] = 1.0;
+    if (channels == 6) {
+        meter->channel_weights[3] = 0.0;
+        meter->channel_weights[4] = 1.41;
+        meter->channel_weights[5] = 1.41;
+    }
+
+    // K-weighting filter coefficients for any sample rate, derived from the
+    // 48kHz coefficients in BS.1770
+    {
+        const f64 f0 = 1681.974450955533;
+        const f64 gain = 3.999843853973347;
+        const f64 q = 0.7071752369554196;
+        const f64 k = tan(PI * f0 / (f64)sample_rate);
+        const f64 vh = pow(10.0, gain / 20.0);
+        const f64 vb = pow(vh, 0.4996667741545416);
+        set_biquad(&meter->shelf,
+            vh + vb * k / q + k * k, 2.0 * (k * k - vh), vh - vb * k / q + k * k,
+            1.0 + k / q + k * k, 2.0 * (k * k - 1.0), 1.0 - k / q + k * k);
+    }
+
+    {
+        const f64 f0 = 38.13547087602444;
+        const f64 q = 0.5003270373238773;
+        const f64 k = tan(PI * f0 / (f64)sample_rate);
+        set_biquad(&meter->highpass,
+            1.0, -2.0, 1.0,
+            1.0 + k / q + k * k, 2.0 * (k * k - 1.0), 1.0 - k / q + k * k);
+    }
+}
+
+void loudness_free(Loudness_Meter *meter) {
+    meter->blocks.free();
+}
+
+void loudness_reset(Loudness_Meter *meter) {
+    zero_array(meter->shelf.z1, MAX_AUDIO_CHANNELS);
+    zero_array(meter->shelf.z2, MAX_AUDIO_CHANNELS);
+    zero_array(meter->highpass.z1, MAX_AUDIO_CHANNELS);
+    zero_array(meter->highpass.z2, MAX_AUDIO_CHANNELS);
+    meter->frames_in_step = 0;
+    meter->step_sum = 0.0;
+    meter->step_count = 0;
+    meter->blocks.clear();
+}
+
+// Mean square of the last step_count steps
+static f64 mean_of_last_steps(const Loudness_Meter *meter, u32 step_count) {
+    f64 sum = 0.0;
+    for (u32 i = 1; i <= step_count; ++i) {
+        sum += meter->steps[(meter->step_count - i) % LOUDNESS_SHORT_TERM_STEPS];
+    }
+    return sum / (f64)step_count;
+}
+
+static INLINE void end_frame(Loudness_Meter *meter) {
+    if (++meter->frames_in_step == meter->step_frames) {
+        meter->steps[meter->step_count % LOUDNESS_SHORT_TERM_STEPS] = meter->step_sum / (f64)meter->step_frames;
+        meter->step_count++;
+        meter->step_sum = 0.0;
+        meter->frames_in_step = 0;
+
+        if (meter->keep_blocks && meter->step_count >= 4) {
+            meter->blocks.append((f32)mean_of_last_steps(meter, 4));
+        }
+    }
+}
+
+void loudness_process(Loudness_Meter *meter, const f32 *samples, u32 frame_count) {
+    const i32 channels = meter->channels;
+
+    for (u32 i = 0; i < frame_count; ++i) {
+        const f32 *frame = &samples[i * channels];
+        for (i32 ch = 0; ch < channels; ++ch) {
+            f64 v = run_biquad(&meter->shelf, ch, (f64)frame[ch]);
+            v = run_biquad(&meter->highpass, ch, v);
+            meter->step_sum += meter->channel_weights[ch] * v * v;
+        }
+        end_frame(meter);
+    }
+}
+
+void loudness_process_planar(Loudness_Meter *meter, const f32 *const *samples, u32 frame_count) {
+    const i32 channels = meter->channels;
+
+    for (u32 i = 0; i < frame_count; ++i) {
+        for (i32 ch = 0; ch < channels; ++ch) {
+            f64 v = run_biquad(&meter->shelf, ch, (f64)samples[ch][i]);
+            v = run_biquad(&meter->highpass, ch, v);
+            meter->step_sum += meter->channel_weights[ch] * v * v;
+        }
+        end_frame(meter);
+    }
+}
+
+f32 loudness_get_integrated(const Loudness_Meter *meter) {
+    // Absolute gate
+    f64 sum = 0.0;
+    u32 count = 0;
+    for (f32 block : meter->blocks) {
+        if (loudness_from_mean_square(block) > LOUDNESS_SILENCE) {
+            sum += block;
+            count++;
+        }
+    }
+    if (!count) return LOUDNESS_SILENCE;
+
+    // Relative gate
+    const f32 threshold = loudness_from_mean_square(sum / (f64)count) - 10.f;
+    sum = 0.0;
+    count = 0;
+    for (f32 block : meter->blocks) {
+        if (loudness_from_mean_square(block) > threshold) {
+            sum += block;
+            count++;
+        }
+    }
+    if (!count) return LOUDNESS_SILENCE;
+
+    return loudness_from_mean_square(sum / (f64)count);
+}
+
+f32 loudness_get_momentary(const Loudness_Meter *meter) {
+    if (meter->step_count < 4) return LOUDNESS_SILENCE;
+    return loudness_from_mean_square(mean_of_last_steps(meter, 4));
+}
+
+f32 loudness_get_short_term(const Loudness_Meter *meter) {
+    if (meter->step_count < LOUDNESS_SHORT_TERM_STEPS) return LOUDNESS_SILENCE;
+    return loudness_from_mean_square(mean_of_last_steps(meter, LOUDNESS_SHORT_TERM_STEPS));
+}
+
+f32 true_peak(const f32 *samples, u32 count) {
+    return simd_polyphase4_abs_max(samples, count, &TRUE_PEAK_COEFS[0][0], TRUE_PEAK_TAPS);
+}
@@ -0,0 +1,85 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+// Loudness measurement following ITU-R BS.1770: K-weighting, 400ms blocks
+// with 75% overlap, absolute gate at -70 LUFS and relative gate at -10 LU.
+// Also momentary (400ms) and short-term (3s) loudness and 4x oversampled
+// true-peak as in EBU R 128
+
+#include "defines.h"
+#include "array.h"
+#include <math.h>
+
+#define LOUDNESS_SILENCE -70.f
+// 100ms steps in the short-term window
+#define LOUDNESS_SHORT_TERM_STEPS 30
+#define TRUE_PEAK_TAPS 12
+
+struct Loudness_Biquad {
+    f64 b0, b1, b2, a1, a2;
+    f64 z1[MAX_AUDIO_CHANNELS];
+    f64 z2[MAX_AUDIO_CHANNELS];
+};
+
+struct Loudness_Meter {
+    i32 channels;
+    i32 sample_rate;
+    f64 channel_weights[MAX_AUDIO_CHANNELS];
+    Loudness_Biquad shelf;
+    Loudness_Biquad highpass;
+    // Blocks are built from 100ms steps
+    u32 step_frames;
+    u32 frames_in_step;
+    f64 step_sum;
+    // Mean square of the last 30 steps
+    f64 steps[LOUDNESS_SHORT_TERM_STEPS];
+    u32 step_count;
+    // Mean square of every 400ms block, for gating. Not kept by live meters
+    Array<f32> blocks;
+    bool keep_blocks;
+};
+
+// Meters that don't need integrated loudness should pass keep_blocks = false
+// so they don't grow over time
+void loudness_init(Loudness_Meter *meter, i32 channels, i32 sample_rate, bool keep_blocks = true);
+void loudness_free(Loudness_Meter *meter);
+// Clears the filter state and measurements
+void loudness_reset(Loudness_Meter *meter);
+// Feeds interleaved samples into the meter
+void loudness_process(Loudness_Meter *meter, const f32 *samples, u32 frame_count);
+// Feeds one array of samples per channel into the meter
+void loudness_process_planar(Loudness_Meter *meter, const f32 *const *samples, u32 frame_count);
+// Gated loudness of everything processed so far, in LUFS
+f32 loudness_get_integrated(const Loudness_Meter *meter);
+// Loudness of the last 400ms, in LUFS
+f32 loudness_get_momentary(const Loudness_Meter *meter);
+// Loudness of the last 3s, in LUFS
+f32 loudness_get_short_term(const Loudness_Meter *meter);
+
+// Largest absolute value of the signal after 4x oversampling. The first
+// TRUE_PEAK_TAPS-1 samples are only used as filter history
+f32 true_peak(const f32 *samples, u32 count);
+
+static inline f32 loudness_from_mean_square(f64 mean_square) {
+    if (mean_square <= 0.0) return LOUDNESS_SILENCE;
+    return MAX(LOUDNESS_SILENCE, (f32)(-0.691 + 10.0 * log10(mean_square)));
+}
+
+#endif //LOUDNESS_H
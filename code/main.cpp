@@ -27,6 +27,11 @@
 #include "font_awesome.h"
 #include "preferences.h"
 #include "metadata.h"
+#include "library.h"
+#include "analysis.h"
+#include "cover_art.h"
+#include "tag_writer.h"
+#include "playback_analysis.h"
 #include "util.h"
 #include <stdlib.h>
 #include <stdarg.h>
@@ -112,12 +117,17 @@ int main(int argc, char *argv[])
     
     //-
     // Load cached stuff. Needs to go before init_ui()
+    metadata_init();
     load_metadata_cache(MAIN_METADATA_PATH);
     //-
     
     // Initialize UI before showing the window to avoid
     // flashbanging the user. Uses the metadata cache
     init_ui();
+    analysis_init();
+    playback_analysis_init();
+    cover_art_init();
+    tag_writer_init();
     
     //-
     // Load preferences and hotkeys
@@ -171,7 +181,13 @@ int main(int argc, char *argv[])
     }
     
     g_prefs.save_to_file(MAIN_PREFS_PATH);
-    save_metadata_cache(MAIN_METADATA_PATH);
+    library_watch_folders(NULL, 0);
+    library_cancel_file_updates();
+    cover_art_deinit();
+    playback_analysis_deinit();
+    analysis_deinit();
+    tag_writer_deinit();
+    ui_save_metadata_cache();
     destroy_texture(&g_background.texture);
     platform_deinit();
     
@@ -355,6 +371,11 @@ void apply_preferences() {
     g_need_load_background = true;
     g_need_load_font = true;
     load_theme(prefs.theme);
+    
+    const char *watched_folders[Preferences::MAX_WATCHED_FOLDERS];
+    for (int i = 0; i < prefs.watched_folder_count; ++i) watched_folders[i] = prefs.watched_folders[i];
+    library_watch_folders(watched_folders, prefs.watched_folder_count);
+    
     g_prefs.save_to_file(MAIN_PREFS_PATH);
     platform_apply_preferences();
 }
@@ -16,33 +16,118 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "metadata.h"
+#include "analysis.h"
+#include "fingerprint.h"
 #include "filenames.h"
-#include "video.h"
 #include "array.h"
+#include "os.h"
+#include "hash_index.h"
 #include "taglib_file_name_workaround.h"
 #include <tag_c.h>
 #include <wchar.h>
 #include <xxhash.h>
 
-// @TODO: Make a more memory efficient way to store metadata
+// Metadata is stored a field at a time, so scans over one field don't
+// pull the others into cache. Each column has an entry per Metadata_Index
+struct Metadata_Store {
+    Array<String_ID> titles;
+    Array<String_ID> artists;
+    Array<String_ID> albums;
+    Array<String_ID> genres;
+    Array<u32> durations;
+    Array<u16> track_numbers;
+    Array<u16> disc_numbers;
+    Array<u16> years;
+    Array<u16> flags;
+    Array<u32> bitrates;
+    Array<u32> sample_rates;
+    Array<u64> file_sizes;
+    Array<u64> modified_times;
+    Array<Track_Analysis> analyses;
+    u32 count;
+};
+
+// Entries are only ever added while running. save_metadata_cache leaves
+// out the ones nothing refers to any more
+static Metadata_Store g_metadata;
 static Array<u32> g_filename_hashes;
-static Array<Metadata> g_metadata;
+// Full path of each entry, as an offset into g_path_pool. Offset 0 is an
+// empty string, used for entries loaded from caches that didn't store paths
+static Array<u32> g_path_offsets;
+static Array<char> g_path_pool;
+// Filename hash to metadata index
+static Hash_Index g_path_index;
+// Most tracks never get a fingerprint, so they are stored separately.
+// Slots are by metadata index, 0 means no fingerprint, otherwise it's
+// one more than the index into g_fingerprints
+static Array<u32> g_fingerprint_slots;
+static Array<Fingerprint> g_fingerprints;
+// The TagLib C bindings keep every string they return in one global list
+// until taglib_tag_free_strings(), so only one thread at a time can use them
+static Mutex g_taglib_strings_lock;
 
-Metadata_Index read_file_metadata(const char *path) {
+static u32 add_path(const char *path) {
+    if (!g_path_pool.count) g_path_pool.append(0);
+    if (!path || !path[0]) return 0;
+    return g_path_pool.append_array(path, (u32)strlen(path) + 1);
+}
+
+static Metadata_Index append_metadata(const Metadata& md) {
+    g_metadata.titles.append(md.title);
+    g_metadata.artists.append(md.artist);
+    g_metadata.albums.append(md.album);
+    g_metadata.genres.append(md.genre);
+    g_metadata.durations.append(md.duration_seconds);
+    g_metadata.track_numbers.append(md.track_number);
+    g_metadata.disc_numbers.append(md.disc_number);
+    g_metadata.years.append(md.year);
+    g_metadata.flags.append(md.flags);
+    g_metadata.bitrates.append(md.bitrate);
+    g_metadata.sample_rates.append(md.sample_rate);
+    g_metadata.file_sizes.append(md.file_size);
+    g_metadata.modified_times.append(md.modified_time);
+    g_metadata.analyses.append(md.analysis);
+    return g_metadata.count++;
+}
+
+static Metadata_Index add_metadata(u32 filename_hash, const char *path, const Metadata& md) {
+    Metadata_Index index = append_metadata(md);
+    g_filename_hashes.append(filename_hash);
+    g_path_offsets.append(add_path(path));
+    // Index 0 is the placeholder for missing metadata, never look it up
+    if (index) g_path_index.insert(filename_hash, index);
+    return index;
+}
+
+// Hashes can collide, so the full path has to match too. Entries without a
+// path take the first path with their hash
+static Metadata_Index find_metadata(u32 filename_hash, const char *path) {
+    Metadata_Index index = g_path_index.find(filename_hash, [path](u32 candidate) {
+        u32 offset = g_path_offsets[candidate];
+        return !offset || !strcmp(&g_path_pool[offset], path);
+    });
+
+    if (index == Hash_Index::NOT_FOUND) return 0;
+    if (!g_path_offsets[index]) g_path_offsets[index] = add_path(path);
+    return index;
+}
+
+static void add_placeholder_metadata() {
+    if (g_metadata.count) return;
+    Metadata empty = {};
+    empty.artist = intern_string(" ");
+    empty.album = intern_string(" ");
+    empty.title = intern_string(" ");
+    add_metadata(0, NULL, empty);
+}
+
+void metadata_init() {
+    string_table_init();
+    g_taglib_strings_lock = create_mutex();
+}
+
+bool read_file_tags(const char *path, Metadata *md) {
     TagLib_File *file;
-    u32 filename_hash = hash_string(path);
-    
-    if (!g_metadata.count) {
-        Metadata empty = {};
-        empty.artist[0] = ' ';
-        empty.album[0] = ' ';
-        empty.title[0] = ' ';
-        g_filename_hashes.append(0);
-        g_metadata.append(empty);
-    }
-    
-    i32 existing_index = linear_search(g_filename_hashes.data, g_filename_hashes.count, filename_hash);
-    if (existing_index >= 0) return existing_index;
 
 #ifdef _WIN32
     wchar_t path_win[PATH_LENGTH];
@@ -56,46 +141,98 @@ Metadata_Index read_file_metadata(const char *path) {
         defer(taglib_file_free(file));
         TagLib_Tag *tag = taglib_file_tag(file);
         Metadata metadata = {};
-        u32 index;
+        File_Stat stat;
+        metadata.flags = METADATA_FLAG_EXTENDED_TAGS;
+        
+        if (get_file_stat(path, &stat)) {
+            metadata.file_size = stat.size;
+            metadata.modified_time = stat.modified_time;
+        }
         
         const TagLib_AudioProperties *props = taglib_file_audioproperties(file);
         
         if (props) {
             metadata.duration_seconds = taglib_audioproperties_length(props);
-            format_time(metadata.duration_seconds, metadata.duration_string,
-                        sizeof(metadata.duration_string));
+            metadata.bitrate = taglib_audioproperties_bitrate(props);
+            metadata.sample_rate = taglib_audioproperties_samplerate(props);
+        }
+        
+        // Usually "1" or "1/2"
+        char **disc = taglib_property_get(file, "DISCNUMBER");
+        if (disc) {
+            if (disc[0]) metadata.disc_number = (u16)clamp(atoi(disc[0]), 0, UINT16_MAX);
+            taglib_property_free(disc);
         }
         
         if (tag) {
+            lock_mutex(g_taglib_strings_lock);
             char *title = taglib_tag_title(tag);
             char *artist = taglib_tag_artist(tag);
             char *album = taglib_tag_album(tag);
+            char *genre = taglib_tag_genre(tag);
             
-            if (title && title[0]) strncpy0(metadata.title, title, sizeof(metadata.title));
-            else strncpy0(metadata.title, get_file_name(path), sizeof(metadata.title));
+            if (title && title[0]) metadata.title = intern_string(title);
+            else metadata.title = intern_string(get_file_name(path));
             
-            if (artist) strncpy0(metadata.artist, artist, sizeof(metadata.artist));
-            if (album) strncpy0(metadata.album, album, sizeof(metadata.album));
+            metadata.artist = intern_string(artist);
+            metadata.album = intern_string(album);
+            metadata.genre = intern_string(genre);
+            metadata.track_number = (u16)MIN(taglib_tag_track(tag), (u32)UINT16_MAX);
+            metadata.year = (u16)MIN(taglib_tag_year(tag), (u32)UINT16_MAX);
+            taglib_tag_free_strings();
+            unlock_mutex(g_taglib_strings_lock);
             
-            index = g_metadata.append(metadata);
-            g_filename_hashes.append(filename_hash);
-            return index;
+            *md = metadata;
+            return true;
         }
     }
     
     // If we fail to get the metadata, use empty strings for artist and album and just use the
     // file name as the title
     Metadata not_found = {};
-    u32 index;
-    not_found.artist[0] = ' ';
-    not_found.album[0] = ' ';
-    strncpy(not_found.title, get_file_name(path), sizeof(not_found.title)-1);
-    index = g_metadata.append(not_found);
-    g_filename_hashes.append(filename_hash);
-    return index;
+    not_found.flags = METADATA_FLAG_EXTENDED_TAGS;
+    not_found.artist = intern_string(" ");
+    not_found.album = intern_string(" ");
+    not_found.title = intern_string(get_file_name(path));
+    *md = not_found;
+    return false;
+}
+
+Metadata_Index find_file_metadata(const char *path) {
+    add_placeholder_metadata();
+    return find_metadata(hash_string(path), path);
 }
 
-bool update_file_metadata(Metadata_Index index, const char *path, Detailed_Metadata *new_md) {
+Metadata_Index add_file_metadata(const char *path, const Metadata *md) {
+    u32 filename_hash = hash_string(path);
+    add_placeholder_metadata();
+    
+    Metadata_Index existing_index = find_metadata(filename_hash, path);
+    if (existing_index) return existing_index;
+    
+    return add_metadata(filename_hash, path, *md);
+}
+
+Metadata_Index read_file_metadata(const char *path) {
+    Metadata md;
+    Metadata_Index existing_index = find_file_metadata(path);
+    if (existing_index) return existing_index;
+    
+    read_file_tags(path, &md);
+    return add_file_metadata(path, &md);
+}
+
+struct Tag_Values {
+    const char *title;
+    const char *artist;
+    const char *album;
+    const char *genre;
+    const char *comment;
+    u32 year;
+    u32 track_number;
+};
+
+static bool write_tag_values(const char *path, const Tag_Values& values, Tag_Fields fields) {
     TagLib_File *file;
 #ifdef _WIN32
     wchar_t path_win[PATH_LENGTH];
@@ -104,30 +241,85 @@ bool update_file_metadata(Metadata_Index index, const char *path, Detailed_Metad
 #else
     file = taglib_file_new(path);
 #endif
-    Metadata *old_md = &g_metadata[index];
     if (!file) return false;
     defer(taglib_file_free(file));
 
     TagLib_Tag *tag = taglib_file_tag(file);
     if (!tag) return false;
     
-    taglib_tag_set_title(tag, new_md->title);
-    taglib_tag_set_artist(tag, new_md->artist);
-    taglib_tag_set_album(tag, new_md->album);
-    taglib_tag_set_comment(tag, new_md->comment);
-    taglib_tag_set_genre(tag, new_md->genre);
-    taglib_tag_set_year(tag, new_md->year);
-    taglib_tag_set_track(tag, new_md->track_number);
-
-    strncpy0(old_md->title, new_md->title, sizeof(old_md->title));
-    strncpy0(old_md->artist, new_md->artist, sizeof(old_md->artist));
-    strncpy0(old_md->album, new_md->album, sizeof(old_md->album));
+    if (fields & TAG_FIELD_TITLE) taglib_tag_set_title(tag, values.title);
+    if (fields & TAG_FIELD_ARTIST) taglib_tag_set_artist(tag, values.artist);
+    if (fields & TAG_FIELD_ALBUM) taglib_tag_set_album(tag, values.album);
+    if (fields & TAG_FIELD_COMMENT) taglib_tag_set_comment(tag, values.comment);
+    if (fields & TAG_FIELD_GENRE) taglib_tag_set_genre(tag, values.genre);
+    if (fields & TAG_FIELD_YEAR) taglib_tag_set_year(tag, values.year);
+    if (fields & TAG_FIELD_TRACK_NUMBER) taglib_tag_set_track(tag, values.track_number);
 
     return taglib_file_save(file);
 }
 
-bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md, Image *cover) {
+bool write_file_tags(const char *path, const Detailed_Metadata *md, Tag_Fields fields) {
+    Tag_Values values;
+    values.title = md->title;
+    values.artist = md->artist;
+    values.album = md->album;
+    values.genre = md->genre;
+    values.comment = md->comment;
+    values.year = md->year;
+    values.track_number = md->track_number;
+    return write_tag_values(path, values, fields);
+}
+
+bool restore_file_tags(const char *path, const Tag_Snapshot *snapshot, Tag_Fields fields) {
+    const char *strings = snapshot->strings.data;
+    Tag_Values values;
+    values.title = &strings[snapshot->title];
+    values.artist = &strings[snapshot->artist];
+    values.album = &strings[snapshot->album];
+    values.genre = &strings[snapshot->genre];
+    values.comment = &strings[snapshot->comment];
+    values.year = snapshot->year;
+    values.track_number = snapshot->track_number;
+    return write_tag_values(path, values, fields);
+}
+
+static u32 append_tag_string(Array<char>& strings, const char *str) {
+    if (!str) str = "";
+    return strings.append_array(str, (u32)strlen(str) + 1);
+}
+
+bool read_file_tag_snapshot(const char *path, Tag_Snapshot *snapshot) {
+    TagLib_File *file;
+#ifdef _WIN32
+    wchar_t path_win[PATH_LENGTH];
+    utf8_to_wchar(path, path_win, PATH_LENGTH);
+    file = taglib_file_new_wchar_(path_win);
+#else
+    file = taglib_file_new(path);
+#endif
+    if (!file) return false;
+    defer(taglib_file_free(file));
+
+    TagLib_Tag *tag = taglib_file_tag(file);
+    if (!tag) return false;
+
+    lock_mutex(g_taglib_strings_lock);
+    defer(taglib_tag_free_strings(); unlock_mutex(g_taglib_strings_lock));
+
+    snapshot->strings.clear();
+    snapshot->title = append_tag_string(snapshot->strings, taglib_tag_title(tag));
+    snapshot->artist = append_tag_string(snapshot->strings, taglib_tag_artist(tag));
+    snapshot->album = append_tag_string(snapshot->strings, taglib_tag_album(tag));
+    snapshot->genre = append_tag_string(snapshot->strings, taglib_tag_genre(tag));
+    snapshot->comment = append_tag_string(snapshot->strings, taglib_tag_comment(tag));
+    snapshot->year = taglib_tag_year(tag);
+    snapshot->track_number = taglib_tag_track(tag);
+    return true;
+}
+
+bool read_file_picture(const char *path, Array<u8> *data) {
     TagLib_File *file;
+    bool found = false;
     
 #ifdef _WIN32
     wchar_t path_win[PATH_LENGTH];
@@ -137,24 +329,42 @@ bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md, Image
     file = taglib_file_new(path);
 #endif
     
-    if (cover) cover->data = NULL;
+    data->clear();
+    if (!file) return false;
+    defer(taglib_file_free(file));
+    
+    TagLib_Complex_Property_Attribute ***props = taglib_complex_property_get(file, "PICTURE");
+    if (props) {
+        TagLib_Complex_Property_Picture_Data pict;
+        taglib_picture_from_complex_property(props, &pict);
+        
+        if (pict.data && pict.size) {
+            data->append_array((const u8*)pict.data, pict.size);
+            found = true;
+        }
+        
+        taglib_complex_property_free(props);
+    }
+    
+    return found;
+}
+
+bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md) {
+    TagLib_File *file;
+    
+#ifdef _WIN32
+    wchar_t path_win[PATH_LENGTH];
+    utf8_to_wchar(path, path_win, PATH_LENGTH);
+    file = taglib_file_new_wchar_(path_win);
+#else
+    file = taglib_file_new(path);
+#endif
     
     if (file) {
         defer(taglib_file_free(file));
         TagLib_Tag *tag = taglib_file_tag(file);
-        defer(if (tag) taglib_tag_free_strings());
-
-        if (cover) {
-            TagLib_Complex_Property_Attribute ***props = taglib_complex_property_get(file, "PICTURE");
-            if (props) {
-                TagLib_Complex_Property_Picture_Data pict;
-                taglib_picture_from_complex_property(props, &pict);
-                
-                if (pict.data) load_image_from_memory(pict.data, pict.size, cover);
-                
-                taglib_complex_property_free(props);
-            }
-        }
+        lock_mutex(g_taglib_strings_lock);
+        defer(if (tag) taglib_tag_free_strings(); unlock_mutex(g_taglib_strings_lock));
         
         if (tag && md) {
             char *title = taglib_tag_title(tag);
@@ -179,78 +389,508 @@ bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md, Image
 }
 
 void retrieve_metadata(Metadata_Index index, Metadata *md) {
-    *md = g_metadata[index];
+    md->title = g_metadata.titles[index];
+    md->artist = g_metadata.artists[index];
+    md->album = g_metadata.albums[index];
+    md->genre = g_metadata.genres[index];
+    md->duration_seconds = g_metadata.durations[index];
+    md->track_number = g_metadata.track_numbers[index];
+    md->disc_number = g_metadata.disc_numbers[index];
+    md->year = g_metadata.years[index];
+    md->flags = g_metadata.flags[index];
+    md->bitrate = g_metadata.bitrates[index];
+    md->sample_rate = g_metadata.sample_rates[index];
+    md->file_size = g_metadata.file_sizes[index];
+    md->modified_time = g_metadata.modified_times[index];
+    md->analysis = g_metadata.analyses[index];
+}
+
+Metadata_Columns get_metadata_columns() {
+    Metadata_Columns columns;
+    columns.titles = g_metadata.titles.data;
+    columns.artists = g_metadata.artists.data;
+    columns.albums = g_metadata.albums.data;
+    columns.genres = g_metadata.genres.data;
+    columns.durations = g_metadata.durations.data;
+    columns.track_numbers = g_metadata.track_numbers.data;
+    columns.disc_numbers = g_metadata.disc_numbers.data;
+    columns.years = g_metadata.years.data;
+    columns.bitrates = g_metadata.bitrates.data;
+    columns.sample_rates = g_metadata.sample_rates.data;
+    columns.analyses = g_metadata.analyses.data;
+    columns.count = g_metadata.count;
+    return columns;
+}
+
+void refresh_metadata(Metadata_Index index, const Metadata *md) {
+    Track_Analysis analysis = g_metadata.analyses[index];
+    bool reset_analysis = false;
+    
+    // A different length means different audio, so it has to be analyzed again
+    if (md->duration_seconds != g_metadata.durations[index]) {
+        analysis = {};
+        reset_analysis = true;
+        if (index < g_fingerprint_slots.count && g_fingerprint_slots[index]) {
+            g_fingerprints[g_fingerprint_slots[index] - 1].frame_count = 0;
+        }
+    }
+    
+    g_metadata.titles[index] = md->title;
+    g_metadata.artists[index] = md->artist;
+    g_metadata.albums[index] = md->album;
+    g_metadata.genres[index] = md->genre;
+    g_metadata.durations[index] = md->duration_seconds;
+    g_metadata.track_numbers[index] = md->track_number;
+    g_metadata.disc_numbers[index] = md->disc_number;
+    g_metadata.years[index] = md->year;
+    g_metadata.flags[index] = md->flags;
+    g_metadata.bitrates[index] = md->bitrate;
+    g_metadata.sample_rates[index] = md->sample_rate;
+    g_metadata.file_sizes[index] = md->file_size;
+    g_metadata.modified_times[index] = md->modified_time;
+    g_metadata.analyses[index] = analysis;
+    
+    if (reset_analysis) analysis_invalidate(index);
+}
+
+void set_metadata_file_stat(Metadata_Index index, u64 file_size, u64 modified_time) {
+    g_metadata.file_sizes[index] = file_size;
+    g_metadata.modified_times[index] = modified_time;
+}
+
+void retrieve_metadata_analysis(Metadata_Index index, Track_Analysis *analysis) {
+    *analysis = g_metadata.analyses[index];
+}
+
+void set_metadata_analysis(Metadata_Index index, const Track_Analysis *analysis) {
+    g_metadata.analyses[index] = *analysis;
+}
+
+bool retrieve_metadata_fingerprint(Metadata_Index index, Fingerprint *fp) {
+    if (index >= g_fingerprint_slots.count || !g_fingerprint_slots[index]) return false;
+    *fp = g_fingerprints[g_fingerprint_slots[index] - 1];
+    return fp->frame_count != 0;
+}
+
+void set_metadata_fingerprint(Metadata_Index index, const Fingerprint *fp) {
+    while (g_fingerprint_slots.count <= index) g_fingerprint_slots.append(0);
+    if (!g_fingerprint_slots[index]) g_fingerprint_slots[index] = g_fingerprints.append(*fp) + 1;
+    else g_fingerprints[g_fingerprint_slots[index] - 1] = *fp;
 }
 
 #define METADATA_CACHE_MAGIC *(u32*)"MTDC"
+#define METADATA_CACHE_VERSION 1
+
+// Version 0 stored packed records with the strings in a pool. From version 1
+// the cache is laid out to be mapped and copied into the store a section at
+// a time: one section per column of the store, followed by the filename
+// hashes, path offsets, the slots of the path index, fingerprints, the path
+// pool, the interned strings and the slots of their index. Every section
+// starts on an 8 byte boundary
+struct Metadata_Cache_Header {
+    u32 magic;
+    u32 version;
+    u32 flags;
+    u32 entry_count;
+    u32 fingerprint_count;
+    u32 path_pool_size;
+    u32 index_capacity;
+    u32 index_count;
+    u32 string_count;
+    u32 string_index_capacity;
+    u32 string_index_count;
+    u32 reserved;
+    u64 strings_size;
+    // XXH64 of everything after the header
+    u64 checksum;
+};
 
-static void write_u32(FILE *f, u32 value) {
-    fwrite(&value, 4, 1, f);
+struct Metadata_Cache_Layout {
+    u64 titles;
+    u64 artists;
+    u64 albums;
+    u64 durations;
+    u64 file_sizes;
+    u64 modified_times;
+    u64 analyses;
+    u64 genres;
+    u64 track_numbers;
+    u64 disc_numbers;
+    u64 years;
+    u64 bitrates;
+    u64 sample_rates;
+    u64 flags;
+    u64 filename_hashes;
+    u64 path_offsets;
+    u64 index_hashes;
+    u64 index_values;
+    u64 fingerprint_indices;
+    u64 fingerprints;
+    u64 path_pool;
+    u64 strings;
+    u64 string_index_hashes;
+    u64 string_index_values;
+    u64 total_size;
+};
+
+static u64 align_cache_offset(u64 offset) {
+    return (offset + 7) & ~(u64)7;
 }
 
-static inline u32 mread_u32(void **memory) {
-    u32 value;
-    memcpy(&value, *memory, 4);
-    *memory = (u8*)*memory + 4;
-    return value;
+static Metadata_Cache_Layout get_metadata_cache_layout(const Metadata_Cache_Header& header) {
+    Metadata_Cache_Layout layout;
+    u64 offset = sizeof(Metadata_Cache_Header);
+    const u64 n = header.entry_count;
+    layout.titles = offset;
+    offset = align_cache_offset(offset + (n * sizeof(String_ID)));
+    layout.artists = offset;
+    offset = align_cache_offset(offset + (n * sizeof(String_ID)));
+    layout.albums = offset;
+    offset = align_cache_offset(offset + (n * sizeof(String_ID)));
+    layout.durations = offset;
+    offset = align_cache_offset(offset + (n * 4));
+    layout.file_sizes = offset;
+    offset = align_cache_offset(offset + (n * 8));
+    layout.modified_times = offset;
+    offset = align_cache_offset(offset + (n * 8));
+    layout.analyses = offset;
+    offset = align_cache_offset(offset + (n * sizeof(Track_Analysis)));
+    layout.genres = offset;
+    offset = align_cache_offset(offset + (n * sizeof(String_ID)));
+    layout.track_numbers = offset;
+    offset = align_cache_offset(offset + (n * 2));
+    layout.disc_numbers = offset;
+    offset = align_cache_offset(offset + (n * 2));
+    layout.years = offset;
+    offset = align_cache_offset(offset + (n * 2));
+    layout.bitrates = offset;
+    offset = align_cache_offset(offset + (n * 4));
+    layout.sample_rates = offset;
+    offset = align_cache_offset(offset + (n * 4));
+    layout.flags = offset;
+    offset = align_cache_offset(offset + (n * 2));
+    layout.filename_hashes = offset;
+    offset = align_cache_offset(offset + (n * 4));
+    layout.path_offsets = offset;
+    offset = align_cache_offset(offset + (n * 4));
+    layout.index_hashes = offset;
+    offset = align_cache_offset(offset + ((u64)header.index_capacity * 4));
+    layout.index_values = offset;
+    offset = align_cache_offset(offset + ((u64)header.index_capacity * 4));
+    layout.fingerprint_indices = offset;
+    offset = align_cache_offset(offset + ((u64)header.fingerprint_count * 4));
+    layout.fingerprints = offset;
+    offset = align_cache_offset(offset + ((u64)header.fingerprint_count * sizeof(Fingerprint)));
+    layout.path_pool = offset;
+    offset = align_cache_offset(offset + header.path_pool_size);
+    layout.strings = offset;
+    offset = align_cache_offset(offset + header.strings_size);
+    layout.string_index_hashes = offset;
+    offset = align_cache_offset(offset + ((u64)header.string_index_capacity * 4));
+    layout.string_index_values = offset;
+    layout.total_size = align_cache_offset(offset + ((u64)header.string_index_capacity * 4));
+    return layout;
 }
 
-void save_metadata_cache(const char *path) {
-    FILE *f = fopen(path, "wb");
-    if (!f) return;
-    defer(fclose(f));
-    
-    Array<char> sp = {};
-    defer(sp.free());
-    
-    write_u32(f, METADATA_CACHE_MAGIC);
-    write_u32(f, 0); // Version
-    write_u32(f, 0); // Flags
-    write_u32(f, g_metadata.count); // Track count
-    
-    for (u32 i = 0; i < g_metadata.count; ++i) {
-        Metadata md = g_metadata[i];
-        u32 title = sp.append_array(md.title, (u32)strlen(md.title)+1);
-        u32 artist = sp.append_array(md.artist, (u32)strlen(md.artist)+1);
-        u32 album = sp.append_array(md.album, (u32)strlen(md.album)+1);
-        
-        write_u32(f, g_filename_hashes[i]);
-        write_u32(f, title);
-        write_u32(f, artist);
-        write_u32(f, album);
-        write_u32(f, md.duration_seconds);
+static void write_cache_padding(FILE *f, XXH64_state_t *checksum, u64 size) {
+    static const u8 zeros[8] = {};
+    u64 padding = align_cache_offset(size) - size;
+    if (padding) {
+        fwrite(zeros, 1, padding, f);
+        XXH64_update(checksum, zeros, padding);
     }
-    
-    fwrite(sp.data, 1, sp.count, f);
 }
 
-void load_metadata_cache(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return;
-    defer(fclose(f));
-    START_TIMER(load_metadata, "Load metadata");
-    
-    fseek(f, 0, SEEK_END);
-    i64 size = ftell(f);
+// Writes a section followed by zeros up to the next section
+static void write_cache_section(FILE *f, XXH64_state_t *checksum, const void *data, u64 size) {
+    if (size) {
+        fwrite(data, 1, size, f);
+        XXH64_update(checksum, data, size);
+    }
+    write_cache_padding(f, checksum, size);
+}
+
+// Writes the entries of a column listed in entries, in that order
+template<typename T>
+static void write_cache_column(FILE *f, XXH64_state_t *checksum, const Array<T>& column,
+                               const Array<u32>& entries) {
+    Array<T> section = {};
+    defer(section.free());
+    if (entries.count) section.push(entries.count);
+    for (u32 i = 0; i < entries.count; ++i) section[i] = column[entries[i]];
+    write_cache_section(f, checksum, section.data, (u64)section.count * sizeof(T));
+}
+
+static void write_cache_string_column(FILE *f, XXH64_state_t *checksum, const Array<String_ID>& column,
+                                      const Array<u32>& entries, const Array<String_ID>& string_ids) {
+    Array<String_ID> section = {};
+    defer(section.free());
+    if (entries.count) section.push(entries.count);
+    for (u32 i = 0; i < entries.count; ++i) section[i] = string_ids[column[entries[i]]];
+    write_cache_section(f, checksum, section.data, (u64)section.count * sizeof(String_ID));
+}
+
+void save_metadata_cache(const char *path, const Metadata_Index *live, u32 live_count) {
+    // Written beside the cache and swapped in once it's on disk, so a failed
+    // save leaves the old cache in place
+    char temp_path[PATH_LENGTH];
+    snprintf(temp_path, PATH_LENGTH, "%s.tmp", path);
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) {
+        log_error("Failed to open file %s for writing\n", temp_path);
+        return;
+    }
+
+    // Entries are renumbered in their current order. entries holds the old
+    // index of each saved entry. The placeholder is always kept as 0
+    Array<u32> new_indices = {};
+    Array<u32> entries = {};
+    defer(new_indices.free());
+    defer(entries.free());
+    new_indices.push(g_metadata.count);
+    for (u32 i = 0; i < g_metadata.count; ++i) new_indices[i] = Hash_Index::NOT_FOUND;
+    new_indices[0] = 0;
+    for (u32 i = 0; i < live_count; ++i) {
+        if (live[i] < g_metadata.count) new_indices[live[i]] = 0;
+    }
+    for (u32 i = 0; i < g_metadata.count; ++i) {
+        if (new_indices[i] == Hash_Index::NOT_FOUND) continue;
+        new_indices[i] = entries.append(i);
+    }
+
+    // Strings only used by dropped entries are left out too, the rest are
+    // renumbered in ID order
+    const u32 string_count = get_string_count();
+    Array<String_ID> string_ids = {};
+    defer(string_ids.free());
+    string_ids.push(string_count);
+    memset(string_ids.data, 0, string_count * sizeof(String_ID));
+    for (u32 i = 0; i < entries.count; ++i) {
+        const u32 e = entries[i];
+        string_ids[g_metadata.titles[e]] = 1;
+        string_ids[g_metadata.artists[e]] = 1;
+        string_ids[g_metadata.albums[e]] = 1;
+        string_ids[g_metadata.genres[e]] = 1;
+    }
+
+    Hash_Index string_index = {};
+    u32 saved_string_count = 0;
+    u64 strings_size = 0;
+    defer(string_index.free());
+    string_ids[0] = 0;
+    for (String_ID id = 1; id < string_count; ++id) {
+        if (!string_ids[id]) continue;
+        const char *str = get_string(id);
+        const u64 length = strlen(str);
+        string_ids[id] = ++saved_string_count;
+        string_index.insert(get_string_hash(str, length), string_ids[id]);
+        strings_size += length + 1;
+    }
+
+    Array<u32> path_offsets = {};
+    Array<char> path_pool = {};
+    Hash_Index path_index = {};
+    defer(path_offsets.free());
+    defer(path_pool.free());
+    defer(path_index.free());
+    path_pool.append(0);
+    for (u32 i = 0; i < entries.count; ++i) {
+        const u32 offset = g_path_offsets[entries[i]];
+        if (!offset) path_offsets.append(0);
+        else {
+            const char *entry_path = &g_path_pool[offset];
+            path_offsets.append(path_pool.append_array(entry_path, (u32)strlen(entry_path) + 1));
+        }
+        if (i) path_index.insert(g_filename_hashes[entries[i]], i);
+    }
+
+    Array<u32> fingerprint_indices = {};
+    Array<Fingerprint> fingerprints = {};
+    defer(fingerprint_indices.free());
+    defer(fingerprints.free());
+    for (u32 i = 0; i < entries.count; ++i) {
+        const u32 e = entries[i];
+        if (e >= g_fingerprint_slots.count || !g_fingerprint_slots[e]) continue;
+        fingerprint_indices.append(i);
+        fingerprints.append(g_fingerprints[g_fingerprint_slots[e] - 1]);
+    }
+
+    Metadata_Cache_Header header = {};
+    header.magic = METADATA_CACHE_MAGIC;
+    header.version = METADATA_CACHE_VERSION;
+    header.entry_count = entries.count;
+    header.fingerprint_count = fingerprint_indices.count;
+    header.path_pool_size = path_pool.count;
+    header.index_capacity = path_index.capacity;
+    header.index_count = path_index.count;
+    header.string_count = saved_string_count;
+    header.string_index_capacity = string_index.capacity;
+    header.string_index_count = string_index.count;
+    header.strings_size = strings_size;
+
+    XXH64_state_t *checksum = XXH64_createState();
+    defer(XXH64_freeState(checksum));
+    XXH64_reset(checksum, 0);
+
+    // The header is written again at the end with the checksum filled in
+    fwrite(&header, sizeof(header), 1, f);
+    write_cache_string_column(f, checksum, g_metadata.titles, entries, string_ids);
+    write_cache_string_column(f, checksum, g_metadata.artists, entries, string_ids);
+    write_cache_string_column(f, checksum, g_metadata.albums, entries, string_ids);
+    write_cache_column(f, checksum, g_metadata.durations, entries);
+    write_cache_column(f, checksum, g_metadata.file_sizes, entries);
+    write_cache_column(f, checksum, g_metadata.modified_times, entries);
+    write_cache_column(f, checksum, g_metadata.analyses, entries);
+    write_cache_string_column(f, checksum, g_metadata.genres, entries, string_ids);
+    write_cache_column(f, checksum, g_metadata.track_numbers, entries);
+    write_cache_column(f, checksum, g_metadata.disc_numbers, entries);
+    write_cache_column(f, checksum, g_metadata.years, entries);
+    write_cache_column(f, checksum, g_metadata.bitrates, entries);
+    write_cache_column(f, checksum, g_metadata.sample_rates, entries);
+    write_cache_column(f, checksum, g_metadata.flags, entries);
+    write_cache_column(f, checksum, g_filename_hashes, entries);
+    write_cache_section(f, checksum, path_offsets.data, (u64)path_offsets.count * 4);
+    write_cache_section(f, checksum, path_index.hashes, (u64)path_index.capacity * 4);
+    write_cache_section(f, checksum, path_index.values, (u64)path_index.capacity * 4);
+    write_cache_section(f, checksum, fingerprint_indices.data, (u64)fingerprint_indices.count * 4);
+    write_cache_section(f, checksum, fingerprints.data, (u64)fingerprints.count * sizeof(Fingerprint));
+    write_cache_section(f, checksum, path_pool.data, path_pool.count);
+
+    // Strings are packed in their new ID order, without the empty string
+    for (String_ID id = 1; id < string_count; ++id) {
+        if (!string_ids[id]) continue;
+        const char *str = get_string(id);
+        u64 size = strlen(str) + 1;
+        fwrite(str, 1, size, f);
+        XXH64_update(checksum, str, size);
+    }
+    write_cache_padding(f, checksum, header.strings_size);
+    write_cache_section(f, checksum, string_index.hashes, (u64)string_index.capacity * 4);
+    write_cache_section(f, checksum, string_index.values, (u64)string_index.capacity * 4);
+
+    header.checksum = XXH64_digest(checksum);
     fseek(f, 0, SEEK_SET);
-    
-    void *file_buffer = malloc(size);
-    void *data = file_buffer;
-    defer(free(file_buffer));
-    
-    fread(data, size, 1, f);
-    
-    u32 magic = mread_u32(&data);
+    fwrite(&header, sizeof(header), 1, f);
 
-    if (magic != METADATA_CACHE_MAGIC) return;
+    bool flushed = flush_file(f);
+    fclose(f);
+
+    if (!flushed || !replace_file(temp_path, path)) {
+        log_error("Failed to save metadata cache %s\n", path);
+        delete_file(temp_path);
+    }
+}
+
+// Checks everything before touching the store, so nothing is loaded from a
+// damaged file
+static bool load_mapped_metadata_cache(const u8 *file_data, u64 file_size) {
+    Metadata_Cache_Header header;
+    if (file_size < sizeof(header)) return false;
+    memcpy(&header, file_data, sizeof(header));
+
+    if (header.index_capacity & (header.index_capacity - 1)) return false;
+    if (header.index_count > header.index_capacity) return false;
+    if (header.string_index_capacity & (header.string_index_capacity - 1)) return false;
+    if (header.string_index_count > header.string_index_capacity) return false;
+
+    const Metadata_Cache_Layout layout = get_metadata_cache_layout(header);
+    if (layout.total_size != file_size) return false;
+    if (XXH64(&file_data[sizeof(header)], file_size - sizeof(header), 0) != header.checksum) return false;
+
+    const u32 entry_count = header.entry_count;
+    const u32 *filename_hashes = (const u32*)&file_data[layout.filename_hashes];
+    const u32 *path_offsets = (const u32*)&file_data[layout.path_offsets];
+    const u32 *fingerprint_indices = (const u32*)&file_data[layout.fingerprint_indices];
+    const Fingerprint *fingerprints = (const Fingerprint*)&file_data[layout.fingerprints];
+    const char *path_pool = (const char*)&file_data[layout.path_pool];
+
+    if (header.path_pool_size && path_pool[header.path_pool_size - 1]) return false;
+    for (u32 i = 0; i < entry_count; ++i) {
+        if (path_offsets[i] && path_offsets[i] >= header.path_pool_size) return false;
+    }
+
+    const u32 first_entry = g_metadata.count;
+    const u32 first_path = g_path_pool.count;
+
+    Hash_Index string_index = {};
+    string_index.hashes = (u32*)&file_data[layout.string_index_hashes];
+    string_index.values = (u32*)&file_data[layout.string_index_values];
+    string_index.capacity = header.string_index_capacity;
+    string_index.count = header.string_index_count;
+
+    // String IDs in the cache are only right for a fresh table
+    if (first_entry || !load_string_table((const char*)&file_data[layout.strings], header.strings_size,
+                                          header.string_count, string_index)) {
+        return false;
+    }
+
+    g_metadata.titles.append_array((const String_ID*)&file_data[layout.titles], entry_count);
+    g_metadata.artists.append_array((const String_ID*)&file_data[layout.artists], entry_count);
+    g_metadata.albums.append_array((const String_ID*)&file_data[layout.albums], entry_count);
+    g_metadata.durations.append_array((const u32*)&file_data[layout.durations], entry_count);
+    g_metadata.file_sizes.append_array((const u64*)&file_data[layout.file_sizes], entry_count);
+    g_metadata.modified_times.append_array((const u64*)&file_data[layout.modified_times], entry_count);
+    g_metadata.analyses.append_array((const Track_Analysis*)&file_data[layout.analyses], entry_count);
+    g_metadata.genres.append_array((const String_ID*)&file_data[layout.genres], entry_count);
+    g_metadata.track_numbers.append_array((const u16*)&file_data[layout.track_numbers], entry_count);
+    g_metadata.disc_numbers.append_array((const u16*)&file_data[layout.disc_numbers], entry_count);
+    g_metadata.years.append_array((const u16*)&file_data[layout.years], entry_count);
+    g_metadata.bitrates.append_array((const u32*)&file_data[layout.bitrates], entry_count);
+    g_metadata.sample_rates.append_array((const u32*)&file_data[layout.sample_rates], entry_count);
+    g_metadata.flags.append_array((const u16*)&file_data[layout.flags], entry_count);
+    g_metadata.count += entry_count;
 
+    g_filename_hashes.append_array(filename_hashes, entry_count);
+    g_path_pool.append_array(path_pool, header.path_pool_size);
+
+    // The saved index can only be used as it is when the store was empty
+    if (!first_entry) {
+        g_path_offsets.append_array(path_offsets, entry_count);
+        g_path_index.load((const u32*)&file_data[layout.index_hashes],
+                          (const u32*)&file_data[layout.index_values],
+                          header.index_capacity, header.index_count);
+    }
+    else {
+        for (u32 i = 0; i < entry_count; ++i) {
+            g_path_offsets.append(path_offsets[i] ? first_path + path_offsets[i] : 0);
+            if (i) g_path_index.insert(filename_hashes[i], first_entry + i);
+        }
+    }
+
+    for (u32 i = 0; i < header.fingerprint_count; ++i) {
+        if (fingerprint_indices[i] < entry_count) {
+            set_metadata_fingerprint(first_entry + fingerprint_indices[i], &fingerprints[i]);
+        }
+    }
+
+    log_info("Loaded %u files from metadata cache\n", entry_count);
+    return true;
+}
+
+static inline u32 mread_u32(void **memory) {
+    u32 value;
+    memcpy(&value, *memory, 4);
+    *memory = (u8*)*memory + 4;
+    return value;
+}
+
+// Version 0 had a 16 byte header, then 20 bytes per track followed by the
+// string pool
+static bool load_legacy_metadata_cache(const u8 *file_data, u64 file_size) {
+    void *data = (void*)file_data;
+    if (file_size < 16) return false;
+
+    /*u32 magic =*/ mread_u32(&data);
     /*u32 version =*/ mread_u32(&data);
     /*u32 flags =*/ mread_u32(&data);
     u32 file_count = mread_u32(&data);
-    
-    // 16 byte header + 20 bytes per track
-    const char *string_pool = (char*)file_buffer + (16 + (file_count * 20));
-    
+
+    const u64 pool_offset = 16 + ((u64)file_count * 20);
+    if (pool_offset > file_size) return false;
+    const char *string_pool = (const char*)file_data + pool_offset;
+    const u64 pool_size = file_size - pool_offset;
+    if (pool_size && string_pool[pool_size - 1]) return false;
+
     for (u32 i = 0; i < file_count; ++i) {
         Metadata md = {};
         u32 hash = mread_u32(&data);
@@ -258,20 +898,42 @@ void load_metadata_cache(const char *path) {
         u32 artist = mread_u32(&data);
         u32 album = mread_u32(&data);
         u32 duration = mread_u32(&data);
-        
-        strncpy0(md.title, &string_pool[title], sizeof(md.title));
-        strncpy0(md.artist, &string_pool[artist], sizeof(md.artist));
-        strncpy0(md.album, &string_pool[album], sizeof(md.album));
+        if (title >= pool_size || artist >= pool_size || album >= pool_size) return false;
+
+        md.title = intern_string(&string_pool[title]);
+        md.artist = intern_string(&string_pool[artist]);
+        md.album = intern_string(&string_pool[album]);
         md.duration_seconds = duration;
-        format_time(md.duration_seconds, md.duration_string,
-                    sizeof(md.duration_string));
-        
-        g_filename_hashes.append(hash);
-        g_metadata.append(md);
+
+        add_metadata(hash, NULL, md);
     }
+
+    log_info("Loaded %u files from metadata cache\n", file_count);
+    return true;
+}
+
+void load_metadata_cache(const char *path) {
+    Mapped_File file;
+    if (!map_file(path, &file)) return;
+    defer(unmap_file(&file));
+    START_TIMER(load_metadata, "Load metadata");
+
+    const u8 *data = (const u8*)file.data;
+    u32 magic, version;
+    if (file.size < 8) return;
+    memcpy(&magic, data, 4);
+    memcpy(&version, data + 4, 4);
+
+    if (magic != METADATA_CACHE_MAGIC) return;
+    if (version > METADATA_CACHE_VERSION) return;
+
+    bool loaded = version == METADATA_CACHE_VERSION ?
+        load_mapped_metadata_cache(data, file.size) :
+        load_legacy_metadata_cache(data, file.size);
+
+    // Tracks without metadata have their tags read again when they are
+    // added, so the cache rebuilds itself
+    if (!loaded) log_warning("Metadata cache %s is damaged, ignoring it\n", path);
     
     STOP_TIMER(load_metadata);
-    log_info("Loaded %u files from metadata cache\n", file_count);
 }
-                                              
-                                              
\ No newline at end of file
@@ -19,20 +19,75 @@
 #define METADATA_H
 
 #include "defines.h"
+#include "string_table.h"
+#include "array.h"
 
 typedef u32 Metadata_Index;
 
-struct Image;
+struct Fingerprint;
 
-// Typically needed metadata
+// Serialized. Set by the background analysis (analysis.h)
+enum {
+    // Peak, RMS, loudness and duration have been measured
+    ANALYSIS_FLAG_LEVELS = 0x1,
+    // Tempo and key have been estimated
+    ANALYSIS_FLAG_TEMPO_KEY = 0x2,
+    // An acoustic fingerprint has been computed (fingerprint.h). Tracks too
+    // short or quiet to fingerprint have the flag but no fingerprint
+    ANALYSIS_FLAG_FINGERPRINT = 0x4,
+    ANALYSIS_FLAG__ALL_STAGES = ANALYSIS_FLAG_LEVELS|ANALYSIS_FLAG_TEMPO_KEY|ANALYSIS_FLAG_FINGERPRINT,
+    ANALYSIS_FLAG_OPEN_FAILED = 0x100,
+    // Decoding stopped before the end of the file
+    ANALYSIS_FLAG_TRUNCATED = 0x200,
+    // Decoded length doesn't match the length from the tags
+    ANALYSIS_FLAG_DURATION_MISMATCH = 0x400,
+    ANALYSIS_FLAG__ERRORS = ANALYSIS_FLAG_OPEN_FAILED|ANALYSIS_FLAG_TRUNCATED|ANALYSIS_FLAG_DURATION_MISMATCH,
+};
+
+struct Track_Analysis {
+    u32 flags;
+    f32 peak_db;
+    f32 rms_db;
+    // Integrated loudness in LUFS
+    f32 loudness;
+    u32 decoded_duration_ms;
+    // 0 if no tempo was found
+    f32 bpm;
+    // MUSICAL_KEY_* from tempo_key.h
+    u32 key;
+};
+
+// Serialized
+enum {
+    // Every field read_file_tags fills in has been read, or at least tried.
+    // Entries from caches before the extended tags were stored don't have it
+    METADATA_FLAG_EXTENDED_TAGS = 0x1,
+};
+
+// Typically needed metadata. Strings are interned (string_table.h), use
+// format_time on duration_seconds to show the duration
 struct Metadata {
-    char album[64];
-    char artist[64];
-    char title[128];
-    // The duration_string is automatically formatted
-    // when the metadata is loaded
-    char duration_string[60];
+    String_ID album;
+    String_ID artist;
+    String_ID title;
+    String_ID genre;
     u32 duration_seconds;
+    // 0 if not tagged
+    u16 track_number;
+    u16 disc_number;
+    u16 year;
+    // METADATA_FLAG_*
+    u16 flags;
+    // In kbit/s
+    u32 bitrate;
+    // 0 for files that couldn't be read, or entries from caches before
+    // these fields were stored
+    u32 sample_rate;
+    // Size and modification time of the file when the tags were read.
+    // Both 0 if unknown
+    u64 file_size;
+    u64 modified_time;
+    Track_Analysis analysis;
 };
 
 struct Detailed_Metadata {
@@ -45,11 +100,89 @@ struct Detailed_Metadata {
     char genre[64];
 };
 
+// Fields of a Detailed_Metadata to write to a file
+typedef u32 Tag_Fields;
+enum {
+    TAG_FIELD_TITLE = 1<<0,
+    TAG_FIELD_ARTIST = 1<<1,
+    TAG_FIELD_ALBUM = 1<<2,
+    TAG_FIELD_GENRE = 1<<3,
+    TAG_FIELD_COMMENT = 1<<4,
+    TAG_FIELD_YEAR = 1<<5,
+    TAG_FIELD_TRACK_NUMBER = 1<<6,
+    TAG_FIELD__ALL = (1<<7) - 1,
+};
+
+// Every field write_file_tags can write, with the text at full length, so
+// a file's tags can be put back as they were. The text fields are offsets
+// into strings
+struct Tag_Snapshot {
+    Array<char> strings;
+    u32 title;
+    u32 artist;
+    u32 album;
+    u32 genre;
+    u32 comment;
+    u32 year;
+    u32 track_number;
+};
+
+// Read-only view of the metadata store a field at a time, indexed by
+// Metadata_Index. Only valid until metadata is next added
+struct Metadata_Columns {
+    const String_ID *titles;
+    const String_ID *artists;
+    const String_ID *albums;
+    const String_ID *genres;
+    const u32 *durations;
+    const u16 *track_numbers;
+    const u16 *disc_numbers;
+    const u16 *years;
+    const u32 *bitrates;
+    const u32 *sample_rates;
+    const Track_Analysis *analyses;
+    u32 count;
+};
+
+void metadata_init();
+// Reads the tags of a file into md without touching the metadata store, so
+// it can be called from any thread. On failure md gets the file name as
+// its title and false is returned
+bool read_file_tags(const char *path, Metadata *md);
+// Returns 0 if there is no metadata for the path yet
+Metadata_Index find_file_metadata(const char *path);
+// Stores metadata from read_file_tags, unless the path already has some
+Metadata_Index add_file_metadata(const char *path, const Metadata *md);
+// find_file_metadata, falling back to read_file_tags and add_file_metadata
 Metadata_Index read_file_metadata(const char *path);
-bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md, Image *image = NULL);
-bool update_file_metadata(Metadata_Index index, const char *path, Detailed_Metadata *new_md);
+// Replaces the tags of an entry with ones read again by read_file_tags. The
+// analysis is kept unless the duration changed, in which case the entry is
+// handed to analysis_invalidate
+void refresh_metadata(Metadata_Index index, const Metadata *md);
+void set_metadata_file_stat(Metadata_Index index, u64 file_size, u64 modified_time);
+bool read_detailed_file_metadata(const char *path, Detailed_Metadata *md);
+// Copies the still encoded bytes of the file's embedded picture into data.
+// Returns false if there is no picture. Safe to call from any thread
+bool read_file_picture(const char *path, Array<u8> *data);
+// Saves the chosen fields of md to the file's tags. Doesn't touch the
+// metadata store, so it can be called from any thread. Returns false if
+// the file couldn't be opened or saved
+bool write_file_tags(const char *path, const Detailed_Metadata *md, Tag_Fields fields);
+// Safe to call from any thread. Free snapshot->strings when done
+bool read_file_tag_snapshot(const char *path, Tag_Snapshot *snapshot);
+// write_file_tags for the chosen fields of a snapshot
+bool restore_file_tags(const char *path, const Tag_Snapshot *snapshot, Tag_Fields fields);
 void retrieve_metadata(Metadata_Index index, Metadata *md);
-void save_metadata_cache(const char *path);
+Metadata_Columns get_metadata_columns();
+void retrieve_metadata_analysis(Metadata_Index index, Track_Analysis *analysis);
+void set_metadata_analysis(Metadata_Index index, const Track_Analysis *analysis);
+// Returns false if the track has no fingerprint
+bool retrieve_metadata_fingerprint(Metadata_Index index, Fingerprint *fp);
+void set_metadata_fingerprint(Metadata_Index index, const Fingerprint *fp);
+// Saves only the entries in live (which may repeat) and the strings they
+// use, renumbered in their current order. The store itself isn't changed,
+// the numbering only takes effect when the cache is next loaded
+void save_metadata_cache(const char *path, const Metadata_Index *live, u32 live_count);
 void load_metadata_cache(const char *path);
 
 #endif //METADATA_H
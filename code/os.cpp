@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <wchar.h>
+#include <io.h>
 #include <ini.h>
 
 u32 wchar_to_utf8(const wchar_t *in, char *buffer, u32 buffer_size) {
@@ -92,6 +93,10 @@ void thread_destroy(Thread thread) {
     CloseHandle(thread);
 }
 
+void sleep_milliseconds(u32 ms) {
+    Sleep(ms);
+}
+
 void show_message_box(Message_Box_Type type, const char *format, ...) {
     char message[4096];
     va_list va;
@@ -433,10 +438,58 @@ void delete_file(const char *path) {
     DeleteFileW(lazy_convert_path(path));
 }
 
+bool replace_file(const char *from, const char *to) {
+    wchar_t from_path[PATH_LENGTH];
+    wcsncpy(from_path, lazy_convert_path(from), PATH_LENGTH);
+    return MoveFileExW(from_path, lazy_convert_path(to),
+                       MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) == TRUE;
+}
+
+bool flush_file(FILE *f) {
+    if (fflush(f) || ferror(f)) return false;
+    return _commit(_fileno(f)) == 0;
+}
+
 bool is_path_a_folder(const char *path) {
     return GetFileAttributesW(lazy_convert_path(path)) & FILE_ATTRIBUTE_DIRECTORY;
 }
 
+bool get_file_stat(const char *path, File_Stat *out) {
+    struct _stat64 st;
+    if (_wstat64(lazy_convert_path(path), &st)) return false;
+    out->size = (u64)st.st_size;
+    out->modified_time = (u64)st.st_mtime;
+    return true;
+}
+
+bool map_file(const char *path, Mapped_File *file) {
+    LARGE_INTEGER size;
+    HANDLE handle = CreateFileW(lazy_convert_path(path), GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    defer(CloseHandle(handle));
+
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart <= 0) return false;
+
+    // The view keeps the mapping alive after its handle is closed
+    HANDLE mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) return false;
+    defer(CloseHandle(mapping));
+
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) return false;
+
+    file->data = data;
+    file->size = (u64)size.QuadPart;
+    return true;
+}
+
+void unmap_file(Mapped_File *file) {
+    if (file->data) UnmapViewOfFile(file->data);
+    file->data = NULL;
+    file->size = 0;
+}
+
 u64 perf_time_now() {
     LARGE_INTEGER i;
     QueryPerformanceCounter(&i);
@@ -466,5 +519,13 @@ u64 read_whole_file(const char *path, void **buffer, bool null_terminate) {
     
     return size;
 }
+// @TODO: ReadDirectoryChangesW
+Folder_Watcher create_folder_watcher(const char *const *folders, u32 folder_count,
+                                     Folder_Event_Fn *callback, void *data) {
+    return NULL;
+}
+
+void destroy_folder_watcher(Folder_Watcher watcher) {
+}
 #endif
     
\ No newline at end of file
@@ -57,8 +57,34 @@ enum {
 };
 
 typedef int Recurse_Command;
+
+struct File_Stat {
+    u64 size;
+    // Seconds since the epoch
+    u64 modified_time;
+};
 typedef Recurse_Command File_Iterator_Fn(void *data, const char *path, bool is_folder);
 
+enum {
+    // A file was created, written or moved in
+    FOLDER_EVENT_CHANGED,
+    // A file was deleted or moved out
+    FOLDER_EVENT_REMOVED,
+    // A folder was deleted or moved out, along with everything in it
+    FOLDER_EVENT_FOLDER_REMOVED,
+    // Events were dropped. Path is NULL
+    FOLDER_EVENT_OVERFLOW,
+};
+
+// Read-only view of a whole file
+struct Mapped_File {
+    const void *data;
+    u64 size;
+};
+
+typedef void *Folder_Watcher;
+typedef void Folder_Event_Fn(void *data, const char *path, int event);
+
 Mutex create_mutex();
 void lock_mutex(Mutex mutex);
 void unlock_mutex(Mutex mutex);
@@ -66,6 +92,7 @@ void destroy_mutex(Mutex mutex);
 Thread thread_create(void *user_data, Thread_Func *func);
 void thread_join(Thread thread);
 void thread_destroy(Thread thread);
+void sleep_milliseconds(u32 ms);
 void show_message_box(Message_Box_Type type, const char *format, ...);
 bool show_yes_no_dialog(const char *title, const char *format, ...);
 bool show_confirm_dialog(const char *title, const char *format, ...);
@@ -80,7 +107,22 @@ bool create_directory(const char *path);
 void generate_temporary_file_name(const char *base_path, char *buffer, int buffer_size);
 void show_last_error_in_message_box(const char *title);
 void delete_file(const char *path);
+// Renames from to to, replacing to in one step if it exists
+bool replace_file(const char *from, const char *to);
+// Flushes the file and waits for the OS to write it to disk. Returns false
+// if anything written to the file failed
+bool flush_file(FILE *f);
 bool is_path_a_folder(const char *path);
+bool get_file_stat(const char *path, File_Stat *stat);
+// Fails for empty files
+bool map_file(const char *path, Mapped_File *file);
+void unmap_file(Mapped_File *file);
+// Watches folders and everything under them. Files in folders that are moved
+// or copied in are reported as changed. callback is called on the watcher's
+// own thread. Returns NULL if folders can't be watched on this platform
+Folder_Watcher create_folder_watcher(const char *const *folders, u32 folder_count,
+                                     Folder_Event_Fn *callback, void *data);
+void destroy_folder_watcher(Folder_Watcher watcher);
 
 
 #endif //OS_H
@@ -9,6 +9,11 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <cwchar>
+#include <atomic>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 struct Thread_Func_Data {
     void *user_data;
@@ -67,6 +72,10 @@ void thread_join(Thread thread) {
 void thread_destroy(Thread thread) {
 }
 
+void sleep_milliseconds(u32 ms) {
+    usleep((useconds_t)ms * 1000);
+}
+
 void show_message_box(Message_Box_Type type, const char *format, ...) {
 }
 
@@ -153,6 +162,7 @@ bool for_each_file_in_folder(const char *path, File_Iterator_Fn *iterator, void
 
     while ((dent = readdir(dir))) {
         char path_buffer[PATH_LENGTH] = {};
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) continue;
         snprintf(path_buffer, PATH_LENGTH-1, "%s/%s", path, dent->d_name);
         switch (dent->d_type) {
             case DT_DIR:
@@ -184,12 +194,51 @@ void delete_file(const char *path) {
     remove(path);
 }
 
+bool replace_file(const char *from, const char *to) {
+    return rename(from, to) == 0;
+}
+
+bool flush_file(FILE *f) {
+    if (fflush(f) || ferror(f)) return false;
+    return fsync(fileno(f)) == 0;
+}
+
 bool is_path_a_folder(const char *path) {
     struct stat st;
     if (stat(path, &st)) return false;
     return st.st_mode & S_IFDIR;
 }
 
+bool get_file_stat(const char *path, File_Stat *out) {
+    struct stat st;
+    if (stat(path, &st)) return false;
+    out->size = (u64)st.st_size;
+    out->modified_time = (u64)st.st_mtime;
+    return true;
+}
+
+bool map_file(const char *path, Mapped_File *file) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    defer(close(fd));
+
+    if (fstat(fd, &st) || st.st_size <= 0) return false;
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    file->data = data;
+    file->size = (u64)st.st_size;
+    return true;
+}
+
+void unmap_file(Mapped_File *file) {
+    if (file->data) munmap((void*)file->data, (size_t)file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
 u64 perf_time_now() {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -218,4 +267,170 @@ u64 read_whole_file(const char *path, void **buffer, bool null_terminate) {
     return size;
 }
 
+#define FOLDER_WATCH_MASK (IN_CLOSE_WRITE|IN_CREATE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_MOVE_SELF)
+
+struct Linux_Folder_Watcher {
+    int fd;
+    Thread thread;
+    std::atomic_bool want_quit;
+    Folder_Event_Fn *callback;
+    void *data;
+    // Watch descriptors and the folders they watch, as offsets into string_pool.
+    // Only touched by the watcher thread once it's started
+    Array<int> wds;
+    Array<u32> wd_paths;
+    Array<char> string_pool;
+};
+
+// Watches the folder and its subfolders. If report_files is set, every file
+// found is reported as changed
+static void watch_folder_tree(Linux_Folder_Watcher *w, const char *path, bool report_files) {
+    int wd = inotify_add_watch(w->fd, path, FOLDER_WATCH_MASK);
+    if (wd < 0) return;
+
+    // A folder moved within the tree keeps its watch, so it gets the new
+    // path. Its subfolders are updated as the walk reaches them
+    i32 index = w->wds.lookup(wd);
+    if (index < 0 || strcmp(&w->string_pool[w->wd_paths[index]], path)) {
+        u32 length = (u32)strlen(path);
+        u32 offset = w->string_pool.push(length + 1);
+        memcpy(&w->string_pool[offset], path, length + 1);
+        if (index >= 0) w->wd_paths[index] = offset;
+        else {
+            w->wds.append(wd);
+            w->wd_paths.append(offset);
+        }
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    dirent *dent;
+
+    while ((dent = readdir(dir))) {
+        char child[PATH_LENGTH] = {};
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) continue;
+        snprintf(child, PATH_LENGTH-1, "%s/%s", path, dent->d_name);
+
+        if (dent->d_type == DT_DIR) watch_folder_tree(w, child, report_files);
+        else if (report_files && dent->d_type == DT_REG) w->callback(w->data, child, FOLDER_EVENT_CHANGED);
+    }
+
+    closedir(dir);
+}
+
+// Stops watching the folder and every folder under it. Their entries are
+// removed when the IN_IGNORED events come in
+static void unwatch_folder_tree(Linux_Folder_Watcher *w, const char *path) {
+    const u32 length = (u32)strlen(path);
+    for (u32 i = 0; i < w->wds.count; ++i) {
+        const char *watched = &w->string_pool[w->wd_paths[i]];
+        if (!strncmp(watched, path, length) && (!watched[length] || watched[length] == '/')) {
+            inotify_rm_watch(w->fd, w->wds[i]);
+        }
+    }
+}
+
+static void handle_inotify_event(Linux_Folder_Watcher *w, const inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        w->callback(w->data, NULL, FOLDER_EVENT_OVERFLOW);
+        return;
+    }
+
+    i32 index = w->wds.lookup(event->wd);
+    if (index < 0) return;
+
+    // The folder itself is gone
+    if (event->mask & IN_IGNORED) {
+        w->wds.ordered_remove(index);
+        w->wd_paths.ordered_remove(index);
+        return;
+    }
+
+    // Moves within the tree are picked up by IN_MOVED_TO on the new parent,
+    // which updates the path. If the folder isn't at its path any more it
+    // was moved out of the tree
+    if (event->mask & IN_MOVE_SELF) {
+        char folder[PATH_LENGTH];
+        strncpy0(folder, &w->string_pool[w->wd_paths[index]], PATH_LENGTH);
+        if (!is_path_a_folder(folder)) unwatch_folder_tree(w, folder);
+        return;
+    }
+
+    if (!event->len) return;
+
+    char path[PATH_LENGTH] = {};
+    snprintf(path, PATH_LENGTH-1, "%s/%s", &w->string_pool[w->wd_paths[index]], event->name);
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE|IN_MOVED_TO)) watch_folder_tree(w, path, true);
+        else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) w->callback(w->data, path, FOLDER_EVENT_FOLDER_REMOVED);
+    }
+    // Files being copied in are reported once they are closed
+    else if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+        w->callback(w->data, path, FOLDER_EVENT_CHANGED);
+    }
+    else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
+        w->callback(w->data, path, FOLDER_EVENT_REMOVED);
+    }
+}
+
+static int folder_watcher_thread(void *data) {
+    Linux_Folder_Watcher *w = (Linux_Folder_Watcher*)data;
+    alignas(inotify_event) char buffer[16<<10];
+
+    while (!w->want_quit) {
+        pollfd pfd = {w->fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        ssize_t length = read(w->fd, buffer, sizeof(buffer));
+        if (length <= 0) continue;
+
+        for (char *p = buffer; p < buffer + length;) {
+            const inotify_event *event = (const inotify_event*)p;
+            handle_inotify_event(w, event);
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    return 0;
+}
+
+Folder_Watcher create_folder_watcher(const char *const *folders, u32 folder_count,
+                                     Folder_Event_Fn *callback, void *data) {
+    int fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    Linux_Folder_Watcher *w = new Linux_Folder_Watcher();
+    w->fd = fd;
+    w->callback = callback;
+    w->data = data;
+    w->want_quit = false;
+
+    for (u32 i = 0; i < folder_count; ++i) {
+        char folder[PATH_LENGTH];
+        strncpy0(folder, folders[i], PATH_LENGTH);
+        // Reported paths have to match the ones the folder was scanned with
+        u32 length = (u32)strlen(folder);
+        if (length > 1 && folder[length - 1] == '/') folder[length - 1] = 0;
+        watch_folder_tree(w, folder, false);
+    }
+
+    w->thread = thread_create(w, &folder_watcher_thread);
+    return w;
+}
+
+void destroy_folder_watcher(Folder_Watcher watcher) {
+    Linux_Folder_Watcher *w = (Linux_Folder_Watcher*)watcher;
+    if (!w) return;
+
+    w->want_quit = true;
+    thread_join(w->thread);
+    thread_destroy(w->thread);
+    close(w->fd);
+    w->wds.free();
+    w->wd_paths.free();
+    w->string_pool.free();
+    delete w;
+}
+
 #endif
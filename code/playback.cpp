@@ -25,6 +25,7 @@
 #include <samplerate.h>
 #include <math.h>
 #include <string.h>
+#include <atomic>
 
 struct Buffer_View {
     i32 first_frame;
@@ -34,8 +35,25 @@ struct Buffer_View {
 struct Capture_Buffer {
     Array<float> next[MAX_AUDIO_CHANNELS];
     Array<float> prev[MAX_AUDIO_CHANNELS];
+    // DAC time of the first captured frame
     u64 timestamp;
-    u64 first_frame;
+    // DAC time of the first frame in next
+    u64 next_timestamp;
+};
+
+// Maps perf time to the frame of the track at the DAC. Written under g_lock,
+// read without locking through the sequence counter
+struct Playback_Clock {
+    std::atomic_uint32_t sequence;
+    // Frame at the DAC at dac_time, in the track's sample rate
+    std::atomic<i64> frame;
+    // The clock stays within [min_frame, max_frame]. min_frame is the last
+    // seek target so the clock doesn't run backwards into audio from before
+    // a seek. max_frame is the last decoded frame
+    std::atomic<i64> min_frame;
+    std::atomic<i64> max_frame;
+    std::atomic<u64> dac_time;
+    std::atomic<i32> sample_rate;
 };
 
 static Audio_Stream g_stream;
@@ -43,6 +61,46 @@ static Decoder g_decoder;
 static Mutex g_lock;
 static bool g_paused;
 static Capture_Buffer g_capture;
+static Playback_Clock g_clock;
+
+static void set_clock(i64 frame, i64 min_frame, i64 max_frame, u64 dac_time, i32 sample_rate) {
+    g_clock.sequence.fetch_add(1);
+    g_clock.frame = frame;
+    g_clock.min_frame = min_frame;
+    g_clock.max_frame = max_frame;
+    g_clock.dac_time = dac_time;
+    g_clock.sample_rate = sample_rate;
+    g_clock.sequence.fetch_add(1);
+}
+
+static i64 get_clock_frame(u64 now) {
+    i64 frame, min_frame, max_frame;
+    u64 dac_time;
+    i32 sample_rate;
+    u32 sequence;
+
+    do {
+        sequence = g_clock.sequence;
+        frame = g_clock.frame;
+        min_frame = g_clock.min_frame;
+        max_frame = g_clock.max_frame;
+        dac_time = g_clock.dac_time;
+        sample_rate = g_clock.sample_rate;
+    } while ((sequence & 1) || (sequence != g_clock.sequence));
+
+    if (sample_rate <= 0) return frame;
+
+    // dac_time is ahead of now for buffers that are still queued
+    f64 elapsed = (f64)(i64)(now - dac_time) / (f64)perf_time_frequency();
+    frame += (i64)floor(elapsed * (f64)sample_rate);
+    return clamp(frame, min_frame, max_frame);
+}
+
+// Stop the clock at the current frame, or at frame if it's >= 0
+static void hold_clock(i64 frame) {
+    if (frame < 0) frame = get_clock_frame(perf_time_now());
+    set_clock(frame, frame, frame, perf_time_now(), g_decoder.info.samplerate);
+}
 
 static void deinterlace_buffer(f32 *input, u32 frames, u32 in_channels, u32 out_channels, Array<float> *output) {
     u32 sample = 0;
@@ -118,14 +176,16 @@ bool get_playback_buffer_view(Playback_Buffer *buffer, i32 frame_count, Playback
         return false;
     }
     
-    i32 delta_ms = (i32)perf_time_to_millis(perf_time_now() - buffer->timestamp);
-    i32 first_frame;
-    first_frame = delta_ms * (buffer->sample_rate/1000);
-    first_frame = MAX(first_frame, 0);
-    frame_count = MIN(frame_count, buffer->frame_count - first_frame);
-    if (frame_count < 0) return false;
+    // Frame of the buffer that is at the DAC right now
+    f64 elapsed = (f64)(i64)(perf_time_now() - buffer->timestamp) / (f64)perf_time_frequency();
+    i64 position = (i64)floor(elapsed * (f64)buffer->sample_rate);
+    i64 last_frame = clamp(position, (i64)0, (i64)buffer->frame_count);
+    i64 first_frame = MAX(last_frame - frame_count, 0);
+    // Slide the window forward when there isn't enough audio before the position
+    last_frame = MIN(first_frame + frame_count, (i64)buffer->frame_count);
+    if (last_frame <= first_frame) return false;
     
-    view->frame_count = frame_count;
+    view->frame_count = (i32)(last_frame - first_frame);
     view->channels = buffer->channels;
 
     for (i32 i = 0; i < buffer->channels; ++i) {
@@ -145,8 +205,10 @@ void audio_stream_callback(void *user_data, f32 *output_buffer, const Audio_Buff
     }
     
     Decoder *dec = (Decoder*)user_data;
+    i64 first_frame = dec->frame_index;
     Decode_Status status = decoder_decode(dec, output_buffer, spec->frame_count, spec->channel_count, spec->sample_rate);
     if (status == DECODE_STATUS_EOF) notify(NOTIFY_REQUEST_NEXT_TRACK);
+    set_clock(first_frame, g_clock.min_frame, dec->frame_index, spec->dac_time, dec->info.samplerate);
     
     i32 channels = g_stream.channel_count;
 
@@ -163,9 +225,8 @@ void audio_stream_callback(void *user_data, f32 *output_buffer, const Audio_Buff
             channels,
             g_capture.next);
         
-        f32 buffer_seconds = (f32)spec->frame_count/spec->sample_rate;
-        u64 buffer_ticks = (u64)(buffer_seconds * perf_time_frequency());
-        g_capture.timestamp = perf_time_now() - (buffer_ticks/2);
+        g_capture.timestamp = g_capture.next_timestamp;
+        g_capture.next_timestamp = spec->dac_time;
     }
     else {
         deinterlace_buffer(
@@ -175,7 +236,8 @@ void audio_stream_callback(void *user_data, f32 *output_buffer, const Audio_Buff
             channels,
             g_capture.next);
 
-        g_capture.timestamp = perf_time_now();
+        g_capture.timestamp = spec->dac_time;
+        g_capture.next_timestamp = spec->dac_time;
     }
 }
 
@@ -192,6 +254,7 @@ void playback_unload_file() {
     lock_mutex(g_lock);
     interrupt_audio_stream(&g_stream);
     decoder_close(&g_decoder);
+    hold_clock(0);
     unlock_mutex(g_lock);
     for (u32 i = 0; i < MAX_AUDIO_CHANNELS; ++i) {
         g_capture.next[i].free();
@@ -209,6 +272,8 @@ bool playback_load_file(const char *path) {
         notify(NOTIFY_REQUEST_NEXT_TRACK);
         return false;
     }
+
+    hold_clock(0);
     
     if (g_paused) playback_set_paused(false);
     
@@ -224,6 +289,7 @@ void playback_set_paused(bool value) {
     if (!g_decoder.file) return;
     if (g_paused != value) {
         g_paused = value;
+        if (g_paused) hold_clock(-1);
         interrupt_audio_stream(&g_stream);
         notify(NOTIFY_PLAYBACK_STATE_CHANGE);
     }
@@ -268,22 +334,26 @@ void playback_get_file_info(Playback_File_Info *info) {
 
 u64 playback_get_duration_millis() {
     SF_INFO info;
-    u64 seconds;
     if (!g_decoder.file) return 0;
     info = g_decoder.info;
-    seconds = info.frames/info.samplerate;
-    return seconds * 1000;
+    return ((u64)info.frames * 1000) / (u64)info.samplerate;
+}
+
+i64 playback_get_dac_frame() {
+    return get_clock_frame(perf_time_now());
 }
 
 i64 playback_get_position_millis() {
-    if (!g_decoder.file) return 0;
-    return decoder_get_position_millis(&g_decoder);
+    i32 sample_rate = g_clock.sample_rate;
+    if (!g_decoder.file || sample_rate <= 0) return 0;
+    return (playback_get_dac_frame() * 1000) / sample_rate;
 }
 
 void playback_seek_to_millis(i64 ms) {
     if (!g_decoder.file) return;
     lock_mutex(g_lock);
     decoder_seek_millis(&g_decoder, ms);
+    hold_clock(g_decoder.frame_index);
     interrupt_audio_stream(&g_stream);
     unlock_mutex(g_lock);
 }
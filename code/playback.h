@@ -30,6 +30,7 @@ enum Playback_State {
 
 struct Playback_Buffer {
     Array<float> data[MAX_AUDIO_CHANNELS];
+    // Time at which the first frame is played by the device
     u64 timestamp;
     i32 frame_count;
     i32 sample_rate;
@@ -60,13 +61,16 @@ void playback_set_volume(float volume);
 int playback_get_bitrate();
 void playback_get_file_info(Playback_File_Info *info);
 u64 playback_get_duration_millis();
+// Frame of the playing track that the device is playing right now, in the
+// track's sample rate. Interpolated between audio callbacks
+i64 playback_get_dac_frame();
 i64 playback_get_position_millis();
 void playback_seek_to_millis(i64 ms);
 // Copy the global audio buffer if the timestamp doesn't match the timestamp of
 // the provided buffer
 bool playback_update_capture_buffer(Playback_Buffer *buffer);
 // Get a view of the playback buffer going 
-// frame_count frames back from the current position
+// frame_count frames back from the frame at the DAC
 bool get_playback_buffer_view(Playback_Buffer *buffer, i32 frame_count, Playback_Buffer_View *view);
 
 #endif //PLAYBACK_H
@@ -27,240 +27,345 @@
 #include "os.h"
 #include "ui.h"
 #include "decoder.h"
+#include "main.h"
+#include "preferences.h"
+#include "simd.h"
+#include "waveform.h"
+#include "video.h"
+#include "loudness.h"
 
-#define SG_BAND_COUNT 20
 #define PEAK_ROUGHNESS 0.015f
 #define SPECTRUM_ROUGHNESS 0.03f
+#define SPECTRUM_MAX_BANDS Preferences::SPECTRUM_BANDS_MAX
+#define SPECTRUM_MIN_FREQ 20.f
+#define SPECTRUM_MAX_FREQ 20000.f
 #define CAPTURE_CHANNELS PLAYBACK_CAPTURE_CHANNELS
+#define SPECTROGRAM_ROWS 128
+// Width of the spectrogram texture, in columns
+#define SPECTROGRAM_HISTORY 512
+#define SPECTROGRAM_QUEUE_SIZE 64
+// Analyzers that need continuous input keep running this long after the UI
+// last asked for them
+#define REQUEST_TIMEOUT_MS 500.f
 
-static int SG_BAND_OFFSETS[] = {
-    0,
-    50,
-    70,
-    100,
-    130,
-    180,
-    250,
-    330,
-    450,
-    620,
-    850,
-    1200,
-    1600,
-    2200,
-    3000,
-    4100,
-    5600,
-    7700,
-    11000,
-    14000,
-    20000,
+struct Spectrum {
+    f32 peaks[SPECTRUM_MAX_BANDS];
 };
 
-struct Spectrum {
-    f32 peaks[SG_BAND_COUNT];
+// Maps FFT bins to log-spaced bands. Rebuilt whenever the FFT size,
+// sample rate or band count changes
+struct Spectrum_Band_Table {
+    u32 fft_size;
+    i32 sample_rate;
+    u32 band_count;
+    // Band i covers bins [first_bin[i], first_bin[i] + bin_count[i])
+    u32 first_bin[SPECTRUM_MAX_BANDS];
+    u32 bin_count[SPECTRUM_MAX_BANDS];
+    // Upper edge of each band in Hz, used for labels
+    f32 upper_freq[SPECTRUM_MAX_BANDS];
+};
+
+// FFT plan and scratch buffers. Each thread that runs FFTs needs its own
+struct Spectrum_FFT {
+#ifdef _WIN32
+    kiss_fftr_cfg cfg;
+    Array<kiss_fft_cpx> buffer;
+#endif
+    u32 fft_size;
+    Array<f32> power;
 };
 
 struct Waveform_Preview {
-    Decoder decoder;
-    Array<f32> output;
-    std::atomic_uint32_t output_count;
-    std::atomic_bool want_cancel;
-    Thread thread;
+    Waveform waveform;
+    Waveform_Generator generator;
     Track track;
 };
 
-struct Playback_Metrics {
+// Analyzer output. The analysis thread copies its results into a back buffer
+// and swaps it with the shared one, the UI swaps the shared one with its
+// front buffer once per frame
+struct Analyzer_Results {
     Spectrum spectrum;
+    u32 band_count;
+    f32 band_upper_freq[SPECTRUM_MAX_BANDS];
     f32 peak[MAX_AUDIO_CHANNELS];
+    i32 channels;
+    // Meters, only updated while the peak meter window is shown
+    f32 true_peak[MAX_AUDIO_CHANNELS];
+    f32 rms[MAX_AUDIO_CHANNELS];
+    f32 momentary_loudness;
+    f32 short_term_loudness;
+};
+
+struct Spectrogram_Column {
+    u8 rows[SPECTROGRAM_ROWS];
+};
+
+struct Playback_Analyzer {
+    Thread thread;
+    std::atomic_bool want_quit;
+    // Requested by the UI, read by the analysis thread
+    std::atomic_bool need_update_peak;
+    std::atomic_bool need_update_spectrum;
+    std::atomic_uint32_t band_count;
+    // Spectrogram columns are produced for as long as the UI has asked for
+    // them recently, so the history has no gaps between UI frames
+    std::atomic<u64> spectrogram_requested_at;
+    std::atomic<u64> meters_requested_at;
+
+    // Single producer, single consumer queue of spectrogram columns.
+    // spectrogram_written counts every column ever written
+    Spectrogram_Column spectrogram_queue[SPECTROGRAM_QUEUE_SIZE];
+    std::atomic_uint32_t spectrogram_written;
+
+    // Triple buffer. shared holds the index of the buffer that is neither
+    // being written nor read, with RESULTS_FRESH set if it's newer than front
+    Analyzer_Results results[3];
+    std::atomic_uint32_t shared;
+    u32 back;
+    u32 front;
+
+    // Owned by the analysis thread
+    Analyzer_Results state;
+    Playback_Buffer buffer;
+    Spectrum_Band_Table band_table;
+    Spectrum_Band_Table spectrogram_table;
+    Array<f32> hann;
+    Array<f32> windowed;
+    Spectrum_FFT fft;
+    Loudness_Meter loudness;
+    // Fraction of a frame carried over between loudness updates
+    f64 loudness_frame_remainder;
+    bool meters_running;
+#ifndef NDEBUG
+    std::atomic<f32> update_ms_average;
+    std::atomic<f32> update_ms_max;
+#endif
+};
+
+// UI side of the spectrogram. Columns are written into the texture as a
+// ring, next_column being both the next to write and the oldest
+struct Spectrogram {
+    Texture *texture;
+    u32 next_column;
+    u32 read_count;
+};
+
+struct Playback_Metrics {
     Waveform_Preview waveform_preview;
-    bool need_update_peak;
-    bool need_update_spectrum;
+    Spectrogram spectrogram;
     bool need_update_waveform_preview;
 };
 
-static Playback_Buffer g_buffer;
-static Playback_Metrics g_metrics;
+#define RESULTS_FRESH 0x4
+// Frames between analyzer updates
+#define ANALYZER_HOP_FRAMES 512
+// Largest window the spectrum is calculated over
+#define ANALYZER_WINDOW_FRAMES 1024
 
-static void hann_window(Playback_Buffer_View *in, Playback_Buffer_View *out) {
-    f32 *out_data[MAX_AUDIO_CHANNELS];
-    const int n = in->frame_count;
+static Playback_Analyzer g_analyzer;
+static Playback_Metrics g_metrics;
 
-    out->frame_count = in->frame_count;
-    out->channels = in->channels;
+static const Analyzer_Results& get_results() {
+    return g_analyzer.results[g_analyzer.front];
+}
 
-    for (int channel = 0; channel < in->channels; ++channel) {
-        out_data[channel] = (f32 *)malloc(sizeof(f32) * in->frame_count);
-        f32 *channel_data = out_data[channel];
-        memcpy(channel_data, in->data[channel], n * sizeof(f32));
+static void publish_results() {
+    g_analyzer.results[g_analyzer.back] = g_analyzer.state;
+    u32 prev = g_analyzer.shared.exchange(g_analyzer.back | RESULTS_FRESH);
+    g_analyzer.back = prev & ~RESULTS_FRESH;
+}
 
-        for (int i = 0; i < in->frame_count; ++i) {
-            f32 mul = 0.5f * (1 - cosf(2 * PI * i / (n - 1)));
-            channel_data[i] *= mul;
-        }
+static void acquire_results() {
+    if (g_analyzer.shared & RESULTS_FRESH) {
+        u32 prev = g_analyzer.shared.exchange(g_analyzer.front);
+        g_analyzer.front = prev & ~RESULTS_FRESH;
+    }
+}
 
-        out->data[channel] = channel_data;
+static void build_hann_table(Array<f32>& table, u32 n) {
+    table.clear();
+    table.push(n);
+    for (u32 i = 0; i < n; ++i) {
+        table[i] = 0.5f * (1 - cosf(2 * PI * i / (n - 1)));
     }
 }
 
-static void free_windowed_view(Playback_Buffer_View *view) {
-    for (int i = 0; i < view->channels; ++i) {
-       free((void*)view->data[i]);
+static void hann_window(const f32 *in, const f32 *table, f32 *out, u32 n) {
+    for (u32 i = 0; i < n; ++i) {
+        out[i] = in[i] * table[i];
     }
 }
 
 f32 get_playback_peak() {
-    g_metrics.need_update_peak = true;
+    const Analyzer_Results& results = get_results();
+    g_analyzer.need_update_peak = true;
     f32 sum = 0.f;
-    i32 channels = g_buffer.channels;
+    i32 channels = results.channels;
+    if (!channels) return 0.f;
 
     for (i32 i = 0; i < channels; ++i) {
-        sum += g_metrics.peak[i];
+        sum += results.peak[i];
     }
 
     return sum / channels;
 }
 
 int get_playback_channel_peaks(f32 *out) {
-    g_metrics.need_update_peak = true;
-    for (int i = 0; i < g_buffer.channels; ++i) out[i] = g_metrics.peak[i];
-    return g_buffer.channels;
+    const Analyzer_Results& results = get_results();
+    g_analyzer.need_update_peak = true;
+    for (int i = 0; i < results.channels; ++i) out[i] = results.peak[i];
+    return results.channels;
 }
 
-void calc_frame_peak(Playback_Buffer_View *view, f32 *out) {
-
+static void calc_frame_levels(Playback_Buffer_View *view, f32 *peak, f32 *rms) {
     for (i32 ch = 0; ch < view->channels; ++ch) {
-        const f32 *buffer = view->data[ch];
-        out[ch] = 0.f;
-        for (i32 i = 0; i < view->frame_count; ++i) {
-            f32 v = fabsf(buffer[i]);
-            out[ch] = MAX(v, out[ch]);
-        }
+        f32 min, max, sumsq;
+        simd_interleaved_min_max_sumsq(view->data[ch], view->frame_count, 1, &min, &max, &sumsq);
+        peak[ch] = MAX(-min, max);
+        rms[ch] = view->frame_count ? sqrtf(sumsq / (f32)view->frame_count) : 0.f;
     }
 }
 
-static void calc_spectrum(Playback_Buffer_View *view, Spectrum *sg) {
-    // @FixForLinux
-#ifdef _WIN32
-    static kiss_fftr_cfg cfg = NULL;
-    static u32 cfg_frame_count = 0;
-    if (!cfg) {
-        cfg_frame_count = view->frame_count;
-        cfg = kiss_fftr_alloc(cfg_frame_count, 0, NULL, NULL);
-    }
-
-    if (view->frame_count != cfg_frame_count) {
-        kiss_fftr_free(cfg);
-        cfg_frame_count = view->frame_count;
-        cfg = kiss_fftr_alloc(cfg_frame_count, 0, NULL, NULL);
-    }
+static bool requested_recently(u64 requested_at) {
+    return perf_time_to_millis(perf_time_now() - requested_at) < REQUEST_TIMEOUT_MS;
+}
 
-    kiss_fft_cpx *buffer = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * view->frame_count);
-    defer(free(buffer));
+static f32 amplitude_to_db(f32 v) {
+    if (v <= 0.f) return LOUDNESS_SILENCE;
+    return MAX(LOUDNESS_SILENCE, 20.f * log10f(v));
+}
 
-    kiss_fftr(cfg, view->data[0], buffer);
+static void build_band_table(Spectrum_Band_Table *table, u32 fft_size, i32 sample_rate, u32 band_count) {
+    const u32 output_count = (fft_size / 2) + 1;
+    const f32 bin_width = (f32)sample_rate / (f32)fft_size;
+    const f32 max_freq = MIN(SPECTRUM_MAX_FREQ, (f32)sample_rate * 0.5f);
+    const f32 ratio = max_freq / SPECTRUM_MIN_FREQ;
+
+    table->fft_size = fft_size;
+    table->sample_rate = sample_rate;
+    table->band_count = band_count;
+
+    f32 lower = SPECTRUM_MIN_FREQ;
+    for (u32 band = 0; band < band_count; ++band) {
+        f32 upper = SPECTRUM_MIN_FREQ * powf(ratio, (f32)(band + 1) / (f32)band_count);
+        u32 first = (u32)ceilf(lower / bin_width);
+        u32 last = (u32)ceilf(upper / bin_width);
+
+        // Bands narrower than a bin take the bin nearest to their center
+        if (last <= first) {
+            first = (u32)roundf(sqrtf(lower * upper) / bin_width);
+            last = first + 1;
+        }
 
-    int output_count = (view->frame_count / 2) + 1;
-    int base_band_width = 60;
-    int freq_step = 22050 / view->frame_count;
+        // Never use the DC bin
+        first = clamp(first, 1u, output_count - 1);
+        last = clamp(last, first + 1, output_count);
 
-    for (u32 i = 0; i < SG_BAND_COUNT; ++i) {
-        sg->peaks[i] = 0.f;
+        table->first_bin[band] = first;
+        table->bin_count[band] = last - first;
+        table->upper_freq[band] = upper;
+        lower = upper;
     }
+}
 
-    for (int i = 0; i < output_count; ++i) {
-        int freq = i * freq_step;
-        int band = 0;
-
-        while (!(freq >= SG_BAND_OFFSETS[band] && freq <= SG_BAND_OFFSETS[band + 1]) && band < (SG_BAND_COUNT-1))
-            band++;
-
-        kiss_fft_cpx frame = buffer[i];
-
-        f32 mag = sqrtf((frame.r * frame.r) + (frame.i * frame.i));
-        mag = log10f(mag);
-        if (mag < 0.f) mag = 0.f;
+static void free_spectrum_fft(Spectrum_FFT *fft) {
+#ifdef _WIN32
+    if (fft->cfg) kiss_fftr_free(fft->cfg);
+    fft->cfg = NULL;
+    fft->buffer.free();
+#endif
+    fft->power.free();
+    fft->fft_size = 0;
+}
 
-        sg->peaks[band] = MAX(mag, sg->peaks[band]);
+// Power of each FFT bin of a windowed signal. Returns NULL if there is no FFT
+// on this platform. The result is valid until the next call with the same fft
+static const f32 *calc_power_spectrum(Spectrum_FFT *fft, const f32 *windowed, u32 fft_size) {
+    // @FixForLinux
+#ifdef _WIN32
+    const u32 output_count = (fft_size / 2) + 1;
+
+    if (fft_size != fft->fft_size) {
+        if (fft->cfg) kiss_fftr_free(fft->cfg);
+        fft->fft_size = fft_size;
+        fft->cfg = kiss_fftr_alloc(fft_size, 0, NULL, NULL);
+        fft->buffer.clear();
+        fft->buffer.push(output_count);
+        fft->power.clear();
+        fft->power.push(output_count);
     }
 
-    for (int i = 0; i < SG_BAND_COUNT; ++i) {
-        sg->peaks[i] /= 2.6f;
-    }
+    kiss_fftr(fft->cfg, windowed, fft->buffer.data);
+    simd_complex_power((const f32*)fft->buffer.data, fft->power.data, output_count);
+    return fft->power.data;
+#else
+    return NULL;
 #endif
 }
 
-static int fill_waveform_preview(void *dont_care) {
-    Waveform_Preview *wp = &g_metrics.waveform_preview;
-    Decoder *dec = &wp->decoder;
-    int samplerate = dec->info.samplerate;
-    int channels = dec->info.channels;
-    int segment_size = dec->info.frames / 1024;
-    Array<f32> buffer = {};
-    buffer.push(segment_size * channels);
-
-    wp->output.push(dec->info.frames / segment_size);
-
-    const f32 *input = buffer.data;
-
-    while (decoder_decode(dec, buffer.data, segment_size, channels, samplerate) == DECODE_STATUS_COMPLETE) {
-        f32 peak = 0.f;
-
-        for (int i = 0; i < segment_size; ++i) {
-            peak = MAX(fabsf(input[i]), peak);
-        }
-
-        wp->output[wp->output_count] = clamp(peak, 0.f, 1.f);
-        wp->output_count++;
-
-        if (wp->want_cancel) return 0;
+// Reduce to the peak power of each band before taking the log, so the
+// sqrt/log only runs once per band instead of once per bin.
+// log10(sqrt(x)) == 0.5 * log10(x)
+static void reduce_to_bands(const f32 *power, const Spectrum_Band_Table *table, f32 *out) {
+    for (u32 band = 0; band < table->band_count; ++band) {
+        f32 peak = simd_max(&power[table->first_bin[band]], table->bin_count[band]);
+        f32 mag = peak > 1.f ? 0.5f * log10f(peak) : 0.f;
+        out[band] = mag / 2.6f;
     }
+}
 
-    return 0;
+static void calc_spectrum(Spectrum_FFT *fft, Playback_Buffer_View *view, const Spectrum_Band_Table *table,
+                          Spectrum *sg) {
+    ASSERT(view->frame_count >= (i32)table->fft_size);
+    const f32 *power = calc_power_spectrum(fft, view->data[0], table->fft_size);
+    if (power) reduce_to_bands(power, table, sg->peaks);
 }
 
-bool get_waveform_preview(f32 **buffer, u32 *sample_count, u32 *length) {
+const Waveform *get_waveform_preview() {
     Waveform_Preview *wp = &g_metrics.waveform_preview;
     g_metrics.need_update_waveform_preview = true;
-    if (wp->output_count != 0) {
-        *buffer = wp->output.data;
-        *length = wp->output.count;
-        *sample_count = wp->output_count;
-        return true;
-    }
-    return false;
+    if (wp->waveform.level_count != 0) return &wp->waveform;
+    return NULL;
 }
 
 void show_spectrum_widget(const char *str_id, float width) {
-    const Spectrum &sg = g_metrics.spectrum;
-    g_metrics.need_update_spectrum = true;
+    const Analyzer_Results& results = get_results();
+    g_analyzer.need_update_spectrum = true;
     ImGui::PushStyleColor(ImGuiCol_FrameBg, 0);
-    ImGui::PlotHistogram(str_id, sg.peaks, SG_BAND_COUNT, 0, NULL, 0.f, 1.f, ImVec2(width, 0));
+    ImGui::PlotHistogram(str_id, results.spectrum.peaks, results.band_count, 0, NULL, 0.f, 1.f, ImVec2(width, 0));
     ImGui::PopStyleColor();
 }
 
 void show_spectrum_ui() {
-    g_metrics.need_update_spectrum = true;
+    const Analyzer_Results& results = get_results();
+    g_analyzer.need_update_spectrum = true;
     ImDrawList *drawlist = ImGui::GetWindowDrawList();
     ImVec2 cursor = ImGui::GetCursorScreenPos();
     ImVec2 region = ImGui::GetContentRegionAvail();
-    f32 bar_width = (region.x / SG_BAND_COUNT) - 1;
-    const Spectrum &sg = g_metrics.spectrum;
+    const Spectrum &sg = results.spectrum;
+    if (!results.band_count) return;
+    f32 bar_width = (region.x / results.band_count) - 1;
 
     ui_push_mini_font();
     f32 line_height = ImGui::GetTextLineHeight();
     f32 max_bar_height = region.y - line_height;
-    for (u32 band = 0; band < SG_BAND_COUNT; ++band) {
+    f32 y_offset = cursor.y + region.y - line_height;
+    f32 next_label_x = cursor.x;
+    for (u32 band = 0; band < results.band_count; ++band) {
         f32 peak = sg.peaks[band];
-        char freq_text[7] = {};
-        int freq = SG_BAND_OFFSETS[band+1];
-        f32 y_offset = cursor.y + region.y - line_height;
 
-        if (freq < 1000) snprintf(freq_text, 7, "%d", freq);
-        else snprintf(freq_text, 7, "%.1fK", (f32)freq / 1000.f);
+        // Only label bands when there is room for the text
+        if (cursor.x >= next_label_x) {
+            char freq_text[8] = {};
+            int freq = (int)results.band_upper_freq[band];
+            if (freq < 1000) snprintf(freq_text, 8, "%d", freq);
+            else snprintf(freq_text, 8, "%.1fK", (f32)freq / 1000.f);
 
-        drawlist->AddText(ImVec2(cursor.x, y_offset),
-            ImGui::GetColorU32(ImGuiCol_TextDisabled), freq_text);
+            drawlist->AddText(ImVec2(cursor.x, y_offset),
+                ImGui::GetColorU32(ImGuiCol_TextDisabled), freq_text);
+            next_label_x = cursor.x + ImGui::CalcTextSize(freq_text).x + 4.f;
+        }
 
         drawlist->AddRectFilled(
             ImVec2(cursor.x, y_offset),
@@ -273,73 +378,301 @@ void show_spectrum_ui() {
 }
 
 void show_channel_peaks_ui() {
-    g_metrics.need_update_peak = true;
+    const Analyzer_Results& results = get_results();
+    g_analyzer.need_update_peak = true;
+    g_analyzer.meters_requested_at = perf_time_now();
     ImDrawList *drawlist = ImGui::GetWindowDrawList();
     ImVec2 cursor = ImGui::GetCursorScreenPos();
     ImVec2 region = ImGui::GetContentRegionAvail();
-    f32 bar_width = (region.x / g_buffer.channels) - 1;
-    const f32 *peaks = g_metrics.peak;
-
-    f32 max_bar_height = region.y;
-    for (i32 ch = 0; ch < g_buffer.channels; ++ch) {
-        f32 peak = peaks[ch];
-        f32 y_offset = cursor.y + region.y;
+    if (!results.channels) return;
+    f32 bar_width = (region.x / results.channels) - 1;
+    const f32 *peaks = results.peak;
+    const f32 left = cursor.x;
+    f32 max_true_peak = 0.f;
+    f32 max_rms = 0.f;
 
-        peak = clamp(peak, 0.f, 1.f);
+    ui_push_mini_font();
+    f32 line_height = ImGui::GetTextLineHeight();
+    f32 max_bar_height = region.y - line_height;
+    f32 y_offset = cursor.y + max_bar_height;
+    for (i32 ch = 0; ch < results.channels; ++ch) {
+        f32 peak = clamp(peaks[ch], 0.f, 1.f);
+        f32 rms = clamp(results.rms[ch], 0.f, 1.f);
+        f32 true_peak = clamp(results.true_peak[ch], 0.f, 1.f);
 
         drawlist->AddRectFilled(
             ImVec2(cursor.x, y_offset),
             ImVec2(cursor.x + bar_width, y_offset - (peak * max_bar_height)),
             ImGui::GetColorU32(ImGuiCol_PlotHistogram));
+        drawlist->AddRectFilled(
+            ImVec2(cursor.x, y_offset),
+            ImVec2(cursor.x + bar_width, y_offset - (rms * max_bar_height)),
+            ImGui::GetColorU32(ImGuiCol_PlotHistogramHovered));
+        drawlist->AddRectFilled(
+            ImVec2(cursor.x, y_offset - (true_peak * max_bar_height)),
+            ImVec2(cursor.x + bar_width, y_offset - (true_peak * max_bar_height) + 2.f),
+            ImGui::GetColorU32(ImGuiCol_PlotLinesHovered));
 
+        max_true_peak = MAX(max_true_peak, results.true_peak[ch]);
+        max_rms = MAX(max_rms, results.rms[ch]);
         cursor.x += bar_width + 1;
     }
+
+    char text[128];
+    snprintf(text, sizeof(text), "TP %.1f dBTP  RMS %.1f dB  M %.1f LUFS  S %.1f LUFS",
+        amplitude_to_db(max_true_peak), amplitude_to_db(max_rms),
+        results.momentary_loudness, results.short_term_loudness);
+    drawlist->AddText(ImVec2(left, y_offset),
+        ImGui::GetColorU32(ImGuiCol_TextDisabled), text);
+    ui_pop_mini_font();
+}
+
+void show_spectrogram_ui() {
+    Spectrogram *sg = &g_metrics.spectrogram;
+    g_analyzer.spectrogram_requested_at = perf_time_now();
+
+    if (!sg->texture) {
+        sg->texture = create_streaming_texture(SPECTROGRAM_HISTORY, SPECTROGRAM_ROWS);
+        sg->read_count = g_analyzer.spectrogram_written;
+        if (!sg->texture) return;
+    }
+
+    // Upload only the columns produced since the last frame. If we fell
+    // behind, skip ahead rather than read columns that are being overwritten
+    u32 written = g_analyzer.spectrogram_written;
+    if (written - sg->read_count > SPECTROGRAM_QUEUE_SIZE/2) {
+        sg->read_count = written - SPECTROGRAM_QUEUE_SIZE/2;
+    }
+
+    for (; sg->read_count != written; ++sg->read_count) {
+        const Spectrogram_Column &column = g_analyzer.spectrogram_queue[sg->read_count % SPECTROGRAM_QUEUE_SIZE];
+        u32 pixels[SPECTROGRAM_ROWS];
+        // Low frequencies at the bottom. Intensity goes in alpha so the
+        // theme color can be applied when drawing
+        for (u32 row = 0; row < SPECTROGRAM_ROWS; ++row) {
+            pixels[row] = IM_COL32(255, 255, 255, column.rows[SPECTROGRAM_ROWS - 1 - row]);
+        }
+        update_texture_region(sg->texture, sg->next_column, 0, 1, SPECTROGRAM_ROWS, pixels, sizeof(u32));
+        sg->next_column = (sg->next_column + 1) % SPECTROGRAM_HISTORY;
+    }
+
+    ImDrawList *drawlist = ImGui::GetWindowDrawList();
+    ImVec2 cursor = ImGui::GetCursorScreenPos();
+    ImVec2 region = ImGui::GetContentRegionAvail();
+    u32 color = ImGui::GetColorU32(ImGuiCol_PlotHistogram);
+    f32 split = (f32)sg->next_column / (f32)SPECTROGRAM_HISTORY;
+    f32 split_x = cursor.x + (region.x * (1.f - split));
+
+    // Draw the ring oldest to newest, left to right
+    drawlist->AddImage(sg->texture, cursor, ImVec2(split_x, cursor.y + region.y),
+        ImVec2(split, 0), ImVec2(1, 1), color);
+    drawlist->AddImage(sg->texture, ImVec2(split_x, cursor.y), ImVec2(cursor.x + region.x, cursor.y + region.y),
+        ImVec2(0, 0), ImVec2(split, 1), color);
+}
+
+// True-peak and loudness. Loudness needs every frame exactly once, so only the
+// frames that reached the DAC since the last update are fed to it
+static void run_meters(Playback_Buffer_View *view, i32 sample_rate, f32 delta_ms, Analyzer_Results *results) {
+    Loudness_Meter *meter = &g_analyzer.loudness;
+    const f32 peak_t = MIN(delta_ms*PEAK_ROUGHNESS, 1.f);
+
+    if (meter->channels != view->channels || meter->sample_rate != sample_rate) {
+        loudness_init(meter, view->channels, sample_rate, false);
+        g_analyzer.meters_running = false;
+    }
+
+    if (!g_analyzer.meters_running) {
+        loudness_reset(meter);
+        g_analyzer.loudness_frame_remainder = 0.0;
+        g_analyzer.meters_running = true;
+    }
+    else {
+        f64 new_frames = ((f64)delta_ms / 1000.0) * (f64)sample_rate + g_analyzer.loudness_frame_remainder;
+        u32 frame_count = (u32)new_frames;
+        const f32 *channels[MAX_AUDIO_CHANNELS];
+
+        g_analyzer.loudness_frame_remainder = new_frames - (f64)frame_count;
+        frame_count = MIN(frame_count, (u32)view->frame_count);
+        for (i32 ch = 0; ch < view->channels; ++ch) {
+            channels[ch] = view->data[ch] + (view->frame_count - frame_count);
+        }
+        loudness_process_planar(meter, channels, frame_count);
+    }
+
+    results->momentary_loudness = loudness_get_momentary(meter);
+    results->short_term_loudness = loudness_get_short_term(meter);
+
+    // Hold true-peaks and let them fall slowly
+    for (i32 ch = 0; ch < view->channels; ++ch) {
+        f32 tp = true_peak(view->data[ch], view->frame_count);
+        results->true_peak[ch] = MAX(tp, lerp(results->true_peak[ch], tp, peak_t));
+    }
 }
 
-void update_playback_analyzers(f32 delta_ms) {
-    u32 rounded_delta = (u32)ceilf(delta_ms);
-    playback_update_capture_buffer(&g_buffer);
-    
-    Playback_Buffer_View windowed_view = {};
+// Runs one analyzer update over the newest captured audio
+static void run_analyzers(f32 delta_ms) {
+    Playback_Buffer *buffer = &g_analyzer.buffer;
+    Analyzer_Results *results = &g_analyzer.state;
+    const u32 band_count = g_analyzer.band_count;
+    const f32 spectrum_t = MIN(delta_ms*SPECTRUM_ROUGHNESS, 1.f);
+    const f32 peak_t = MIN(delta_ms*PEAK_ROUGHNESS, 1.f);
+    playback_update_capture_buffer(buffer);
+
     Playback_Buffer_View view = {};
-    u32 frames_wanted = (g_buffer.sample_rate/1000)*rounded_delta;
-    get_playback_buffer_view(&g_buffer, frames_wanted, &view);
-    
+    get_playback_buffer_view(buffer, ANALYZER_WINDOW_FRAMES, &view);
+    results->channels = buffer->channels;
+
     if (view.frame_count == 0 || !view.data[0]) {
-        for (int i = 0; i < SG_BAND_COUNT; ++i) {
-            g_metrics.spectrum.peaks[i] = lerp(g_metrics.spectrum.peaks[i], 0, delta_ms*SPECTRUM_ROUGHNESS);
+        for (u32 i = 0; i < results->band_count; ++i) {
+            results->spectrum.peaks[i] = lerp(results->spectrum.peaks[i], 0, spectrum_t);
         }
 
-        for (int i = 0; i < g_buffer.channels; ++i) {
-            g_metrics.peak[i] = lerp(g_metrics.peak[i], 0.f, delta_ms*PEAK_ROUGHNESS);
+        for (int i = 0; i < results->channels; ++i) {
+            results->peak[i] = lerp(results->peak[i], 0.f, peak_t);
+            results->true_peak[i] = lerp(results->true_peak[i], 0.f, peak_t);
+            results->rms[i] = lerp(results->rms[i], 0.f, peak_t);
         }
 
+        results->momentary_loudness = LOUDNESS_SILENCE;
+        results->short_term_loudness = LOUDNESS_SILENCE;
+        g_analyzer.meters_running = false;
         return;
     }
-    
-    hann_window(&view, &windowed_view);
-    defer(free_windowed_view(&windowed_view));
 
-    if (g_metrics.need_update_peak) {
-        g_metrics.need_update_peak = false;
+    const bool want_meters = requested_recently(g_analyzer.meters_requested_at);
+    if (g_analyzer.need_update_peak || want_meters) {
+        g_analyzer.need_update_peak = false;
         f32 cur_peak[MAX_AUDIO_CHANNELS];
-        calc_frame_peak(&view, cur_peak);
-        for (int ch = 0; ch < g_buffer.channels; ++ch) {
-            g_metrics.peak[ch] = lerp(g_metrics.peak[ch], cur_peak[ch], delta_ms*PEAK_ROUGHNESS);
+        f32 cur_rms[MAX_AUDIO_CHANNELS];
+        calc_frame_levels(&view, cur_peak, cur_rms);
+        for (int ch = 0; ch < results->channels; ++ch) {
+            results->peak[ch] = lerp(results->peak[ch], cur_peak[ch], peak_t);
+            results->rms[ch] = lerp(results->rms[ch], cur_rms[ch], peak_t);
         }
     }
 
-    if (g_metrics.need_update_spectrum) {
-        Spectrum frame_sg;
-        f32 *peaks = g_metrics.spectrum.peaks;
+    if (want_meters) {
+        run_meters(&view, buffer->sample_rate, delta_ms, results);
+    }
+    else {
+        g_analyzer.meters_running = false;
+    }
+
+    const bool want_spectrum = g_analyzer.need_update_spectrum;
+    const bool want_spectrogram = requested_recently(g_analyzer.spectrogram_requested_at);
+
+    if ((want_spectrum || want_spectrogram) && (view.frame_count >= 2) && (buffer->sample_rate > 0)) {
+        Spectrum_Band_Table *table = &g_analyzer.band_table;
+        Spectrum_Band_Table *sg_table = &g_analyzer.spectrogram_table;
+        f32 *peaks = results->spectrum.peaks;
+        // Real FFT needs an even size
+        u32 fft_size = (u32)view.frame_count & ~1u;
+
+        if (table->fft_size != fft_size || table->sample_rate != buffer->sample_rate ||
+            table->band_count != band_count) {
+            build_band_table(table, fft_size, buffer->sample_rate, band_count);
+            build_band_table(sg_table, fft_size, buffer->sample_rate, SPECTROGRAM_ROWS);
+            build_hann_table(g_analyzer.hann, fft_size);
+            g_analyzer.windowed.clear();
+            g_analyzer.windowed.push(fft_size);
+
+            if (results->band_count != band_count) {
+                zero_array(peaks, SPECTRUM_MAX_BANDS);
+                results->band_count = band_count;
+            }
+            memcpy(results->band_upper_freq, table->upper_freq, sizeof(table->upper_freq));
+        }
+
+        // Only the first channel goes into the spectrum
+        hann_window(view.data[0], g_analyzer.hann.data, g_analyzer.windowed.data, fft_size);
+        const f32 *power = calc_power_spectrum(&g_analyzer.fft, g_analyzer.windowed.data, fft_size);
 
-        calc_spectrum(&windowed_view, &frame_sg);
-        for (u32 i = 0; i < SG_BAND_COUNT; ++i) {
-            peaks[i] = lerp(peaks[i], frame_sg.peaks[i], delta_ms*SPECTRUM_ROUGHNESS);
+        if (power && want_spectrum) {
+            Spectrum frame_sg = {};
+            reduce_to_bands(power, table, frame_sg.peaks);
+            for (u32 i = 0; i < table->band_count; ++i) {
+                peaks[i] = lerp(peaks[i], frame_sg.peaks[i], spectrum_t);
+            }
+            g_analyzer.need_update_spectrum = false;
+        }
+
+        if (power && want_spectrogram) {
+            u32 index = g_analyzer.spectrogram_written;
+            Spectrogram_Column *column = &g_analyzer.spectrogram_queue[index % SPECTROGRAM_QUEUE_SIZE];
+            f32 rows[SPECTROGRAM_ROWS];
+            reduce_to_bands(power, sg_table, rows);
+            for (u32 i = 0; i < SPECTROGRAM_ROWS; ++i) {
+                column->rows[i] = (u8)(clamp(rows[i], 0.f, 1.f) * 255.f);
+            }
+            g_analyzer.spectrogram_written = index + 1;
         }
-        g_metrics.need_update_spectrum = false;
+    }
+}
+
+static int analyzer_thread(void *data) {
+    u64 last_update = perf_time_now();
+
+    while (!g_analyzer.want_quit) {
+        u64 update_start = perf_time_now();
+        f32 delta_ms = perf_time_to_millis(update_start - last_update);
+        last_update = update_start;
+
+        run_analyzers(delta_ms);
+        publish_results();
+
+        f32 ms = perf_time_to_millis(perf_time_now() - update_start);
+#ifndef NDEBUG
+        g_analyzer.update_ms_average = lerp(g_analyzer.update_ms_average.load(), ms, 0.05f);
+        g_analyzer.update_ms_max = MAX(g_analyzer.update_ms_max.load(), ms);
+#endif
+
+        // Wait out the rest of the hop
+        i32 sample_rate = g_analyzer.buffer.sample_rate > 0 ? g_analyzer.buffer.sample_rate : 44100;
+        f32 hop_ms = (f32)ANALYZER_HOP_FRAMES * 1000.f / (f32)sample_rate;
+        if (ms < hop_ms) sleep_milliseconds((u32)(hop_ms - ms));
+    }
+
+    return 0;
+}
+
+void playback_analysis_init() {
+    g_analyzer.want_quit = false;
+    g_analyzer.need_update_peak = false;
+    g_analyzer.need_update_spectrum = false;
+    g_analyzer.band_count = (u32)get_preferences().spectrum_band_count;
+    g_analyzer.back = 0;
+    g_analyzer.shared = 1;
+    g_analyzer.front = 2;
+    g_analyzer.thread = thread_create(NULL, &analyzer_thread);
+}
+
+void playback_analysis_deinit() {
+    Waveform_Preview *wp = &g_metrics.waveform_preview;
+
+    if (g_analyzer.thread) {
+        g_analyzer.want_quit = true;
+        thread_join(g_analyzer.thread);
+        thread_destroy(g_analyzer.thread);
+        g_analyzer.thread = NULL;
     }
 
+    for (u32 i = 0; i < MAX_AUDIO_CHANNELS; ++i) {
+        g_analyzer.buffer.data[i].free();
+    }
+    g_analyzer.hann.free();
+    g_analyzer.windowed.free();
+    free_spectrum_fft(&g_analyzer.fft);
+    loudness_free(&g_analyzer.loudness);
+
+    waveform_generator_stop(&wp->generator);
+    waveform_free(&wp->waveform);
+    if (g_metrics.spectrogram.texture) destroy_texture(&g_metrics.spectrogram.texture);
+}
+
+void update_playback_analyzers() {
+    g_analyzer.band_count = (u32)get_preferences().spectrum_band_count;
+    acquire_results();
+
     if (g_metrics.need_update_waveform_preview) {
         Waveform_Preview *wp = &g_metrics.waveform_preview;
         Track track = ui_get_playing_track();
@@ -349,21 +682,109 @@ void update_playback_analyzers(f32 delta_ms) {
             wp->track = track;
             library_get_track_path(track, path);
 
-            if (wp->thread) {
-                wp->want_cancel = true;
-                thread_join(wp->thread);
-                wp->want_cancel = false;
-                thread_destroy(wp->thread);
-                decoder_close(&wp->decoder);
+            waveform_generator_stop(&wp->generator);
+            waveform_free(&wp->waveform);
+            if (!waveform_load_from_cache(path, &wp->waveform)) {
+                waveform_generator_start(&wp->generator, &wp->waveform, path);
             }
+        }
+    }
+}
+
+#ifndef NDEBUG
+void get_playback_analyzer_timings(f32 *average_ms, f32 *max_ms) {
+    *average_ms = g_analyzer.update_ms_average;
+    *max_ms = g_analyzer.update_ms_max;
+}
+
+void reset_playback_analyzer_timings() {
+    g_analyzer.update_ms_average = 0.f;
+    g_analyzer.update_ms_max = 0.f;
+}
+
+void benchmark_playback_analyzers() {
+#ifdef _WIN32
+    static const u32 fft_sizes[] = {512, 1024, 2048, 4096};
+    static const u32 band_counts[] = {20, 64, 128, 256};
+    const i32 sample_rate = 48000;
+    const u32 iterations = 1000;
+    // Separate from the analyzer's, which its thread may be using
+    Spectrum_FFT fft = {};
+    Spectrum_Band_Table table = {};
+    Spectrum sg;
+    Array<f32> signal = {};
+    defer(free_spectrum_fft(&fft));
+    defer(signal.free());
+    signal.push(4096);
+
+    for (u32 i = 0; i < signal.count; ++i) {
+        f32 t = (f32)i / (f32)sample_rate;
+        signal[i] = 0.5f*sinf(2*PI*440.f*t) + 0.25f*sinf(2*PI*5000.f*t);
+    }
 
-            if (decoder_open(&wp->decoder, path)) {
-                wp->output.clear();
-                wp->output_count = 0;
-                wp->thread = thread_create(NULL, &fill_waveform_preview);
+    for (u32 fft_size : fft_sizes) {
+        for (u32 band_count : band_counts) {
+            Playback_Buffer_View view = {};
+            view.data[0] = signal.data;
+            view.frame_count = fft_size;
+            view.channels = 1;
+
+            build_band_table(&table, fft_size, sample_rate, band_count);
+            u64 start = perf_time_now();
+            for (u32 i = 0; i < iterations; ++i) {
+                calc_spectrum(&fft, &view, &table, &sg);
             }
+            f32 ms = perf_time_to_millis(perf_time_now() - start);
+
+            log_info("Spectrum: FFT size %u, %u bands: %.4fms per update\n",
+                fft_size, band_count, ms / iterations);
         }
     }
-}
+#else
+    log_info("Spectrum benchmark is not available on this platform\n");
+#endif
 
+    // Meters, per analyzer hop of stereo audio
+    {
+        const i32 sample_rate = 48000;
+        const u32 iterations = 1000;
+        Array<f32> signal = {};
+        Loudness_Meter meter = {};
+        Playback_Buffer_View view = {};
+        f32 peak[2], rms[2];
+        f32 ms;
+        u64 start;
+
+        signal.push(ANALYZER_WINDOW_FRAMES);
+        for (u32 i = 0; i < signal.count; ++i) {
+            signal[i] = 0.5f*sinf(2*PI*997.f*(f32)i/(f32)sample_rate);
+        }
+        view.data[0] = signal.data;
+        view.data[1] = signal.data;
+        view.frame_count = ANALYZER_WINDOW_FRAMES;
+        view.channels = 2;
+        loudness_init(&meter, 2, sample_rate, false);
+
+        start = perf_time_now();
+        for (u32 i = 0; i < iterations; ++i) calc_frame_levels(&view, peak, rms);
+        ms = perf_time_to_millis(perf_time_now() - start);
+        log_info("Peak/RMS: %u frames: %.4fms per update\n", ANALYZER_WINDOW_FRAMES, ms / iterations);
+
+        start = perf_time_now();
+        for (u32 i = 0; i < iterations; ++i) {
+            peak[0] = true_peak(view.data[0], view.frame_count);
+            peak[1] = true_peak(view.data[1], view.frame_count);
+        }
+        ms = perf_time_to_millis(perf_time_now() - start);
+        log_info("True-peak: %u frames: %.4fms per update\n", ANALYZER_WINDOW_FRAMES, ms / iterations);
 
+        start = perf_time_now();
+        for (u32 i = 0; i < iterations; ++i) loudness_process_planar(&meter, view.data, ANALYZER_HOP_FRAMES);
+        ms = perf_time_to_millis(perf_time_now() - start);
+        log_info("Loudness: %u frames: %.4fms per update\n", ANALYZER_HOP_FRAMES, ms / iterations);
+
+        loudness_free(&meter);
+        signal.free();
+    }
+}
+#endif
@@ -20,15 +20,34 @@
 
 #include "defines.h"
 
-void update_playback_analyzers(f32 delta_ms);
+// Starts the analysis thread. The spectrum and peak meters are calculated
+// there and the UI only reads the latest results
+void playback_analysis_init();
+void playback_analysis_deinit();
+// Called by the UI once per frame to pick up the latest analyzer results
+void update_playback_analyzers();
 f32 get_playback_peak();
 // Returns the number of channels. Output must be array of at least MAX_AUDIO_CHANNELS floats
 int get_playback_channel_peaks(f32 *out);
-bool get_waveform_preview(f32 **buffer, u32 *sample_count, u32 *length);
+struct Waveform;
+
+// Returns NULL until some of the waveform for the playing track is available
+const Waveform *get_waveform_preview();
 // Show the spectrogram as an ImGui histogram
 void show_spectrum_widget(const char *str_id, float width = 0.f);
 // Show the spectrogram in a window, occupying the whole window
 void show_spectrum_ui();
 void show_channel_peaks_ui();
+// Show a scrolling time-frequency view, occupying the whole window
+void show_spectrogram_ui();
+
+#ifndef NDEBUG
+// Average and worst cost of an analyzer update on the analysis thread
+void get_playback_analyzer_timings(f32 *average_ms, f32 *max_ms);
+void reset_playback_analyzer_timings();
+// Time the spectrum over a range of FFT sizes and band counts, and the meters
+// over one analyzer update, and log the results
+void benchmark_playback_analyzers();
+#endif
 
 #endif //PLAYBACK_ANALYSIS_H
@@ -21,8 +21,6 @@
 #include <xxhash.h>
 #include <stdlib.h>
 
-typedef int Compare_Fn(const void*, const void*);
-
 #ifdef _WIN32
 static inline int strcasecmp(const char *a, const char *b) {
     int ca, cb;
@@ -39,111 +37,148 @@ static inline int strcasecmp(const char *a, const char *b) {
 }
 #endif
 
-static int compare_titles_descending(const void *p_a, const void *p_b) {
-    Track a = *(Track*)p_a;
-    Track b = *(Track*)p_b;
-    Metadata am;
-    Metadata bm;
-    
-    library_get_track_metadata(a, &am);
-    library_get_track_metadata(b, &bm);
-    
-    return strcasecmp(am.title, bm.title);
+// Tracks are sorted by up to 3 keys, compared in order. Keys are taken from
+// the metadata columns up front, so comparisons don't touch the store
+struct Sort_Entry {
+    u32 keys[3];
+    Track track;
+};
+
+static int compare_sort_entries(const void *p_a, const void *p_b) {
+    const Sort_Entry *a = (const Sort_Entry*)p_a;
+    const Sort_Entry *b = (const Sort_Entry*)p_b;
+    for (u32 i = 0; i < ARRAY_LENGTH(a->keys); ++i) {
+        if (a->keys[i] != b->keys[i]) return a->keys[i] < b->keys[i] ? -1 : 1;
+    }
+    return 0;
 }
 
-static int compare_artists_descending(const void *p_a, const void *p_b) {
-    Track a = *(Track*)p_a;
-    Track b = *(Track*)p_b;
-    Metadata am;
-    Metadata bm;
-    
-    library_get_track_metadata(a, &am);
-    library_get_track_metadata(b, &bm);
-    
-    int cmp = strcasecmp(am.artist, bm.artist);
-    if (!cmp) cmp = strcasecmp(am.album, bm.album);
-    if (!cmp) cmp = strcasecmp(am.title, bm.title);
-    return cmp;
+static int compare_sort_entries_reversed(const void *p_a, const void *p_b) {
+    return compare_sort_entries(p_b, p_a);
 }
 
-static int compare_albums_descending(const void *p_a, const void *p_b) {
-    Track a = *(Track*)p_a;
-    Track b = *(Track*)p_b;
-    Metadata am;
-    Metadata bm;
-    
-    library_get_track_metadata(a, &am);
-    library_get_track_metadata(b, &bm);
-    
-    int cmp = strcasecmp(am.album, bm.album);
-    if (!cmp) cmp = strcasecmp(am.title, bm.title);
-    return cmp;
+static int compare_strings_ignoring_case(const void *p_a, const void *p_b) {
+    return strcasecmp(get_string(*(String_ID*)p_a), get_string(*(String_ID*)p_b));
 }
 
-static int compare_duration_descending(const void *p_a, const void *p_b) {
-    Track a = *(Track*)p_a;
-    Track b = *(Track*)p_b;
-    Metadata am;
-    Metadata bm;
-    
-    library_get_track_metadata(a, &am);
-    library_get_track_metadata(b, &bm);
-    
-    if (am.duration_seconds == bm.duration_seconds) return 0;
-    else if (am.duration_seconds < bm.duration_seconds) return -1;
-    return 1;
+// Orders floats the same way as their values
+static u32 get_float_sort_key(f32 value) {
+    u32 bits;
+    memcpy(&bits, &value, 4);
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
 }
 
-static int compare_titles_ascending(const void *p_a, const void *p_b) {
-    int cmp = compare_titles_descending(p_a, p_b);
-    if (cmp == 0) return 0;
-    return -cmp;
-}
+// Gives each string in columns a rank by case insensitive order, so strings
+// can be compared as numbers. ranks is indexed by String_ID
+static void rank_strings(const Array<Track>& tracks, const String_ID *const *columns, u32 column_count,
+                         Array<u32>& ranks) {
+    const Metadata_Index *md_indices = library_get_metadata_indices();
+    Array<String_ID> unique = {};
+    defer(unique.free());
+
+    ranks.push(get_string_count());
+    for (u32 i = 0; i < ranks.count; ++i) ranks[i] = UINT32_MAX;
+
+    for (Track track : tracks) {
+        Metadata_Index index = md_indices[track-1];
+        for (u32 c = 0; c < column_count; ++c) {
+            String_ID id = columns[c][index];
+            if (ranks[id] == UINT32_MAX) {
+                ranks[id] = 0;
+                unique.append(id);
+            }
+        }
+    }
 
-static int compare_artists_ascending(const void *p_a, const void *p_b) {
-    int cmp = compare_artists_descending(p_a, p_b);
-    if (cmp == 0) return 0;
-    return -cmp;
-}
+    qsort(unique.data, unique.count, sizeof(String_ID), &compare_strings_ignoring_case);
 
-static int compare_albums_ascending(const void *p_a, const void *p_b) {
-    int cmp = compare_albums_descending(p_a, p_b);
-    if (cmp == 0) return 0;
-    return -cmp;
+    u32 rank = 0;
+    for (u32 i = 0; i < unique.count; ++i) {
+        if (i && compare_strings_ignoring_case(&unique[i-1], &unique[i])) rank++;
+        ranks[unique[i]] = rank;
+    }
 }
 
-static int compare_duration_ascending(const void *p_a, const void *p_b) {
-    int cmp = compare_duration_descending(p_a, p_b);
-    if (cmp == 0) return 0;
-    return -cmp;
-}
+void sort_playlist(Playlist& playlist, int metric, int order) {
+    if (metric <= SORT_METRIC_NONE || metric > SORT_METRIC__LAST) return;
+
+    const Metadata_Columns md = get_metadata_columns();
+    const Metadata_Index *md_indices = library_get_metadata_indices();
+    Array<Sort_Entry> entries = {};
+    Array<u32> ranks = {};
+    defer(entries.free());
+    defer(ranks.free());
+
+    if (metric == SORT_METRIC_TITLE) {
+        const String_ID *columns[] = {md.titles};
+        rank_strings(playlist.tracks, columns, ARRAY_LENGTH(columns), ranks);
+    }
+    else if (metric == SORT_METRIC_ARTIST) {
+        const String_ID *columns[] = {md.artists, md.albums, md.titles};
+        rank_strings(playlist.tracks, columns, ARRAY_LENGTH(columns), ranks);
+    }
+    else if (metric == SORT_METRIC_ALBUM || metric == SORT_METRIC_YEAR) {
+        const String_ID *columns[] = {md.albums, md.titles};
+        rank_strings(playlist.tracks, columns, ARRAY_LENGTH(columns), ranks);
+    }
+    else if (metric == SORT_METRIC_GENRE) {
+        const String_ID *columns[] = {md.genres, md.artists, md.albums};
+        rank_strings(playlist.tracks, columns, ARRAY_LENGTH(columns), ranks);
+    }
 
-static Compare_Fn *get_compare_fn_from_metric_and_order(int metric, int order) {
-    if (metric == SORT_METRIC_TITLE && order == SORT_ORDER_DESCENDING)
-        return &compare_titles_descending;
-    if (metric == SORT_METRIC_ARTIST && order == SORT_ORDER_DESCENDING)
-        return &compare_artists_descending;
-    if (metric == SORT_METRIC_ALBUM && order == SORT_ORDER_DESCENDING)
-        return &compare_albums_descending;
-    if (metric == SORT_METRIC_DURATION && order == SORT_ORDER_DESCENDING)
-        return &compare_duration_descending;
-    
-    if (metric == SORT_METRIC_TITLE && order == SORT_ORDER_ASCENDING)
-        return &compare_titles_ascending;
-    if (metric == SORT_METRIC_ARTIST && order == SORT_ORDER_ASCENDING)
-        return &compare_artists_ascending;
-    if (metric == SORT_METRIC_ALBUM && order == SORT_ORDER_ASCENDING)
-        return &compare_albums_ascending;
-    if (metric == SORT_METRIC_DURATION && order == SORT_ORDER_ASCENDING)
-        return &compare_duration_ascending;
-    
-    return NULL;
-}
+    entries.push(playlist.tracks.count);
+    for (u32 i = 0; i < playlist.tracks.count; ++i) {
+        Sort_Entry& entry = entries[i];
+        const Metadata_Index index = md_indices[playlist.tracks[i]-1];
+        entry = {};
+        entry.track = playlist.tracks[i];
+
+        switch (metric) {
+            case SORT_METRIC_TITLE:
+                entry.keys[0] = ranks[md.titles[index]];
+                break;
+            case SORT_METRIC_ARTIST:
+                entry.keys[0] = ranks[md.artists[index]];
+                entry.keys[1] = ranks[md.albums[index]];
+                entry.keys[2] = ranks[md.titles[index]];
+                break;
+            case SORT_METRIC_ALBUM:
+                entry.keys[0] = ranks[md.albums[index]];
+                entry.keys[1] = ranks[md.titles[index]];
+                break;
+            case SORT_METRIC_DURATION: entry.keys[0] = md.durations[index]; break;
+            case SORT_METRIC_PEAK: entry.keys[0] = get_float_sort_key(md.analyses[index].peak_db); break;
+            case SORT_METRIC_RMS: entry.keys[0] = get_float_sort_key(md.analyses[index].rms_db); break;
+            case SORT_METRIC_LOUDNESS: entry.keys[0] = get_float_sort_key(md.analyses[index].loudness); break;
+            case SORT_METRIC_BPM: entry.keys[0] = get_float_sort_key(md.analyses[index].bpm); break;
+            case SORT_METRIC_KEY: entry.keys[0] = md.analyses[index].key; break;
+            case SORT_METRIC_TRACK_NUMBER:
+                entry.keys[0] = md.track_numbers[index];
+                entry.keys[1] = md.disc_numbers[index];
+                break;
+            // Album order within each disc
+            case SORT_METRIC_DISC:
+                entry.keys[0] = md.disc_numbers[index];
+                entry.keys[1] = md.track_numbers[index];
+                break;
+            case SORT_METRIC_YEAR:
+                entry.keys[0] = md.years[index];
+                entry.keys[1] = ranks[md.albums[index]];
+                entry.keys[2] = (md.disc_numbers[index] << 16) | md.track_numbers[index];
+                break;
+            case SORT_METRIC_GENRE:
+                entry.keys[0] = ranks[md.genres[index]];
+                entry.keys[1] = ranks[md.artists[index]];
+                entry.keys[2] = ranks[md.albums[index]];
+                break;
+            case SORT_METRIC_BITRATE: entry.keys[0] = md.bitrates[index]; break;
+            case SORT_METRIC_SAMPLE_RATE: entry.keys[0] = md.sample_rates[index]; break;
+        }
+    }
 
-void sort_playlist(Playlist& playlist, int metric, int order) {
-    Compare_Fn *compare_fn = get_compare_fn_from_metric_and_order(metric, order);
-    if (!compare_fn) return;
-    qsort(playlist.tracks.data, playlist.tracks.count, sizeof(Track), compare_fn);
+    qsort(entries.data, entries.count, sizeof(Sort_Entry),
+          order == SORT_ORDER_DESCENDING ? &compare_sort_entries : &compare_sort_entries_reversed);
+    for (u32 i = 0; i < entries.count; ++i) playlist.tracks[i] = entries[i].track;
     
     playlist.sort_metric = metric;
     playlist.sort_order = order;
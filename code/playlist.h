@@ -38,7 +38,18 @@ enum Sort_Metric {
     SORT_METRIC_ARTIST,
     SORT_METRIC_TITLE,
     SORT_METRIC_DURATION,
-    SORT_METRIC__LAST = SORT_METRIC_TITLE,
+    SORT_METRIC_PEAK,
+    SORT_METRIC_RMS,
+    SORT_METRIC_LOUDNESS,
+    SORT_METRIC_BPM,
+    SORT_METRIC_KEY,
+    SORT_METRIC_TRACK_NUMBER,
+    SORT_METRIC_DISC,
+    SORT_METRIC_YEAR,
+    SORT_METRIC_GENRE,
+    SORT_METRIC_BITRATE,
+    SORT_METRIC_SAMPLE_RATE,
+    SORT_METRIC__LAST = SORT_METRIC_SAMPLE_RATE,
 };
 
 enum {
@@ -54,6 +65,17 @@ static inline const char *sort_metric_to_string(int metric) {
         case SORT_METRIC_ARTIST: return "ARTIST";
         case SORT_METRIC_TITLE: return "TITLE";
         case SORT_METRIC_DURATION: return "DURATION";
+        case SORT_METRIC_PEAK: return "PEAK";
+        case SORT_METRIC_RMS: return "RMS";
+        case SORT_METRIC_LOUDNESS: return "LOUDNESS";
+        case SORT_METRIC_BPM: return "BPM";
+        case SORT_METRIC_KEY: return "KEY";
+        case SORT_METRIC_TRACK_NUMBER: return "TRACK_NUMBER";
+        case SORT_METRIC_DISC: return "DISC";
+        case SORT_METRIC_YEAR: return "YEAR";
+        case SORT_METRIC_GENRE: return "GENRE";
+        case SORT_METRIC_BITRATE: return "BITRATE";
+        case SORT_METRIC_SAMPLE_RATE: return "SAMPLE_RATE";
         default: return "NONE";
     }
 }
@@ -167,21 +189,22 @@ struct Playlist {
     ~Playlist() {}
 };
 
-static inline bool metadata_meets_filter(const Metadata& md, const char *filter) {
-    if (md.title[0] && string_contains_string_ignoring_case(md.title, filter))
+static inline bool strings_meet_filter(String_ID title, String_ID artist, String_ID album, const char *filter) {
+    if (title && string_contains_string_ignoring_case(get_string(title), filter))
         return true;
-    if (md.artist[0] && string_contains_string_ignoring_case(md.artist, filter))
+    if (artist && string_contains_string_ignoring_case(get_string(artist), filter))
         return true;
-    if (md.album[0] && string_contains_string_ignoring_case(md.album, filter))
+    if (album && string_contains_string_ignoring_case(get_string(album), filter))
         return true;
     
     return false;
 }
 
+// Only reads the title, artist and album columns
 static inline bool track_meets_filter(const Track& track, const char *filter) {
-    Metadata md;
-    library_get_track_metadata(track, &md);
-    return metadata_meets_filter(md, filter);
+    const Metadata_Columns md = get_metadata_columns();
+    const Metadata_Index index = library_get_track_metadata_index(track);
+    return strings_meet_filter(md.titles[index], md.artists[index], md.albums[index], filter);
 }
 
 u32 playlist_remove_missing_tracks(Playlist& playlist);
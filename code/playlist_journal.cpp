@@ -0,0 +1,472 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "playlist_journal.h"
+#include "library.h"
+#include "os.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+// Version 2 adds the generation after the version
+#define CHECKPOINT_VERSION 2
+// The journal is checkpointed once it would have more records than this,
+// or than the playlist has tracks if that's more
+#define JOURNAL_MIN_RECORDS 1024
+
+// What was last written for a playlist file. The next save is compared
+// against it to find what changed
+struct Saved_Playlist {
+    char path[PATH_LENGTH];
+    char name[PLAYLIST_NAME_MAX];
+    int sort_metric;
+    int sort_order;
+    u32 generation;
+    // Records in the journal on disk. 0 if there is no journal for this
+    // generation
+    u32 journal_records;
+    // The files don't match tracks, e.g. the journal has a damaged record
+    // or some tracks couldn't be loaded, so appending to them won't work
+    bool needs_checkpoint;
+    Array<Track> tracks;
+};
+
+static Array<Saved_Playlist> g_saved_playlists;
+
+static Saved_Playlist *find_saved_playlist(const char *path) {
+    for (Saved_Playlist& saved : g_saved_playlists) {
+        if (!strcmp(saved.path, path)) return &saved;
+    }
+    return NULL;
+}
+
+static Saved_Playlist *add_saved_playlist(const char *path) {
+    Saved_Playlist *saved = find_saved_playlist(path);
+    if (saved) return saved;
+
+    u32 index = g_saved_playlists.push();
+    saved = &g_saved_playlists[index];
+    *saved = Saved_Playlist{};
+    strncpy0(saved->path, path, PATH_LENGTH);
+    saved->needs_checkpoint = true;
+    return saved;
+}
+
+static void get_journal_path(const char *path, char *buffer) {
+    snprintf(buffer, PATH_LENGTH, "%s" PLAYLIST_JOURNAL_SUFFIX, path);
+}
+
+static void insert_tracks(Array<Track>& tracks, u32 index, const Track *items, u32 count) {
+    u32 old_count = tracks.count;
+    tracks.push(count);
+    memmove(&tracks.data[index + count], &tracks.data[index], (old_count - index) * sizeof(Track));
+    memcpy(&tracks.data[index], items, count * sizeof(Track));
+}
+
+static void remove_tracks(Array<Track>& tracks, u32 index, u32 count) {
+    memmove(&tracks.data[index], &tracks.data[index + count], (tracks.count - index - count) * sizeof(Track));
+    tracks.pull(count);
+}
+
+//-
+// Journal records, one per line:
+//   + <index> <path>           Insert a track
+//   - <index> <count>          Remove tracks
+//   m <from> <count> <to>      Move tracks, to is the index after removing them
+// After a "journal <generation>" header line
+
+static void append_record(Array<char>& records, const char *format, ...) {
+    char line[PATH_LENGTH + 64];
+    va_list va;
+    va_start(va, format);
+    int length = vsnprintf(line, sizeof(line), format, va);
+    va_end(va);
+    if (length < 0) return;
+    records.append_array(line, (u32)MIN(length, (int)sizeof(line) - 1));
+}
+
+static void append_insert_record(Array<char>& records, u32 index, Track track) {
+    char path[PATH_LENGTH];
+    library_get_track_path(track, path);
+    append_record(records, "+ %u %s\n", index, path);
+}
+
+// Writes the records that turn old_tracks into new_tracks. Returns false if
+// it would take more than max_records
+static bool diff_tracks(const Array<Track>& old_tracks, const Array<Track>& new_tracks, u32 max_records,
+                        Array<char>& records, u32 *record_count) {
+    const u32 n = old_tracks.count;
+    const u32 m = new_tracks.count;
+    u32 prefix = 0;
+    u32 suffix = 0;
+    *record_count = 0;
+
+    while (prefix < n && prefix < m && old_tracks[prefix] == new_tracks[prefix]) prefix++;
+    while (suffix < n - prefix && suffix < m - prefix &&
+           old_tracks[n - 1 - suffix] == new_tracks[m - 1 - suffix]) suffix++;
+
+    // Only the middle changed
+    const u32 old_count = n - prefix - suffix;
+    const u32 new_count = m - prefix - suffix;
+    auto old_at = [&](u32 i) {return old_tracks[prefix + i];};
+    auto new_at = [&](u32 i) {return new_tracks[prefix + i];};
+
+    if (!old_count && !new_count) return true;
+
+    // One block of tracks was moved, so the middle is rotated
+    if (old_count == new_count) {
+        u32 k = 1;
+        while (k < old_count && old_at(k) != new_at(0)) k++;
+        bool rotated = k < old_count;
+        for (u32 i = 0; rotated && i < old_count; ++i) {
+            rotated = new_at(i) == old_at((i + k) % old_count);
+        }
+        if (rotated) {
+            if (k <= old_count - k) append_record(records, "m %u %u %u\n", prefix, k, prefix + old_count - k);
+            else append_record(records, "m %u %u %u\n", prefix + k, old_count - k, prefix);
+            *record_count = 1;
+            return max_records >= 1;
+        }
+    }
+
+    // Tracks were only removed
+    if (new_count < old_count) {
+        u32 i = 0, j = 0;
+        while (i < old_count && *record_count <= max_records) {
+            if (j < new_count && old_at(i) == new_at(j)) {
+                i++; j++;
+                continue;
+            }
+            u32 first = i;
+            while (i < old_count && !(j < new_count && old_at(i) == new_at(j))) i++;
+            append_record(records, "- %u %u\n", prefix + j, i - first);
+            *record_count += 1;
+        }
+        if (j == new_count) return *record_count <= max_records;
+    }
+
+    // Tracks were only added
+    if (new_count > old_count) {
+        u32 i = 0, j = 0;
+        records.clear();
+        *record_count = 0;
+        while (j < new_count && *record_count <= max_records) {
+            if (i < old_count && old_at(i) == new_at(j)) {
+                i++; j++;
+                continue;
+            }
+            append_insert_record(records, prefix + j, new_at(j));
+            *record_count += 1;
+            j++;
+        }
+        if (i == old_count) return *record_count <= max_records;
+    }
+
+    // Otherwise replace the middle
+    records.clear();
+    *record_count = new_count + 1;
+    if (*record_count > max_records) return false;
+    append_record(records, "- %u %u\n", prefix, old_count);
+    for (u32 j = 0; j < new_count; ++j) append_insert_record(records, prefix + j, new_at(j));
+    return true;
+}
+
+static bool apply_record(char *line, Array<Track>& tracks) {
+    char *p = line + 1;
+    u32 a, b, c;
+
+    switch (line[0]) {
+        case '+': {
+            a = strtoul(p, &p, 10);
+            if (*p != ' ' || a > tracks.count) return false;
+            Track track = library_add_track(p + 1);
+            insert_tracks(tracks, a, &track, 1);
+            return true;
+        }
+        case '-': {
+            a = strtoul(p, &p, 10);
+            b = strtoul(p, &p, 10);
+            if (*p || a > tracks.count || b > tracks.count - a) return false;
+            remove_tracks(tracks, a, b);
+            return true;
+        }
+        case 'm': {
+            a = strtoul(p, &p, 10);
+            b = strtoul(p, &p, 10);
+            c = strtoul(p, &p, 10);
+            if (*p || a > tracks.count || b > tracks.count - a || c > tracks.count - b) return false;
+            Array<Track> moved = {};
+            defer(moved.free());
+            moved.append_array(&tracks.data[a], b);
+            remove_tracks(tracks, a, b);
+            insert_tracks(tracks, c, moved.data, b);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Applies the journal to tracks if it belongs to generation. Returns the
+// number of records applied. intact is false if the journal ends with a
+// record that is incomplete or doesn't apply
+static u32 replay_journal(char *journal, u32 generation, Array<Track>& tracks, bool *intact) {
+    char *line = journal;
+    char *end = strchr(line, '\n');
+    u32 record_count = 0;
+    *intact = true;
+
+    if (!end || strncmp(line, "journal ", 8) || strtoul(&line[8], NULL, 10) != generation) return 0;
+
+    for (line = end + 1; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (!end) {
+            // Cut off while being written
+            *intact = false;
+            break;
+        }
+        *end = 0;
+        if (end > line && end[-1] == '\r') end[-1] = 0;
+        if (!apply_record(line, tracks)) {
+            *intact = false;
+            break;
+        }
+        record_count++;
+    }
+
+    return record_count;
+}
+
+static bool append_journal(Saved_Playlist *saved, const Array<char>& records) {
+    char journal_path[PATH_LENGTH];
+    get_journal_path(saved->path, journal_path);
+
+    // Anything already there belongs to another generation
+    FILE *f = fopen(journal_path, saved->journal_records ? "ab" : "wb");
+    if (!f) return false;
+    defer(fclose(f));
+
+    if (!saved->journal_records) fprintf(f, "journal %u\n", saved->generation);
+    fwrite(records.data, 1, records.count, f);
+    return flush_file(f);
+}
+//-
+
+static bool write_checkpoint(const Playlist& playlist, const char *path) {
+    char journal_path[PATH_LENGTH];
+    char temp_path[PATH_LENGTH];
+    get_journal_path(path, journal_path);
+    snprintf(temp_path, PATH_LENGTH, "%s" PLAYLIST_CHECKPOINT_TEMP_SUFFIX, path);
+
+    // A journal from before this run could have any generation
+    Saved_Playlist *saved = find_saved_playlist(path);
+    if (!saved) {
+        delete_file(journal_path);
+        saved = add_saved_playlist(path);
+    }
+    const u32 generation = saved->generation + 1;
+
+    FILE *f = fopen(temp_path, "w");
+    if (!f) {
+        log_error("Failed to open file %s for writing\n", temp_path);
+        return false;
+    }
+
+    fprintf(f, "%d\n", CHECKPOINT_VERSION); // Version
+    fprintf(f, "%u\n", generation); // Generation
+    fprintf(f, "%s\n", playlist.name); // Name
+    fprintf(f, "%s\n", sort_metric_to_string(playlist.sort_metric)); // Sort metric
+    fprintf(f, "%s\n", sort_order_to_string(playlist.sort_order)); // Sort order
+
+    // Track paths
+    for (u32 i = 0; i < playlist.tracks.count; ++i) {
+        char track_path[PATH_LENGTH];
+        library_get_track_path(playlist.tracks[i], track_path);
+        fprintf(f, "%s\n", track_path);
+    }
+
+    bool flushed = flush_file(f);
+    fclose(f);
+
+    // The old checkpoint and journal are left alone until the new
+    // checkpoint has replaced them
+    if (!flushed || !replace_file(temp_path, path)) {
+        log_error("Failed to save playlist %s\n", path);
+        delete_file(temp_path);
+        return false;
+    }
+    delete_file(journal_path);
+
+    strncpy0(saved->name, playlist.name, PLAYLIST_NAME_MAX);
+    saved->sort_metric = playlist.sort_metric;
+    saved->sort_order = playlist.sort_order;
+    saved->generation = generation;
+    saved->journal_records = 0;
+    saved->needs_checkpoint = false;
+    saved->tracks.clear();
+    playlist.tracks.copy_to(saved->tracks);
+    return true;
+}
+
+bool save_playlist_to_file(const Playlist& playlist, const char *path) {
+    Saved_Playlist *saved = find_saved_playlist(path);
+
+    if (saved && !saved->needs_checkpoint && !strcmp(saved->name, playlist.name) &&
+        saved->sort_metric == playlist.sort_metric && saved->sort_order == playlist.sort_order) {
+        const u32 max_records = MAX((u32)JOURNAL_MIN_RECORDS, playlist.tracks.count);
+        Array<char> records = {};
+        u32 record_count;
+        defer(records.free());
+
+        if (saved->journal_records < max_records &&
+            diff_tracks(saved->tracks, playlist.tracks, max_records - saved->journal_records,
+                        records, &record_count)) {
+            if (!record_count) return true;
+            if (append_journal(saved, records)) {
+                saved->journal_records += record_count;
+                saved->tracks.clear();
+                playlist.tracks.copy_to(saved->tracks);
+                return true;
+            }
+            // Part of a record may have been written
+            saved->needs_checkpoint = true;
+        }
+    }
+
+    return write_checkpoint(playlist, path);
+}
+
+static INLINE bool iscontrol(int c) {
+    return c == '\n' || c == '\r';
+}
+
+static bool read_line(char **memory, char *buffer, int buffer_size) {
+    char *p = *memory;
+    int i = 0;
+    
+    if (*p == 0) return false;
+    
+    while (*p && isspace(*p)) ++p;
+    
+    for (; *p && !iscontrol(*p) && *p != '\n' && (i < (buffer_size-1)); ++p, ++i) {
+        buffer[i] = *p;
+    }
+    
+    buffer[i] = 0;
+    
+    *memory = p;
+    return true;
+}
+
+bool load_playlist_from_file(const char *path, Playlist& playlist) {
+    char *buffer;
+    char *f;
+    if (!read_whole_file(path, (void**)&buffer, true)) return false;
+    defer(free(buffer));
+    
+    f = buffer;
+    
+    char line[1024];
+    u32 generation = 0;
+    
+    // Version
+    if (read_line(&f, line, sizeof(line)) == 0) return false;
+    int version = atoi(line);
+    if (version > CHECKPOINT_VERSION) {
+        log_error("Unsupported playlist file version %s\n", line);
+        return false;
+    }
+    
+    // Generation
+    if (version >= 2) {
+        if (read_line(&f, line, sizeof(line)) == 0) return false;
+        generation = strtoul(line, NULL, 10);
+    }
+    
+    // Name
+    if (read_line(&f, line, sizeof(line)) == 0) return false;
+    playlist.set_name(line);
+    
+    // Sort metric
+    if (read_line(&f, line, sizeof(line)) == 0) return false;
+    playlist.sort_metric = sort_metric_from_string(line);
+    
+    // Sort order
+    if (read_line(&f, line, sizeof(line)) == 0) return false;
+    playlist.sort_order = sort_order_from_string(line);
+    
+    // Tracks. Ones that can't be added are kept as 0 until the journal has
+    // been replayed, since its indices count them
+    Array<Track> tracks = {};
+    defer(tracks.free());
+    while (read_line(&f, line, sizeof(line)) != 0) {
+        if (line[0]) tracks.append(library_add_track(line));
+    }
+    
+    Saved_Playlist *saved = add_saved_playlist(path);
+    bool intact = true;
+    saved->generation = generation;
+    saved->journal_records = 0;
+    
+    char journal_path[PATH_LENGTH];
+    get_journal_path(path, journal_path);
+    if (does_file_exist(journal_path)) {
+        char *journal = NULL;
+        if (read_whole_file(journal_path, (void**)&journal, true)) {
+            saved->journal_records = replay_journal(journal, generation, tracks, &intact);
+        }
+        free(journal);
+    }
+    
+    for (Track track : tracks) {
+        if (track) playlist.add_track(track);
+    }
+    
+    strncpy0(saved->name, playlist.name, PLAYLIST_NAME_MAX);
+    saved->sort_metric = playlist.sort_metric;
+    saved->sort_order = playlist.sort_order;
+    saved->needs_checkpoint = !intact || playlist.tracks.count != tracks.count;
+    saved->tracks.clear();
+    playlist.tracks.copy_to(saved->tracks);
+    
+    return true;
+}
+
+void delete_playlist_file(const char *path) {
+    char journal_path[PATH_LENGTH];
+    get_journal_path(path, journal_path);
+    delete_file(path);
+    delete_file(journal_path);
+
+    for (u32 i = 0; i < g_saved_playlists.count; ++i) {
+        if (!strcmp(g_saved_playlists[i].path, path)) {
+            g_saved_playlists[i].tracks.free();
+            g_saved_playlists.ordered_remove(i);
+            break;
+        }
+    }
+}
+
+static bool has_suffix(const char *str, const char *suffix) {
+    size_t length = strlen(str);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && !strcmp(&str[length - suffix_length], suffix);
+}
+
+bool is_playlist_journal_file(const char *path) {
+    return has_suffix(path, PLAYLIST_JOURNAL_SUFFIX) || has_suffix(path, PLAYLIST_CHECKPOINT_TEMP_SUFFIX);
+}
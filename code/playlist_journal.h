@@ -0,0 +1,48 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef PLAYLIST_JOURNAL_H
+#define PLAYLIST_JOURNAL_H
+
+// Playlists are saved as a checkpoint, which is a complete playlist file,
+// and a journal next to it of the tracks added, removed and moved since.
+// Saving appends the difference from the last save to the journal, so it
+// costs as much as the change rather than the whole playlist. When the
+// journal gets long, or the change is too big to describe cheaply (e.g. a
+// sort), a new checkpoint is written to a temporary file and renamed over
+// the old one, so there is always a complete copy on disk.
+//
+// Checkpoints and journals carry a generation number. A journal is only
+// replayed onto the checkpoint of the same generation, so one left behind
+// by a crash during a checkpoint is ignored
+
+#include "defines.h"
+#include "playlist.h"
+
+#define PLAYLIST_JOURNAL_SUFFIX ".journal"
+#define PLAYLIST_CHECKPOINT_TEMP_SUFFIX ".tmp"
+
+bool save_playlist_to_file(const Playlist& playlist, const char *path);
+// Loads the checkpoint at path and replays its journal
+bool load_playlist_from_file(const char *path, Playlist& playlist);
+// Deletes the checkpoint and journal of a playlist
+void delete_playlist_file(const char *path);
+// True for journals and unfinished checkpoints, which aren't playlists
+// themselves
+bool is_playlist_journal_file(const char *path);
+
+#endif //PLAYLIST_JOURNAL_H
@@ -55,11 +55,18 @@ struct Preferences {
     int close_policy;
     int menu_bar_visualizer;
     int waveform_window_size;
+    int spectrum_band_count;
+    static constexpr int MAX_WATCHED_FOLDERS = 8;
+    // Library folders kept up to date as files change
+    char watched_folders[MAX_WATCHED_FOLDERS][PATH_LENGTH];
+    int watched_folder_count;
     
     static constexpr int FONT_SIZE_MIN = 8;
     static constexpr int FONT_SIZE_MAX = 24;
     static constexpr int WAVEFORM_WINDOW_SIZE_MIN = 10;
     static constexpr int WAVEFORM_WINDOW_SIZE_MAX = 100;
+    static constexpr int SPECTRUM_BANDS_MIN = 20;
+    static constexpr int SPECTRUM_BANDS_MAX = 256;
     
     void set_defaults() {
 #ifdef _WIN32
@@ -68,6 +75,7 @@ struct Preferences {
         font_size = 16;
         icon_font_size = 12;
         waveform_window_size = 40;
+        spectrum_band_count = 20;
     }
     
     void save_to_file(const char *path) {
@@ -83,6 +91,10 @@ struct Preferences {
         fprintf(f, "iClosePolicy = %d\n", close_policy);
         fprintf(f, "iMenuBarVisualizer = %d\n", menu_bar_visualizer);
         fprintf(f, "iWaveformWindowSize = %d\n", waveform_window_size);
+        fprintf(f, "iSpectrumBands = %d\n", spectrum_band_count);
+        for (int i = 0; i < watched_folder_count; ++i) {
+            fprintf(f, "sWatchedFolder = %s\n", watched_folders[i]);
+        }
         
         fclose(f);
     }
@@ -107,6 +119,10 @@ struct Preferences {
                 p->menu_bar_visualizer = clamp(atoi(value), 0, MENU_BAR_VISUAL__COUNT-1);
             else if (!strcmp(key, "iWaveformWindowSize"))
                 p->waveform_window_size = clamp(atoi(value), WAVEFORM_WINDOW_SIZE_MIN, WAVEFORM_WINDOW_SIZE_MAX);
+            else if (!strcmp(key, "iSpectrumBands"))
+                p->spectrum_band_count = clamp(atoi(value), SPECTRUM_BANDS_MIN, SPECTRUM_BANDS_MAX);
+            else if (!strcmp(key, "sWatchedFolder") && p->watched_folder_count < MAX_WATCHED_FOLDERS)
+                strncpy0(p->watched_folders[p->watched_folder_count++], value, PATH_LENGTH);
             return 1;
         };
         
@@ -0,0 +1,193 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef SIMD_H
+#define SIMD_H
+
+// Small set of vectorized kernels used by the analyzers. Every kernel
+// has a scalar fallback for targets without SSE
+
+#include "defines.h"
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#ifdef SIMD_SSE
+static INLINE f32 simd_horizontal_max_(__m128 v) {
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+// out[i] = in[i*2]^2 + in[i*2+1]^2 for interleaved complex input
+static inline void simd_complex_power(const f32 *in, f32 *out, i32 count) {
+    i32 i = 0;
+#ifdef SIMD_SSE
+    for (; i + 4 <= count; i += 4) {
+        __m128 a = _mm_loadu_ps(&in[i*2]);
+        __m128 b = _mm_loadu_ps(&in[i*2 + 4]);
+        __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(&out[i], _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+    }
+#endif
+    for (; i < count; ++i) {
+        f32 re = in[i*2];
+        f32 im = in[i*2 + 1];
+        out[i] = (re * re) + (im * im);
+    }
+}
+
+// Largest value in the array. Returns 0 for an empty array
+static inline f32 simd_max(const f32 *in, i32 count) {
+    f32 result = 0.f;
+    i32 i = 0;
+    if (count <= 0) return 0.f;
+    result = in[0];
+#ifdef SIMD_SSE
+    if (count >= 4) {
+        __m128 m = _mm_loadu_ps(in);
+        for (i = 4; i + 4 <= count; i += 4) {
+            m = _mm_max_ps(m, _mm_loadu_ps(&in[i]));
+        }
+        result = simd_horizontal_max_(m);
+    }
+#endif
+    for (; i < count; ++i) {
+        result = MAX(result, in[i]);
+    }
+    return result;
+}
+
+// Per-channel min, max and sum of squares of interleaved samples.
+// Each output must hold one value per channel
+static inline void simd_interleaved_min_max_sumsq(const f32 *in, u32 frame_count, i32 channels,
+                                                  f32 *out_min, f32 *out_max, f32 *out_sumsq) {
+    const u32 total = frame_count * (u32)channels;
+    u32 i = 0;
+
+    for (i32 ch = 0; ch < channels; ++ch) {
+        out_min[ch] = frame_count ? in[ch] : 0.f;
+        out_max[ch] = frame_count ? in[ch] : 0.f;
+        out_sumsq[ch] = 0.f;
+    }
+
+#ifdef SIMD_SSE
+    if ((channels == 1 || channels == 2 || channels == 4) && total >= 4) {
+        // Every lane always holds the same channel
+        __m128 vmin = _mm_loadu_ps(in);
+        __m128 vmax = vmin;
+        __m128 vsum = _mm_mul_ps(vmin, vmin);
+        f32 lane_min[4], lane_max[4], lane_sum[4];
+
+        for (i = 4; i + 4 <= total; i += 4) {
+            __m128 v = _mm_loadu_ps(&in[i]);
+            vmin = _mm_min_ps(vmin, v);
+            vmax = _mm_max_ps(vmax, v);
+            vsum = _mm_add_ps(vsum, _mm_mul_ps(v, v));
+        }
+
+        _mm_storeu_ps(lane_min, vmin);
+        _mm_storeu_ps(lane_max, vmax);
+        _mm_storeu_ps(lane_sum, vsum);
+
+        for (i32 lane = 0; lane < 4; ++lane) {
+            i32 ch = lane % channels;
+            out_min[ch] = MIN(out_min[ch], lane_min[lane]);
+            out_max[ch] = MAX(out_max[ch], lane_max[lane]);
+            out_sumsq[ch] += lane_sum[lane];
+        }
+    }
+    else if ((channels % 4) == 0 && channels <= MAX_AUDIO_CHANNELS && frame_count) {
+        // Each group of 4 channels gets its own accumulators
+        const i32 groups = channels / 4;
+        __m128 vmin[MAX_AUDIO_CHANNELS/4];
+        __m128 vmax[MAX_AUDIO_CHANNELS/4];
+        __m128 vsum[MAX_AUDIO_CHANNELS/4];
+
+        for (i32 g = 0; g < groups; ++g) {
+            vmin[g] = _mm_loadu_ps(&in[g*4]);
+            vmax[g] = vmin[g];
+            vsum[g] = _mm_setzero_ps();
+        }
+
+        for (u32 frame = 0; frame < frame_count; ++frame) {
+            for (i32 g = 0; g < groups; ++g) {
+                __m128 v = _mm_loadu_ps(&in[frame*channels + g*4]);
+                vmin[g] = _mm_min_ps(vmin[g], v);
+                vmax[g] = _mm_max_ps(vmax[g], v);
+                vsum[g] = _mm_add_ps(vsum[g], _mm_mul_ps(v, v));
+            }
+        }
+
+        for (i32 g = 0; g < groups; ++g) {
+            _mm_storeu_ps(&out_min[g*4], vmin[g]);
+            _mm_storeu_ps(&out_max[g*4], vmax[g]);
+            _mm_storeu_ps(&out_sumsq[g*4], vsum[g]);
+        }
+        i = total;
+    }
+#endif
+
+    for (; i < total; ++i) {
+        i32 ch = (i32)(i % (u32)channels);
+        f32 v = in[i];
+        out_min[ch] = MIN(out_min[ch], v);
+        out_max[ch] = MAX(out_max[ch], v);
+        out_sumsq[ch] += v * v;
+    }
+}
+
+// Runs a 4 phase polyphase FIR over in and returns the largest absolute
+// output, i.e. the peak after 4x upsampling. coefs holds 4 phases per tap.
+// The first taps-1 inputs only fill the filter history
+static inline f32 simd_polyphase4_abs_max(const f32 *in, u32 count, const f32 *coefs, i32 taps) {
+    f32 result = 0.f;
+    u32 n = (u32)taps - 1;
+    if (count <= n) return 0.f;
+
+#ifdef SIMD_SSE
+    {
+        const __m128 sign = _mm_set1_ps(-0.f);
+        __m128 vmax = _mm_setzero_ps();
+        for (; n < count; ++n) {
+            __m128 acc = _mm_setzero_ps();
+            for (i32 k = 0; k < taps; ++k) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(in[n - k]), _mm_loadu_ps(&coefs[k*4])));
+            }
+            vmax = _mm_max_ps(vmax, _mm_andnot_ps(sign, acc));
+        }
+        result = simd_horizontal_max_(vmax);
+    }
+#else
+    for (; n < count; ++n) {
+        f32 acc[4] = {};
+        for (i32 k = 0; k < taps; ++k) {
+            for (i32 p = 0; p < 4; ++p) acc[p] += in[n - k] * coefs[k*4 + p];
+        }
+        for (i32 p = 0; p < 4; ++p) result = MAX(result, fabsf(acc[p]));
+    }
+#endif
+
+    return result;
+}
+
+#endif //SIMD_H
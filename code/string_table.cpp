@@ -0,0 +1,133 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "string_table.h"
+#include "hash_index.h"
+#include "os.h"
+#include <atomic>
+#include <xxhash.h>
+
+#define STRING_PAGE_SIZE 4096
+#define STRING_MAX_PAGES 4096
+#define STRING_BLOCK_SIZE (256<<10)
+
+struct String_Table {
+    Mutex lock;
+    // ID to string, a page of pointers at a time. Pages are never moved so
+    // get_string doesn't need the lock
+    const char **pages[STRING_MAX_PAGES];
+    std::atomic_uint32_t count;
+    Hash_Index index;
+    // Strings are copied into the current block until it fills up
+    char *block;
+    u64 block_used;
+    u64 block_size;
+    u64 total_size;
+};
+
+static String_Table g_strings;
+
+static void append_string(const char *str) {
+    u32 id = g_strings.count;
+    u32 page = id / STRING_PAGE_SIZE;
+    ASSERT(page < STRING_MAX_PAGES);
+    if (!g_strings.pages[page]) {
+        g_strings.pages[page] = (const char**)malloc(STRING_PAGE_SIZE * sizeof(const char*));
+    }
+    g_strings.pages[page][id % STRING_PAGE_SIZE] = str;
+    // Publish the pointer before the ID can be used
+    g_strings.count.store(id + 1);
+}
+
+void string_table_init() {
+    g_strings.lock = create_mutex();
+    append_string("");
+}
+
+String_ID intern_string(const char *str) {
+    if (!str || !str[0]) return 0;
+
+    const u64 length = strlen(str);
+    const u32 hash = get_string_hash(str, length);
+
+    lock_mutex(g_strings.lock);
+    defer(unlock_mutex(g_strings.lock));
+
+    u32 id = g_strings.index.find(hash, [str](u32 candidate) {
+        return !strcmp(get_string(candidate), str);
+    });
+    if (id != Hash_Index::NOT_FOUND) return id;
+
+    if (g_strings.block_used + length + 1 > g_strings.block_size) {
+        g_strings.block_size = MAX(length + 1, (u64)STRING_BLOCK_SIZE);
+        g_strings.block = (char*)malloc(g_strings.block_size);
+        g_strings.block_used = 0;
+    }
+
+    char *copy = &g_strings.block[g_strings.block_used];
+    memcpy(copy, str, length + 1);
+    g_strings.block_used += length + 1;
+    g_strings.total_size += length + 1;
+
+    id = g_strings.count;
+    append_string(copy);
+    g_strings.index.insert(hash, id);
+    return id;
+}
+
+const char *get_string(String_ID id) {
+    ASSERT(id < g_strings.count);
+    return g_strings.pages[id / STRING_PAGE_SIZE][id % STRING_PAGE_SIZE];
+}
+
+u32 get_string_count() {
+    return g_strings.count;
+}
+
+u64 get_string_table_size() {
+    return g_strings.total_size;
+}
+
+u32 get_string_hash(const char *str, u64 length) {
+    return XXH32(str, length, 0);
+}
+
+bool load_string_table(const char *strings, u64 size, u32 count, const Hash_Index& index) {
+    lock_mutex(g_strings.lock);
+    defer(unlock_mutex(g_strings.lock));
+
+    if (g_strings.count != 1) return false;
+    if (count && (!size || strings[size - 1])) return false;
+
+    u32 found = 0;
+    for (u64 i = 0; i < size; ++i) found += strings[i] == 0;
+    if (found != count) return false;
+
+    // One block holds everything, so the next string starts a new one
+    char *block = (char*)malloc(MAX(size, (u64)1));
+    memcpy(block, strings, size);
+    for (u64 offset = 0; offset < size; offset += strlen(&block[offset]) + 1) {
+        append_string(&block[offset]);
+    }
+
+    g_strings.index.load(index.hashes, index.values, index.capacity, index.count);
+    g_strings.block = NULL;
+    g_strings.block_used = 0;
+    g_strings.block_size = 0;
+    g_strings.total_size += size;
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef STRING_TABLE_H
+#define STRING_TABLE_H
+
+// Interned strings. Equal strings share one copy and one ID, so metadata
+// can store artist, album and title as 32-bit IDs. Strings are never freed
+// or moved, so pointers from get_string stay valid
+
+#include "defines.h"
+
+// 0 is the empty string
+typedef u32 String_ID;
+
+struct Hash_Index;
+
+void string_table_init();
+// Thread safe
+String_ID intern_string(const char *str);
+// Thread safe as long as the ID came from intern_string
+const char *get_string(String_ID id);
+// IDs are 0 to get_string_count()-1
+u32 get_string_count();
+// Bytes of all strings including null terminators
+u64 get_string_table_size();
+// Hash the table's index uses, for building a copy of the index when saving
+u32 get_string_hash(const char *str, u64 length);
+// Fills an empty table with count strings packed back to back in ID order
+// (not including the empty string) and a saved index. Returns false if the
+// table isn't empty or the strings don't match count
+bool load_string_table(const char *strings, u64 size, u32 count, const Hash_Index& index);
+
+#endif //STRING_TABLE_H
@@ -0,0 +1,306 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "tag_writer.h"
+#include "array.h"
+#include "os.h"
+#include <atomic>
+
+struct Tag_Write_Job {
+    // Index into edits
+    u32 edit;
+    Track track;
+    Metadata_Index md_index;
+    char path[PATH_LENGTH];
+};
+
+struct Tag_Edit {
+    Detailed_Metadata md;
+    Tag_Fields fields;
+    // Set when the edit puts back original instead of writing md, so there
+    // is nothing to keep for a rollback. Owns original
+    bool restore;
+    Tag_Snapshot original;
+};
+
+// Original tags of a saved file, for putting them back. Owns original
+struct Tag_Restore {
+    Track track;
+    Metadata_Index md_index;
+    Tag_Fields fields;
+    Tag_Snapshot original;
+    char path[PATH_LENGTH];
+};
+
+struct Tag_Write_Result {
+    Track track;
+    Metadata_Index md_index;
+    // Tags read back from the saved file, if have_md is set
+    Metadata md;
+    // Tags before the file was written, if have_original is set. Owned by
+    // the result until it is committed
+    Tag_Snapshot original;
+    Tag_Fields fields;
+    bool saved;
+    bool have_md;
+    bool have_original;
+    char path[PATH_LENGTH];
+};
+
+struct Tag_Writer_State {
+    Thread worker;
+    Mutex lock;
+    // Guarded by lock
+    Array<Tag_Edit> edits;
+    Array<Tag_Write_Job> jobs;
+    Array<Tag_Write_Result> results;
+    u32 jobs_in_flight;
+    //-
+    std::atomic_bool want_quit;
+    Tag_Writer_Progress progress;
+    // Failed paths, one after another
+    Array<char> failure_pool;
+    Array<u32> failures;
+    // Files saved and failed since the writer was last idle
+    Array<Tag_Restore> batch_restores;
+    u32 batch_failed;
+    // Saved files of the last batch that had failures
+    Array<Tag_Restore> rollback;
+};
+
+static Tag_Writer_State g_tag_writer;
+
+static void free_restores(Array<Tag_Restore>& restores) {
+    for (Tag_Restore& restore : restores) restore.original.strings.free();
+    restores.clear();
+}
+
+// Only call when no job refers to the edits
+static void free_edits() {
+    for (Tag_Edit& edit : g_tag_writer.edits) {
+        if (edit.restore) edit.original.strings.free();
+    }
+    g_tag_writer.edits.clear();
+}
+
+static bool pop_job(Tag_Write_Job *job, Tag_Edit *edit) {
+    bool have_job = false;
+    lock_mutex(g_tag_writer.lock);
+    if (g_tag_writer.jobs.count) {
+        *job = g_tag_writer.jobs[0];
+        *edit = g_tag_writer.edits[job->edit];
+        g_tag_writer.jobs.ordered_remove(0);
+        have_job = true;
+    }
+    unlock_mutex(g_tag_writer.lock);
+    return have_job;
+}
+
+static int tag_writer_worker(void *dont_care) {
+    while (!g_tag_writer.want_quit) {
+        Tag_Write_Job job;
+        Tag_Edit edit;
+        Tag_Write_Result result = {};
+
+        if (!pop_job(&job, &edit)) {
+            sleep_milliseconds(50);
+            continue;
+        }
+
+        result.track = job.track;
+        result.md_index = job.md_index;
+        result.fields = edit.fields;
+        strncpy0(result.path, job.path, PATH_LENGTH);
+        if (edit.restore) result.saved = restore_file_tags(job.path, &edit.original, edit.fields);
+        // A file whose tags can't be read first couldn't be restored, so it
+        // isn't written and counts as a failure
+        else if (read_file_tag_snapshot(job.path, &result.original)) {
+            result.saved = write_file_tags(job.path, &edit.md, edit.fields);
+            if (result.saved) result.have_original = true;
+            else result.original.strings.free();
+        }
+        // Pick up the new file size and time along with the tags, so the
+        // next rescan doesn't read the file again
+        if (result.saved) result.have_md = read_file_tags(job.path, &result.md);
+
+        lock_mutex(g_tag_writer.lock);
+        g_tag_writer.results.append(result);
+        unlock_mutex(g_tag_writer.lock);
+    }
+
+    return 0;
+}
+
+void tag_writer_init() {
+    g_tag_writer.lock = create_mutex();
+    g_tag_writer.want_quit = false;
+    g_tag_writer.worker = thread_create(NULL, &tag_writer_worker);
+}
+
+void tag_writer_deinit() {
+    g_tag_writer.want_quit = true;
+    if (g_tag_writer.worker) {
+        thread_join(g_tag_writer.worker);
+        thread_destroy(g_tag_writer.worker);
+        g_tag_writer.worker = NULL;
+    }
+
+    // Commit the files that were saved
+    tag_writer_update();
+
+    destroy_mutex(g_tag_writer.lock);
+    free_edits();
+    free_restores(g_tag_writer.batch_restores);
+    free_restores(g_tag_writer.rollback);
+    g_tag_writer.edits.free();
+    g_tag_writer.jobs.free();
+    g_tag_writer.results.free();
+    g_tag_writer.failure_pool.free();
+    g_tag_writer.failures.free();
+    g_tag_writer.batch_restores.free();
+    g_tag_writer.rollback.free();
+}
+
+bool tag_writer_update(Tag_Writer_Commit_Callback *callback, void *user_data) {
+    Tag_Writer_Progress *progress = &g_tag_writer.progress;
+    bool finished = false;
+
+    lock_mutex(g_tag_writer.lock);
+    defer(unlock_mutex(g_tag_writer.lock));
+
+    if (!g_tag_writer.results.count) return false;
+
+    for (const Tag_Write_Result& result : g_tag_writer.results) {
+        if (result.saved) {
+            if (result.have_md) {
+                Metadata old_md;
+                retrieve_metadata(result.md_index, &old_md);
+                refresh_metadata(result.md_index, &result.md);
+                if (callback) callback(user_data, result.track, &old_md, &result.md);
+            }
+            if (result.have_original) {
+                Tag_Restore restore;
+                restore.track = result.track;
+                restore.md_index = result.md_index;
+                restore.fields = result.fields;
+                restore.original = result.original;
+                strncpy0(restore.path, result.path, PATH_LENGTH);
+                g_tag_writer.batch_restores.append(restore);
+            }
+        }
+        else {
+            log_warning("Failed to write tags to %s\n", result.path);
+            g_tag_writer.failures.append(g_tag_writer.failure_pool.count);
+            g_tag_writer.failure_pool.append_array(result.path, (u32)strlen(result.path) + 1);
+            progress->failed++;
+            g_tag_writer.batch_failed++;
+        }
+        progress->completed++;
+        g_tag_writer.jobs_in_flight--;
+    }
+    g_tag_writer.results.clear();
+
+    if (!g_tag_writer.jobs_in_flight) {
+        // Nothing refers to the edits any more
+        free_edits();
+        // A batch that fully saved has nothing to undo
+        if (g_tag_writer.batch_failed) {
+            free_restores(g_tag_writer.rollback);
+            g_tag_writer.batch_restores.copy_to(g_tag_writer.rollback);
+            g_tag_writer.batch_restores.clear();
+        }
+        else free_restores(g_tag_writer.batch_restores);
+        g_tag_writer.batch_failed = 0;
+        progress->total = 0;
+        progress->completed = 0;
+        finished = true;
+    }
+
+    return finished;
+}
+
+void tag_writer_write(const Track *tracks, u32 track_count, const Detailed_Metadata *md, Tag_Fields fields) {
+    Tag_Edit edit;
+    Tag_Write_Job job;
+
+    if (!track_count || !fields) return;
+    edit.md = *md;
+    edit.fields = fields;
+    edit.restore = false;
+    edit.original = {};
+
+    lock_mutex(g_tag_writer.lock);
+    defer(unlock_mutex(g_tag_writer.lock));
+
+    job.edit = g_tag_writer.edits.append(edit);
+
+    for (u32 i = 0; i < track_count; ++i) {
+        job.track = tracks[i];
+        job.md_index = library_get_track_metadata_index(tracks[i]);
+        library_get_track_path(tracks[i], job.path);
+        g_tag_writer.jobs.append(job);
+    }
+
+    g_tag_writer.jobs_in_flight += track_count;
+    g_tag_writer.progress.total += track_count;
+}
+
+void tag_writer_get_progress(Tag_Writer_Progress *progress) {
+    *progress = g_tag_writer.progress;
+}
+
+u32 tag_writer_get_failure_count() {
+    return g_tag_writer.failures.count;
+}
+
+const char *tag_writer_get_failure(u32 index) {
+    return &g_tag_writer.failure_pool[g_tag_writer.failures[index]];
+}
+
+void tag_writer_clear_failures() {
+    g_tag_writer.failures.clear();
+    g_tag_writer.failure_pool.clear();
+    g_tag_writer.progress.failed = 0;
+    free_restores(g_tag_writer.rollback);
+}
+
+u32 tag_writer_get_rollback_count() {
+    return g_tag_writer.rollback.count;
+}
+
+void tag_writer_rollback() {
+    lock_mutex(g_tag_writer.lock);
+    defer(unlock_mutex(g_tag_writer.lock));
+
+    for (const Tag_Restore& restore : g_tag_writer.rollback) {
+        Tag_Edit edit = {};
+        Tag_Write_Job job;
+        // The edit takes over the snapshot
+        edit.fields = restore.fields;
+        edit.restore = true;
+        edit.original = restore.original;
+        job.edit = g_tag_writer.edits.append(edit);
+        job.track = restore.track;
+        job.md_index = restore.md_index;
+        strncpy0(job.path, restore.path, PATH_LENGTH);
+        g_tag_writer.jobs.append(job);
+    }
+
+    g_tag_writer.jobs_in_flight += g_tag_writer.rollback.count;
+    g_tag_writer.progress.total += g_tag_writer.rollback.count;
+    g_tag_writer.rollback.clear();
+}
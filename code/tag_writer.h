@@ -0,0 +1,66 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TAG_WRITER_H
+#define TAG_WRITER_H
+
+// Writes tags to files in the background. Each file is saved by a worker,
+// then committed into the metadata store by tag_writer_update() on the
+// main thread. Files that fail to save keep their old metadata and are
+// listed as failures. The original tags of each file are read at full
+// length before it is written, and a file whose tags can't be read is not
+// written. When a batch (everything queued until the writer is next idle)
+// has failures, the files of it that did save can be restored
+
+#include "defines.h"
+#include "library.h"
+#include "metadata.h"
+
+struct Tag_Writer_Progress {
+    // Files queued since the writer was last idle
+    u32 total;
+    u32 completed;
+    // Since the failures were last cleared
+    u32 failed;
+};
+
+// Called by tag_writer_update() for each file whose new tags were committed.
+// Must not call back into the tag writer
+typedef void Tag_Writer_Commit_Callback(void *user_data, Track track, const Metadata *old_md,
+                                        const Metadata *new_md);
+
+void tag_writer_init();
+// Waits for the file being written. Files still queued are not written
+void tag_writer_deinit();
+// Call once per frame from the main thread. Returns true when the last
+// queued file has been committed
+bool tag_writer_update(Tag_Writer_Commit_Callback *callback = NULL, void *user_data = NULL);
+// Queues the chosen fields of md to be written to every track
+void tag_writer_write(const Track *tracks, u32 track_count, const Detailed_Metadata *md, Tag_Fields fields);
+void tag_writer_get_progress(Tag_Writer_Progress *progress);
+// Paths of the files that failed to save, until cleared
+u32 tag_writer_get_failure_count();
+const char *tag_writer_get_failure(u32 index);
+// Also drops the files that could be restored
+void tag_writer_clear_failures();
+// Files saved by the last batch with failures, which tag_writer_rollback
+// can restore
+u32 tag_writer_get_rollback_count();
+// Queues the original tags of those files to be written back
+void tag_writer_rollback();
+
+#endif //TAG_WRITER_H
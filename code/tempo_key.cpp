@@ -0,0 +1,262 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "tempo_key.h"
+#include <math.h>
+
+// Hops per second of the onset envelope, roughly
+#define ONSET_HOP_SIZE 128
+// Length of each Goertzel block in seconds
+#define CHROMA_BLOCK_SECONDS 0.37f
+#define MIN_BPM 60.f
+#define MAX_BPM 200.f
+// Tempos near this are preferred when the autocorrelation is ambiguous
+#define PREFERRED_BPM 120.f
+
+// Krumhansl-Kessler key profiles, starting from the tonic
+static const f32 MAJOR_PROFILE[12] = {6.35f, 2.23f, 3.48f, 2.33f, 4.38f, 4.09f, 2.52f, 5.19f, 2.39f, 3.66f, 2.29f, 2.88f};
+static const f32 MINOR_PROFILE[12] = {6.33f, 2.68f, 3.52f, 5.38f, 2.60f, 3.53f, 2.54f, 4.75f, 3.98f, 2.69f, 3.34f, 3.17f};
+
+static const char *KEY_NAMES[MUSICAL_KEY_COUNT] = {
+    "",
+    "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B",
+    "Cm", "C#m", "Dm", "D#m", "Em", "Fm", "F#m", "Gm", "G#m", "Am", "A#m", "Bm",
+};
+
+void tempo_key_init(Tempo_Key_Estimator *est, i32 sample_rate) {
+    tempo_key_free(est);
+    est->decimation = MAX(1, sample_rate / TEMPO_KEY_TARGET_SAMPLE_RATE);
+    est->sample_rate = sample_rate / (i32)est->decimation;
+    est->decimation_fill = 0;
+    est->decimation_sum = 0.f;
+
+    est->hop_size = ONSET_HOP_SIZE;
+    est->hop_fill = 0;
+    est->hop_energy = 0.f;
+    est->prev_log_energy = 0.f;
+    est->hop_count = 0;
+    zero_array(est->hop_energies, TEMPO_KEY_ONSET_ENERGY_HOPS);
+
+    est->block_size = (u32)((f32)est->sample_rate * CHROMA_BLOCK_SECONDS);
+    est->block_fill = 0;
+    zero_array(est->s1, TEMPO_KEY_CHROMA_BINS);
+    zero_array(est->s2, TEMPO_KEY_CHROMA_BINS);
+    zero_array(est->chroma, 12);
+
+    // Bin 0 is C2, MIDI note 36
+    for (u32 bin = 0; bin < TEMPO_KEY_CHROMA_BINS; ++bin) {
+        f32 freq = 440.f * powf(2.f, ((f32)(bin + 36) - 69.f) / 12.f);
+        est->coefs[bin] = 2.f * cosf(2.f * PI * freq / (f32)est->sample_rate);
+    }
+}
+
+void tempo_key_free(Tempo_Key_Estimator *est) {
+    est->onsets.free();
+}
+
+static void end_chroma_block(Tempo_Key_Estimator *est) {
+    f32 magnitudes[TEMPO_KEY_CHROMA_BINS];
+    f32 total = 0.f;
+
+    for (u32 bin = 0; bin < TEMPO_KEY_CHROMA_BINS; ++bin) {
+        f32 s1 = est->s1[bin];
+        f32 s2 = est->s2[bin];
+        f32 power = (s1 * s1) + (s2 * s2) - (est->coefs[bin] * s1 * s2);
+        magnitudes[bin] = sqrtf(MAX(power, 0.f)) / (f32)est->block_size;
+        total += magnitudes[bin];
+    }
+
+    zero_array(est->s1, TEMPO_KEY_CHROMA_BINS);
+    zero_array(est->s2, TEMPO_KEY_CHROMA_BINS);
+    est->block_fill = 0;
+
+    // Every block gets the same say regardless of how loud it is.
+    // Silent blocks are skipped
+    if (total < 1e-4f) return;
+    for (u32 bin = 0; bin < TEMPO_KEY_CHROMA_BINS; ++bin) {
+        est->chroma[bin % 12] += magnitudes[bin] / total;
+    }
+}
+
+static void process_sample(Tempo_Key_Estimator *est, f32 x) {
+    // Onset strength is the rise in log energy from the previous hop
+    est->hop_energy += x * x;
+    if (++est->hop_fill == est->hop_size) {
+        // Energy is measured over a few hops to smooth out beating between
+        // sustained notes
+        est->hop_energies[est->hop_count % TEMPO_KEY_ONSET_ENERGY_HOPS] = est->hop_energy;
+        est->hop_count++;
+        f32 energy = 0.f;
+        for (u32 i = 0; i < TEMPO_KEY_ONSET_ENERGY_HOPS; ++i) energy += est->hop_energies[i];
+        f32 log_energy = logf(1.f + 1000.f * (energy / (f32)(est->hop_size * TEMPO_KEY_ONSET_ENERGY_HOPS)));
+        est->onsets.append(MAX(0.f, log_energy - est->prev_log_energy));
+        est->prev_log_energy = log_energy;
+        est->hop_energy = 0.f;
+        est->hop_fill = 0;
+    }
+
+    for (u32 bin = 0; bin < TEMPO_KEY_CHROMA_BINS; ++bin) {
+        f32 s0 = x + (est->coefs[bin] * est->s1[bin]) - est->s2[bin];
+        est->s2[bin] = est->s1[bin];
+        est->s1[bin] = s0;
+    }
+
+    if (++est->block_fill == est->block_size) end_chroma_block(est);
+}
+
+void tempo_key_process(Tempo_Key_Estimator *est, const f32 *samples, u32 frame_count, i32 channels) {
+    const f32 channel_scale = 1.f / (f32)channels;
+    const f32 decimation_scale = 1.f / (f32)est->decimation;
+
+    for (u32 i = 0; i < frame_count; ++i) {
+        const f32 *frame = &samples[i * channels];
+        f32 mono = 0.f;
+        for (i32 ch = 0; ch < channels; ++ch) mono += frame[ch];
+
+        // Averaging doubles as the anti-aliasing filter
+        est->decimation_sum += mono * channel_scale;
+        if (++est->decimation_fill == est->decimation) {
+            process_sample(est, est->decimation_sum * decimation_scale);
+            est->decimation_sum = 0.f;
+            est->decimation_fill = 0;
+        }
+    }
+}
+
+f32 tempo_key_get_bpm(const Tempo_Key_Estimator *est) {
+    const Array<f32>& onsets = est->onsets;
+    const f32 envelope_rate = (f32)est->sample_rate / (f32)est->hop_size;
+    const u32 count = onsets.count;
+    const u32 min_lag = (u32)floorf(envelope_rate * 60.f / MAX_BPM);
+    const u32 max_lag = (u32)ceilf(envelope_rate * 60.f / MIN_BPM);
+
+    if (count < max_lag * 4 || min_lag < 2) return 0.f;
+
+    // Subtract the local mean so only peaks remain, then the global mean
+    Array<f32> envelope = {};
+    Array<f64> acf = {};
+    defer(envelope.free());
+    defer(acf.free());
+    envelope.push(count);
+    {
+        const u32 radius = MAX(1u, (u32)(envelope_rate * 0.125f));
+        f64 window_sum = 0.0;
+        u32 window_first = 0, window_last = 0;
+        f64 mean = 0.0;
+
+        for (u32 i = 0; i < count; ++i) {
+            u32 first = i > radius ? i - radius : 0;
+            u32 last = MIN(count, i + radius + 1);
+            while (window_last < last) window_sum += onsets[window_last++];
+            while (window_first < first) window_sum -= onsets[window_first++];
+            f32 local_mean = (f32)(window_sum / (f64)(window_last - window_first));
+            envelope[i] = MAX(0.f, onsets[i] - local_mean);
+            mean += envelope[i];
+        }
+
+        mean /= (f64)count;
+        for (u32 i = 0; i < count; ++i) envelope[i] -= (f32)mean;
+    }
+
+    // Lags up to twice the longest beat so each tempo can be checked
+    // against its half-tempo as well
+    const u32 acf_count = MIN(count - 1, max_lag * 2 + 2);
+    acf.push(acf_count);
+    for (u32 lag = 0; lag < acf_count; ++lag) {
+        f64 sum = 0.0;
+        for (u32 i = lag; i < count; ++i) sum += (f64)envelope[i] * (f64)envelope[i - lag];
+        acf[lag] = sum / (f64)(count - lag);
+    }
+    if (acf[0] <= 0.0) return 0.f;
+
+    f64 best_score = 0.0;
+    u32 best_lag = 0;
+    for (u32 lag = min_lag; lag <= max_lag && (lag + 1) < acf_count; ++lag) {
+        f32 bpm = envelope_rate * 60.f / (f32)lag;
+        f32 octaves = log2f(bpm / PREFERRED_BPM);
+        f64 prior = exp(-0.5 * (f64)(octaves * octaves));
+        f64 score = acf[lag];
+        if (lag * 2 < acf_count) score += 0.5 * acf[lag * 2];
+        score *= prior;
+
+        if (score > best_score) {
+            best_score = score;
+            best_lag = lag;
+        }
+    }
+
+    if (!best_lag) return 0.f;
+
+    // Parabolic interpolation for a fractional lag
+    f64 lag = (f64)best_lag;
+    {
+        f64 a = acf[best_lag - 1];
+        f64 b = acf[best_lag];
+        f64 c = acf[best_lag + 1];
+        f64 denom = a - 2.0 * b + c;
+        if (denom < 0.0) lag += clamp(0.5 * (a - c) / denom, -0.5, 0.5);
+    }
+
+    return (f32)(envelope_rate * 60.0 / lag);
+}
+
+static f32 correlate_with_profile(const f64 *chroma, const f32 *profile, u32 tonic) {
+    f64 chroma_mean = 0.0, profile_mean = 0.0;
+    for (u32 i = 0; i < 12; ++i) {
+        chroma_mean += chroma[(tonic + i) % 12];
+        profile_mean += profile[i];
+    }
+    chroma_mean /= 12.0;
+    profile_mean /= 12.0;
+
+    f64 numerator = 0.0, chroma_var = 0.0, profile_var = 0.0;
+    for (u32 i = 0; i < 12; ++i) {
+        f64 c = chroma[(tonic + i) % 12] - chroma_mean;
+        f64 p = profile[i] - profile_mean;
+        numerator += c * p;
+        chroma_var += c * c;
+        profile_var += p * p;
+    }
+
+    if (chroma_var <= 0.0) return 0.f;
+    return (f32)(numerator / sqrt(chroma_var * profile_var));
+}
+
+u32 tempo_key_get_key(const Tempo_Key_Estimator *est) {
+    f32 best = 0.f;
+    u32 key = MUSICAL_KEY_UNKNOWN;
+
+    for (u32 tonic = 0; tonic < 12; ++tonic) {
+        f32 major = correlate_with_profile(est->chroma, MAJOR_PROFILE, tonic);
+        f32 minor = correlate_with_profile(est->chroma, MINOR_PROFILE, tonic);
+        if (major > best) {
+            best = major;
+            key = 1 + tonic;
+        }
+        if (minor > best) {
+            best = minor;
+            key = 13 + tonic;
+        }
+    }
+
+    return key;
+}
+
+const char *get_musical_key_name(u32 key) {
+    if (key >= MUSICAL_KEY_COUNT) return "";
+    return KEY_NAMES[key];
+}
@@ -0,0 +1,79 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TEMPO_KEY_H
+#define TEMPO_KEY_H
+
+// Tempo and key estimation. Audio is mixed down to mono and decimated to
+// around 11kHz first. Tempo comes from the autocorrelation of an onset
+// envelope, key from matching a chroma profile against major and minor
+// key profiles
+
+#include "defines.h"
+#include "array.h"
+
+#define TEMPO_KEY_TARGET_SAMPLE_RATE 11025
+// Semitones from C2 to B7
+#define TEMPO_KEY_CHROMA_BINS 72
+// Analyzing more than this much of a track rarely changes the result
+#define TEMPO_KEY_MAX_SECONDS 90
+// Hops the onset energy is measured over
+#define TEMPO_KEY_ONSET_ENERGY_HOPS 4
+
+// Keys 1-12 are C major to B major, 13-24 are C minor to B minor
+#define MUSICAL_KEY_UNKNOWN 0
+#define MUSICAL_KEY_COUNT 25
+
+struct Tempo_Key_Estimator {
+    i32 sample_rate;
+    // Input frames averaged into each mono sample
+    u32 decimation;
+    u32 decimation_fill;
+    f32 decimation_sum;
+
+    // Onset envelope, one value per hop
+    u32 hop_size;
+    u32 hop_fill;
+    f32 hop_energy;
+    f32 hop_energies[TEMPO_KEY_ONSET_ENERGY_HOPS];
+    u32 hop_count;
+    f32 prev_log_energy;
+    Array<f32> onsets;
+
+    // Goertzel filter bank over one block at a time
+    u32 block_size;
+    u32 block_fill;
+    f32 coefs[TEMPO_KEY_CHROMA_BINS];
+    f32 s1[TEMPO_KEY_CHROMA_BINS];
+    f32 s2[TEMPO_KEY_CHROMA_BINS];
+    f64 chroma[12];
+};
+
+// sample_rate is the rate of the audio that will be passed to tempo_key_process
+void tempo_key_init(Tempo_Key_Estimator *est, i32 sample_rate);
+void tempo_key_free(Tempo_Key_Estimator *est);
+// Feeds interleaved samples into the estimator
+void tempo_key_process(Tempo_Key_Estimator *est, const f32 *samples, u32 frame_count, i32 channels);
+// Returns 0 if no tempo was found
+f32 tempo_key_get_bpm(const Tempo_Key_Estimator *est);
+// Returns MUSICAL_KEY_UNKNOWN if nothing tonal was heard
+u32 tempo_key_get_key(const Tempo_Key_Estimator *est);
+
+// e.g. "C#" or "Am". Empty string for MUSICAL_KEY_UNKNOWN
+const char *get_musical_key_name(u32 key);
+
+#endif //TEMPO_KEY_H
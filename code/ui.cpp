@@ -19,8 +19,13 @@
 #include "ui_functions.h"
 #include "array.h"
 #include "playlist.h"
+#include "playlist_journal.h"
 #include "playback.h"
 #include "playback_analysis.h"
+#include "analysis.h"
+#include "cover_art.h"
+#include "tag_writer.h"
+#include "fingerprint.h"
 #include "preferences.h"
 #include "metadata.h"
 #include "main.h"
@@ -46,12 +51,40 @@
 #define PLAY_ICON "\xef\x81\x8b"
 #define PAUSE_ICON "\xef\x81\x8c"
 
+// Album grid tiles are this many times the font size across
+#define ALBUM_GRID_TILE_SCALE 10.f
+// Covers stay loaded for this many rows above and below the visible ones
+#define ALBUM_GRID_PRELOAD_ROWS 2
+
 char STATE_PATH[PATH_LENGTH];
 char LIBRARY_PATH[PATH_LENGTH];
 char QUEUE_PATH[PATH_LENGTH];
 
 typedef void Window_Show_Fn();
 
+struct Album_Cover {
+    u32 album_id;
+    Cover_Art art;
+    // Still wanted this frame
+    bool wanted;
+};
+
+// Detailed metadata is read on its own thread, one track at a time. If the
+// track changes while a read is running, only the newest track is read
+// next, so skipping through tracks doesn't queue up reads
+struct Detailed_Metadata_Load {
+    Thread thread;
+    // Track being read, or the last one read if done is set
+    Track track;
+    char path[PATH_LENGTH];
+    Detailed_Metadata metadata;
+    std::atomic_bool done;
+    //-
+    // Newest track to show, 0 if there's nothing to load
+    Track wanted_track;
+    Cover_Art cover_art;
+};
+
 struct Filter_Properties {
     char query[128];
     Array<Track> input;
@@ -62,9 +95,15 @@ struct UI_State {
     Array<Playlist> user_playlists;
     Array<Path_Index> user_playlist_paths;
     
+    // Album String_IDs
     Array<u32> album_ids;
     Array<Playlist> albums;
+    // Index into albums plus 1 for each album String_ID, 0 if there's no album
+    Array<u32> album_slots;
     u32 viewing_album_id;
+    bool album_grid_view;
+    // Cover art for the albums near the visible part of the grid
+    Array<Album_Cover> album_covers;
     
     Filter_Properties filter;
     ImGuiID filter_popup_id;
@@ -78,7 +117,9 @@ struct UI_State {
     
     Detailed_Metadata detailed_metadata;
     Track detailed_metadata_track;
-    Texture *cover_art;
+    Cover_Art cover_art;
+    // Swapped into the above once the metadata and the cover art are both ready
+    Detailed_Metadata_Load detailed_metadata_load;
     
     i32 queue_position;
     Track current_track;
@@ -95,6 +136,7 @@ struct UI_State {
     Window_Show_Fn *window_show_fn[WINDOW__COUNT];
     
     bool want_to_create_playlist_from_selection;
+    bool want_find_duplicates;
     
     bool ready;
     bool library_altered;
@@ -110,6 +152,11 @@ struct UI_State {
     ImFont *mini_font;
 
     Track metadata_editor_track;
+    // Tracks given to the batch tag editor
+    Array<Track> batch_edit_tracks;
+    bool want_batch_edit_tags;
+    // The detailed metadata was changed by a tag write
+    bool detailed_metadata_stale;
 
     struct {
         char path[PATH_LENGTH];
@@ -127,6 +174,10 @@ struct UI_State {
         Array<char> path_pool;
         Array<u32> paths;
     } track_scan_buffer;
+    // Set while the scan thread is rescanning the library instead of adding tracks
+    bool rescanning;
+    Library_Rescan rescan;
+    Library_Changes folder_changes;
 
 #ifndef NDEBUG
     bool disable_debug_menu;
@@ -142,42 +193,157 @@ static void show_prefs_editor();
 static void show_file_info();
 static void show_wave_bar();
 static void show_folders_view();
+static void show_duplicates_view();
 static void update_detailed_metadata();
 static void save_all_state();
 static void show_about();
 // Defer saving a playlist until after the async metadata retrieval is done
 static void defer_save_playlist(Playlist *playlist, const char *path);
+static void begin_library_rescan();
+static void finish_library_rescan();
+static void apply_folder_changes();
+static void add_watched_track(void *dont_care, Track track);
+static void save_user_playlist(u32 index);
 
 static void add_to_albums(const Track& track) {
-    Metadata track_md;
-    library_get_track_metadata(track, &track_md);
+    const Metadata_Columns md = get_metadata_columns();
+    const Metadata_Index md_index = library_get_track_metadata_index(track);
+    const String_ID album_id = md.albums[md_index];
     // If there is no album tag we don't need to do anything
-    if (!track_md.album[0]) return;
+    if (!album_id) return;
+    const char *artist = get_string(md.artists[md_index]);
     
-    u32 album_id = hash_string(track_md.album);
-    i32 album_index = ui.album_ids.lookup(album_id);
+    while (ui.album_slots.count <= album_id) ui.album_slots.append(0);
+    u32 album_index = ui.album_slots[album_id] - 1;
     
-    if (album_index < 0) {
-        log_debug("Add album %s\n", track_md.album);
+    if (!ui.album_slots[album_id]) {
+        const char *album_name = get_string(album_id);
+        log_debug("Add album %s\n", album_name);
         
         Playlist playlist = {};
-        playlist.set_name(track_md.album);
-        strncpy0(playlist.creator, track_md.artist, sizeof(playlist.creator));
+        playlist.set_name(album_name);
+        strncpy0(playlist.creator, artist, sizeof(playlist.creator));
         
         ui.album_ids.append(album_id);
         album_index = ui.albums.append(playlist);
+        ui.album_slots[album_id] = album_index + 1;
         ui.albums[album_index].add_track(track);
         return;
     }
     
     Playlist& album = ui.albums[album_index];
-    if (strcmp(album.creator, track_md.artist)) {
+    if (strcmp(album.creator, artist)) {
         zero_array(album.creator, ARRAY_LENGTH(album.creator));
         strcpy(album.creator, "Various Artists");
     }
     album.tracks.append_unique(track);
 }
 
+// Removes the track from the album, and the album once it's empty
+static void remove_from_albums(const Track& track, String_ID album_id) {
+    if (album_id >= ui.album_slots.count || !ui.album_slots[album_id]) return;
+    const u32 album_index = ui.album_slots[album_id] - 1;
+    Playlist& album = ui.albums[album_index];
+    
+    i32 index = album.index_of_track(track);
+    if (index >= 0) album.tracks.ordered_remove(index);
+    if (album.tracks.count) return;
+    
+    album.tracks.free();
+    ui.albums.ordered_remove(album_index);
+    ui.album_ids.ordered_remove(album_index);
+    ui.album_slots[album_id] = 0;
+    // The albums after it moved down
+    for (u32 i = album_index; i < ui.album_ids.count; ++i) ui.album_slots[ui.album_ids[i]] = i + 1;
+}
+
+// The artist of every track, or "Various Artists" if they differ
+static void update_album_creator(Playlist& album) {
+    const Metadata_Columns md = get_metadata_columns();
+    const Metadata_Index *md_indices = library_get_metadata_indices();
+    if (!album.tracks.count) return;
+    
+    const String_ID artist = md.artists[md_indices[album.tracks[0] - 1]];
+    const char *creator = get_string(artist);
+    for (const Track& track : album.tracks) {
+        if (md.artists[md_indices[track - 1]] != artist) {
+            creator = "Various Artists";
+            break;
+        }
+    }
+    
+    zero_array(album.creator, ARRAY_LENGTH(album.creator));
+    strncpy0(album.creator, creator, sizeof(album.creator));
+}
+
+// What tags read again or written by the tag writer changed, so albums and
+// sorted playlists can catch up
+struct Metadata_Changes {
+    // 1 << SORT_METRIC_* for each field that changed
+    u32 sort_metrics;
+    // Albums that gained or lost tracks or had an artist change
+    Array<String_ID> albums;
+    // By track, only filled in once an album or artist changes
+    Array<bool> in_library;
+};
+
+static void on_metadata_changed(void *user_data, Track track, const Metadata *old_md, const Metadata *new_md) {
+    Metadata_Changes *changes = (Metadata_Changes*)user_data;
+    
+    if (old_md->title != new_md->title) changes->sort_metrics |= 1 << SORT_METRIC_TITLE;
+    if (old_md->artist != new_md->artist) changes->sort_metrics |= 1 << SORT_METRIC_ARTIST;
+    if (old_md->album != new_md->album) changes->sort_metrics |= 1 << SORT_METRIC_ALBUM;
+    if (old_md->genre != new_md->genre) changes->sort_metrics |= 1 << SORT_METRIC_GENRE;
+    if (old_md->year != new_md->year) changes->sort_metrics |= 1 << SORT_METRIC_YEAR;
+    if (old_md->track_number != new_md->track_number) changes->sort_metrics |= 1 << SORT_METRIC_TRACK_NUMBER;
+    if (old_md->disc_number != new_md->disc_number) changes->sort_metrics |= 1 << SORT_METRIC_DISC;
+    
+    if (old_md->album == new_md->album && old_md->artist == new_md->artist) return;
+    
+    // Albums are only made from tracks in the library
+    if (!changes->in_library.count) {
+        const u32 track_count = library_get_track_count();
+        changes->in_library.push(track_count + 1);
+        zero_array(changes->in_library.data, track_count + 1);
+        for (const Track& library_track : ui.library.tracks) changes->in_library[library_track] = true;
+    }
+    
+    if (track < changes->in_library.count && changes->in_library[track]) {
+        remove_from_albums(track, old_md->album);
+        add_to_albums(track);
+        changes->albums.append_unique(old_md->album);
+        changes->albums.append_unique(new_md->album);
+    }
+}
+
+static void apply_metadata_changes(const Metadata_Changes& changes) {
+    for (String_ID album_id : changes.albums) {
+        if (album_id < ui.album_slots.count && ui.album_slots[album_id]) {
+            update_album_creator(ui.albums[ui.album_slots[album_id] - 1]);
+        }
+    }
+    
+    if (!changes.sort_metrics) return;
+    auto needs_sort = [&changes](const Playlist& playlist) {
+        return !playlist.unsorted && playlist.sort_metric > SORT_METRIC_NONE &&
+            (changes.sort_metrics & (1 << playlist.sort_metric));
+    };
+    
+    if (needs_sort(ui.library)) {
+        ui.library.sort();
+        ui.library_altered = true;
+    }
+    for (u32 i = 0; i < ui.user_playlists.count; ++i) {
+        if (needs_sort(ui.user_playlists[i])) {
+            ui.user_playlists[i].sort();
+            save_user_playlist(i);
+        }
+    }
+    for (Playlist& album : ui.albums) {
+        if (needs_sort(album)) album.sort();
+    }
+}
+
 Recurse_Command add_tracks_to_async_scan(void *in_data, const char *path, bool is_folder) {
     if (is_folder) {
         for_each_file_in_folder(path, &add_tracks_to_async_scan, NULL);
@@ -208,9 +374,11 @@ const char *get_window_name(int window) {
         case WINDOW_METADATA_EDITOR: return "Edit Metadata";
         case WINDOW_FILE_INFO: return "File Info";
         case WINDOW_FOLDERS: return "Folders";
+        case WINDOW_DUPLICATES: return "Duplicates";
         case WINDOW_V_SPECTRUM: return "Spectrum";
         case WINDOW_V_PEAK: return "Peak Meter";
         case WINDOW_V_WAVE_BAR: return "Wave Bar";
+        case WINDOW_V_SPECTROGRAM: return "Spectrogram";
     }
     
     return NULL;
@@ -232,9 +400,11 @@ const char *get_window_internal_name(int window) {
         case WINDOW_METADATA_EDITOR: return "MetadataEditor";
         case WINDOW_FILE_INFO: return "FileInfo";
         case WINDOW_FOLDERS: return "Folders";
+        case WINDOW_DUPLICATES: return "Duplicates";
         case WINDOW_V_SPECTRUM: return "Spectrum";
         case WINDOW_V_PEAK: return "ChannelPeaks";
         case WINDOW_V_WAVE_BAR: return "WaveBar";
+        case WINDOW_V_SPECTROGRAM: return "Spectrogram";
     }
     
     return NULL;
@@ -299,7 +469,7 @@ static void play_track(const Track& track) {
     Metadata md;
     library_get_track_metadata(track, &md);
     
-    set_window_title_message("%s - %s", md.artist, md.title);
+    set_window_title_message("%s - %s", get_string(md.artist), get_string(md.title));
     notify(NOTIFY_NEW_TRACK_PLAYING);
 }
 
@@ -444,35 +614,70 @@ static void show_search_results() {
     }
 }
 
-// Call upon playing a new track
+static int detailed_metadata_thread_func(void *load_ptr) {
+    Detailed_Metadata_Load *load = (Detailed_Metadata_Load*)load_ptr;
+    load->metadata = Detailed_Metadata{};
+    read_detailed_file_metadata(load->path, &load->metadata);
+    load->done = true;
+    return 0;
+}
+
+// Call every frame. The old metadata and cover art stay up until the new
+// ones have both loaded
 static void update_detailed_metadata() {
-    Track track = ui.current_track;
-    if (!track) return;
+    Detailed_Metadata_Load& load = ui.detailed_metadata_load;
+    const Track track = ui.current_track;
     
-    if (ui.detailed_metadata_track != track) {
-        char path[PATH_LENGTH];
-        Image cover_art;
-        library_get_track_path(track, path);
-        read_detailed_file_metadata(path, &ui.detailed_metadata, &cover_art);
-        ui.detailed_metadata_track = track;
-        
-        if (ui.cover_art)
-            destroy_texture(&ui.cover_art);
+    if (track && track != load.wanted_track) {
+        // Drops the cover art of any track that was skipped past
+        cover_art_release(&load.cover_art);
+        load.wanted_track = 0;
         
-        if (cover_art.data) {
-            ui.cover_art = create_texture_from_image(&cover_art);
-            free_image(&cover_art);
+        if (track != ui.detailed_metadata_track || ui.detailed_metadata_stale) {
+            char path[PATH_LENGTH];
+            library_get_track_path(track, path);
+            load.cover_art = cover_art_request(path, COVER_ART_SIZE_LARGE);
+            load.wanted_track = track;
         }
     }
     
+    if (load.thread) {
+        if (!load.done) return;
+        thread_join(load.thread);
+        thread_destroy(load.thread);
+        load.thread = NULL;
+    }
+    
+    if (!load.wanted_track) return;
+    
+    if (!load.done || load.track != load.wanted_track) {
+        load.track = load.wanted_track;
+        load.done = false;
+        library_get_track_path(load.track, load.path);
+        load.thread = thread_create(&load, &detailed_metadata_thread_func);
+        if (!load.thread) detailed_metadata_thread_func(&load);
+        return;
+    }
+    
+    if (cover_art_is_loading(load.cover_art)) return;
+    
+    ui.detailed_metadata = load.metadata;
+    ui.detailed_metadata_track = load.track;
+    ui.detailed_metadata_stale = false;
+    cover_art_release(&ui.cover_art);
+    ui.cover_art = load.cover_art;
+    load.cover_art = 0;
+    load.wanted_track = 0;
+    // Read again if the track comes back around, its tags may have changed
+    load.done = false;
 }
 
 static void show_detailed_metadata() {
-    if (!ui.current_track) {
+    if (!ui.detailed_metadata_track) {
         ImGui::TextDisabled("No metadata currently loaded");
         return;
     }
-    show_detailed_metadata_table("##metadata", ui.detailed_metadata, ui.cover_art);
+    show_detailed_metadata_table("##metadata", ui.detailed_metadata, cover_art_get_texture(ui.cover_art));
 }
 
 static void show_metadata_editor() {
@@ -539,12 +744,77 @@ static void show_metadata_editor() {
 
     if (ImGui::Button("Save")) {
         char path[PATH_LENGTH];
-        Metadata_Index md_index = library_get_track_metadata_index(md_track);
         library_get_track_path(md_track, path);
         if (show_confirm_dialog("Confirm metadata update", "Overwrite metadata for file %ls?", path)) {
-            update_file_metadata(md_index, path, &md);
+            tag_writer_write(&md_track, 1, &md, TAG_FIELD__ALL);
+        }
+    }
+}
+
+// Sets the checked fields on every track given to it
+static void show_batch_tag_editor() {
+    static Detailed_Metadata md;
+    static Tag_Fields fields;
+    const char *popup_name = "Edit tags";
+    
+    if (ui.want_batch_edit_tags) {
+        ImGui::OpenPopup(popup_name);
+        md = Detailed_Metadata{};
+        fields = 0;
+        ui.want_batch_edit_tags = false;
+    }
+    
+    ImGui::SetNextWindowSize(ImVec2(500, 0));
+    if (!ImGui::BeginPopupModal(popup_name)) return;
+    
+    ImGui::Text("Editing %u tracks. Only checked fields are changed", ui.batch_edit_tracks.count);
+    
+    struct {
+        const char *name;
+        const char *id;
+        Tag_Fields field;
+        char *buf;
+        int buf_size;
+    } md_strings[] = {
+        {"Artist", "##artist", TAG_FIELD_ARTIST, md.artist, sizeof(md.artist)},
+        {"Album", "##album", TAG_FIELD_ALBUM, md.album, sizeof(md.album)},
+        {"Genre", "##genre", TAG_FIELD_GENRE, md.genre, sizeof(md.genre)},
+        {"Comment", "##comment", TAG_FIELD_COMMENT, md.comment, sizeof(md.comment)},
+    };
+    
+    if (ImGui::BeginTable("batch_edit_table", 2, ImGuiTableFlags_SizingStretchProp)) {
+        ImGui::TableSetupColumn("key", 0.3f);
+        ImGui::TableSetupColumn("value", 0.7f);
+        
+        for (auto str : md_strings) {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::CheckboxFlags(str.name, &fields, str.field);
+            ImGui::TableSetColumnIndex(1);
+            if (ImGui::InputText(str.id, str.buf, str.buf_size)) fields |= str.field;
         }
+        
+        ImGui::TableNextRow();
+        ImGui::TableSetColumnIndex(0);
+        ImGui::CheckboxFlags("Year", &fields, TAG_FIELD_YEAR);
+        ImGui::TableSetColumnIndex(1);
+        if (ImGui::InputScalar("##year", ImGuiDataType_U32, &md.year)) fields |= TAG_FIELD_YEAR;
+        
+        ImGui::EndTable();
+    }
+    
+    if (ImGui::Button("Apply") && fields) {
+        tag_writer_write(ui.batch_edit_tracks.data, ui.batch_edit_tracks.count, &md, fields);
+        ui.batch_edit_tracks.clear();
+        ImGui::CloseCurrentPopup();
     }
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel") || ImGui::IsKeyPressed(ImGuiKey_Escape)) {
+        ui.batch_edit_tracks.clear();
+        ImGui::CloseCurrentPopup();
+    }
+    
+    ImGui::EndPopup();
 }
 
 static void load_theme_from_file(const char *path) {
@@ -715,7 +985,7 @@ static void show_user_playlists() {
             char save_path[PATH_LENGTH];
             retrieve_file_path(ui.path_pool, ui.user_playlist_paths[index], 
                                save_path, PATH_LENGTH);
-            delete_file(save_path);
+            delete_playlist_file(save_path);
             playlist.tracks.free();
             ui.user_playlists.ordered_remove(index);
             ui.user_playlist_paths.ordered_remove(index);
@@ -771,8 +1041,153 @@ static void show_user_playlists() {
     //-
 }
 
+// Returns the cover art of an album, requesting it if it isn't loaded.
+// Covers that aren't wanted again before release_unwanted_album_covers()
+// are released
+static Cover_Art want_album_cover(u32 album_index) {
+    const u32 album_id = ui.album_ids[album_index];
+    const Playlist& album = ui.albums[album_index];
+    char path[PATH_LENGTH];
+    
+    for (Album_Cover& cover : ui.album_covers) {
+        if (cover.album_id == album_id) {
+            cover.wanted = true;
+            return cover.art;
+        }
+    }
+    
+    if (!album.tracks.count) return 0;
+    library_get_track_path(album.tracks[0], path);
+    
+    Album_Cover cover = {album_id, cover_art_request(path, COVER_ART_SIZE_MEDIUM), true};
+    ui.album_covers.append(cover);
+    return cover.art;
+}
+
+static void release_unwanted_album_covers() {
+    for (u32 i = 0; i < ui.album_covers.count;) {
+        Album_Cover& cover = ui.album_covers[i];
+        if (cover.wanted) {
+            cover.wanted = false;
+            i++;
+            continue;
+        }
+        
+        cover_art_release(&cover.art);
+        Album_Cover last = ui.album_covers.pop();
+        if (i < ui.album_covers.count) ui.album_covers[i] = last;
+    }
+}
+
+// Returns true if the tile was clicked. Covers are drawn to channel 0 of the
+// draw list and everything else to channel 1
+static bool show_album_tile(u32 album_index, f32 tile_size, ImDrawList *drawlist, bool *want_play) {
+    const Playlist& album = ui.albums[album_index];
+    const ImGuiStyle& style = ImGui::GetStyle();
+    const f32 line_height = ImGui::GetTextLineHeight();
+    const ImVec2 pos = ImGui::GetCursorScreenPos();
+    const ImVec2 size(tile_size, tile_size + style.ItemSpacing.y + (line_height * 2.f));
+    const ImVec2 cover_max(pos.x + tile_size, pos.y + tile_size);
+    const ImVec4 text_clip(pos.x, pos.y, pos.x + size.x, pos.y + size.y);
+    Cover_Art_Image image = {};
+    
+    ImGui::PushID((int)album_index);
+    const bool clicked = ImGui::InvisibleButton("##album", size);
+    ImGui::PopID();
+    const bool hovered = ImGui::IsItemHovered();
+    *want_play = ImGui::IsItemClicked(ImGuiMouseButton_Middle) || is_imgui_item_double_clicked();
+    
+    drawlist->ChannelsSetCurrent(0);
+    if (cover_art_get_image(want_album_cover(album_index), &image)) {
+        // Fit the cover in the tile
+        const f32 scale = tile_size / (f32)MAX(image.width, image.height);
+        const f32 width = (f32)image.width * scale;
+        const f32 height = (f32)image.height * scale;
+        const ImVec2 min(pos.x + ((tile_size - width) * 0.5f), pos.y + ((tile_size - height) * 0.5f));
+        drawlist->AddImage(image.texture, min, ImVec2(min.x + width, min.y + height),
+                           ImVec2(image.u0, image.v0), ImVec2(image.u1, image.v1));
+    }
+    
+    drawlist->ChannelsSetCurrent(1);
+    if (!image.texture) drawlist->AddRectFilled(pos, cover_max, ImGui::GetColorU32(ImGuiCol_FrameBg));
+    if (album.get_id() == ui.current_playlist_id) 
+        drawlist->AddRect(pos, cover_max, get_theme_color(THEME_COLOR_PLAYING_INDICATOR), 0.f, 0, 3.f);
+    else if (hovered)
+        drawlist->AddRect(pos, cover_max, ImGui::GetColorU32(ImGuiCol_HeaderHovered), 0.f, 0, 2.f);
+    
+    drawlist->AddText(ImGui::GetFont(), ImGui::GetFontSize(), ImVec2(pos.x, cover_max.y + style.ItemSpacing.y),
+                      ImGui::GetColorU32(ImGuiCol_Text), album.name, NULL, 0.f, &text_clip);
+    drawlist->AddText(ImGui::GetFont(), ImGui::GetFontSize(), 
+                      ImVec2(pos.x, cover_max.y + style.ItemSpacing.y + line_height),
+                      ImGui::GetColorU32(ImGuiCol_TextDisabled), album.creator, NULL, 0.f, &text_clip);
+    
+    if (hovered) ImGui::SetTooltip("%s\n%s", album.name, album.creator);
+    return clicked;
+}
+
+// Only the visible rows are laid out, and covers are only requested for
+// those and a few rows around them. The covers come from the cover art
+// atlas so they draw together in one batch
+static void show_album_grid(Playlist_List_Action *action) {
+    const ImGuiStyle& style = ImGui::GetStyle();
+    const f32 tile_size = MIN(ImGui::GetFontSize() * ALBUM_GRID_TILE_SCALE,
+                              (f32)cover_art_get_pixel_size(COVER_ART_SIZE_MEDIUM));
+    const f32 row_height = tile_size + (ImGui::GetTextLineHeight() * 2.f) + (style.ItemSpacing.y * 2.f);
+    const u32 album_count = ui.albums.count;
+    i32 first_row = INT32_MAX;
+    i32 end_row = 0;
+    
+    if (ImGui::BeginChild("##album_grid")) {
+        const f32 width = ImGui::GetContentRegionAvail().x;
+        const u32 columns = MAX(1, (u32)((width + style.ItemSpacing.x) / (tile_size + style.ItemSpacing.x)));
+        const i32 rows = (i32)((album_count + columns - 1) / columns);
+        ImDrawList *drawlist = ImGui::GetWindowDrawList();
+        
+        drawlist->ChannelsSplit(2);
+        
+        ImGuiListClipper clipper = ImGuiListClipper();
+        clipper.Begin(rows, row_height);
+        while (clipper.Step()) {
+            first_row = MIN(first_row, clipper.DisplayStart);
+            end_row = MAX(end_row, clipper.DisplayEnd);
+            
+            for (i32 row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+                for (u32 column = 0; column < columns; ++column) {
+                    const u32 index = ((u32)row * columns) + column;
+                    bool want_play;
+                    if (index >= album_count) break;
+                    if (column) ImGui::SameLine();
+                    
+                    if (show_album_tile(index, tile_size, drawlist, &want_play)) {
+                        action->user_selected_playlist = true;
+                        action->selected_playlist_index = index;
+                    }
+                    if (want_play) {
+                        action->user_requested_playlist = true;
+                        action->requested_playlist_index = index;
+                    }
+                }
+            }
+        }
+        clipper.End();
+        
+        drawlist->ChannelsMerge();
+        
+        // Start loading the covers just out of view
+        if (first_row < end_row) {
+            const u32 preload_start = (u32)MAX(0, first_row - ALBUM_GRID_PRELOAD_ROWS) * columns;
+            const u32 preload_end = MIN(album_count, (u32)(end_row + ALBUM_GRID_PRELOAD_ROWS) * columns);
+            for (u32 i = preload_start; i < preload_end; ++i) want_album_cover(i);
+        }
+    }
+    ImGui::EndChild();
+}
+
 static void show_album_list_view() {
     Playlist_List_Action action = {};
+    // Anything the grid didn't ask for this frame is released
+    defer(release_unwanted_album_covers());
+    
     if (ui.viewing_album_id) {
         i32 index = ui.album_ids.lookup(ui.viewing_album_id);
         if (index < 0) {
@@ -798,8 +1213,14 @@ static void show_album_list_view() {
         }
     }
     
-    show_playlist_list("##album_list", ui.albums, ui.current_playlist_id, 
-                       &action, PLAYLIST_LIST_FLAGS_SHOW_CREATOR|PLAYLIST_LIST_FLAGS_NO_EDIT);
+    if (ImGui::Button(ui.album_grid_view ? "Show as list" : "Show as grid"))
+        ui.album_grid_view = !ui.album_grid_view;
+    
+    if (ui.album_grid_view)
+        show_album_grid(&action);
+    else
+        show_playlist_list("##album_list", ui.albums, ui.current_playlist_id, 
+                           &action, PLAYLIST_LIST_FLAGS_SHOW_CREATOR|PLAYLIST_LIST_FLAGS_NO_EDIT);
     
     if (action.user_requested_playlist) {
         const Playlist& playlist = ui.albums[action.requested_playlist_index];
@@ -863,14 +1284,16 @@ void show_ui() {
     const char *layout_name_popup_name = "New layout";
     ImGuiID layout_name_popup_id = ImGui::GetID(layout_name_popup_name);
 
-    update_playback_analyzers(16.66f);
+    update_playback_analyzers();
     
     // If the current track is not the track
     // we have detailed metadata for, load in the
     // new metadata. This must be done at the start of 
-    // the frame because it frees the old texture for the cover art,
-    // which UI functions might want to use.
+    // the frame because swapping in the new metadata
+    // releases the old cover art, whose texture is
+    // freed by cover_art_update().
     update_detailed_metadata();
+    cover_art_update();
     
     float menu_bar_height = 0.f;
     Preferences &prefs = get_preferences();
@@ -893,11 +1316,17 @@ void show_ui() {
         ImGui::SetNextWindowSize(window_size);
         ImGui::SetNextWindowPos(window_pos);
         if (ImGui::Begin("Adding Tracks", NULL, window_flags)) {
-            ImGui::TextUnformatted(
-                "Retrieving metadata... This may take some time for a "
-                "large number of files or files on a hard drive");
-            ImGui::ProgressBar((f32)loaded_tracks / (f32)total_tracks, ImVec2(0, 0), "");
-            ImGui::Text("%u / %u (%u errors)", loaded_tracks, total_tracks, errors);
+            if (ui.rescanning) {
+                ImGui::TextUnformatted("Checking library folders for changes...");
+                ImGui::Text("%u new tracks (%u errors)", loaded_tracks, errors);
+            }
+            else {
+                ImGui::TextUnformatted(
+                    "Retrieving metadata... This may take some time for a "
+                    "large number of files or files on a hard drive");
+                ImGui::ProgressBar((f32)loaded_tracks / (f32)total_tracks, ImVec2(0, 0), "");
+                ImGui::Text("%u / %u (%u errors)", loaded_tracks, total_tracks, errors);
+            }
         }
         ImGui::End();
 
@@ -912,11 +1341,49 @@ void show_ui() {
                 save_playlist_to_file(*ui.deferred_playlist_save.playlist, ui.deferred_playlist_save.path);
                 ui.deferred_playlist_save.playlist = NULL;
             }
+
+            if (ui.rescanning) {
+                finish_library_rescan();
+                ui.rescanning = false;
+            }
         }
 
         return;
     }
 
+    // Commit finished background analysis. Not done while scanning since
+    // the library is being added to on the scan thread
+    analysis_update();
+    
+    // Commit files the tag writer has saved. Once they're all done the
+    // cache is written so the new tags survive a crash
+    {
+        Metadata_Changes changes = {};
+        defer(changes.albums.free());
+        defer(changes.in_library.free());
+        bool finished = tag_writer_update(&on_metadata_changed, &changes);
+        apply_metadata_changes(changes);
+        if (finished) {
+            ui_save_metadata_cache();
+            ui.detailed_metadata_stale = true;
+        }
+    }
+
+    // Changes in watched folders. Their tags are read in the background
+    // and committed here, so the UI isn't blocked
+    {
+        Metadata_Changes changes = {};
+        defer(changes.albums.free());
+        defer(changes.in_library.free());
+        if (library_finish_file_updates(&on_metadata_changed, &add_watched_track, &changes)) {
+            apply_metadata_changes(changes);
+        }
+    }
+    // May start the scan thread if events were missed
+    if (!library_is_updating_files() && library_take_folder_changes(&ui.folder_changes)) {
+        apply_folder_changes();
+    }
+
 #ifndef NDEBUG
     if (ImGui::IsKeyPressed(ImGuiKey_F5)) {
         ui.disable_debug_menu = !ui.disable_debug_menu;
@@ -968,6 +1435,21 @@ void show_ui() {
         
         if (ImGui::BeginMenu("Library")) {
             show_add_files_menu(&ui.library);
+            ImGui::Separator();
+            {
+                Analysis_Progress progress;
+                analysis_get_progress(&progress);
+                if (ImGui::MenuItem("Pause background analysis", NULL, progress.paused)) {
+                    analysis_set_paused(!progress.paused);
+                }
+            }
+            if (ImGui::MenuItem("Rescan library folders")) {
+                begin_library_rescan();
+            }
+            if (ImGui::MenuItem("Find duplicates")) {
+                ui.want_find_duplicates = true;
+                bring_window_to_front(WINDOW_DUPLICATES);
+            }
             ImGui::EndMenu();
         }
         
@@ -1057,6 +1539,19 @@ void show_ui() {
                 }
             }
 
+            ImGui::Separator();
+            {
+                f32 average_ms, max_ms;
+                get_playback_analyzer_timings(&average_ms, &max_ms);
+                ImGui::Text("Analyzers: %.3fms avg, %.3fms max", average_ms, max_ms);
+            }
+            if (ImGui::MenuItem("Reset analyzer timings")) {
+                reset_playback_analyzer_timings();
+            }
+            if (ImGui::MenuItem("Benchmark analyzers")) {
+                benchmark_playback_analyzers();
+            }
+
             ImGui::EndMenu();
         }
 #endif
@@ -1207,7 +1702,7 @@ void show_ui() {
 
             Metadata md;
             library_get_track_metadata(ui.current_track, &md);
-            ImGui::Text("%s - %s", md.artist, md.title);
+            ImGui::Text("%s - %s", get_string(md.artist), get_string(md.title));
             ImGui::Separator();
             ImGui::TextUnformatted(info.format);
             ImGui::Separator();
@@ -1217,6 +1712,47 @@ void show_ui() {
             ImGui::Separator();
             ImGui::TextUnformatted(channel_string);
         }
+
+        {
+            Analysis_Progress progress;
+            analysis_get_progress(&progress);
+            if (progress.completed < progress.total) {
+                if (ui.current_track) ImGui::Separator();
+                if (progress.paused) ImGui::TextDisabled("Analysis paused (%u/%u)", progress.completed, progress.total);
+                else ImGui::Text("Analyzing library (%u/%u)", progress.completed, progress.total);
+            }
+        }
+
+        {
+            Tag_Writer_Progress progress;
+            tag_writer_get_progress(&progress);
+            if (progress.total) {
+                ImGui::Separator();
+                ImGui::Text("Writing tags (%u/%u)", progress.completed, progress.total);
+            }
+            if (progress.failed) {
+                ImGui::Separator();
+                ImGui::Text("Failed to write tags to %u files", progress.failed);
+                if (ImGui::IsItemHovered()) {
+                    const u32 count = tag_writer_get_failure_count();
+                    ImGui::BeginTooltip();
+                    for (u32 i = 0; i < MIN(count, 10u); ++i) ImGui::TextUnformatted(tag_writer_get_failure(i));
+                    if (count > 10) ImGui::TextDisabled("and %u more", count - 10);
+                    ImGui::TextDisabled("Click to dismiss");
+                    ImGui::EndTooltip();
+                }
+                if (ImGui::IsItemClicked()) tag_writer_clear_failures();
+
+                const u32 rollback_count = tag_writer_get_rollback_count();
+                if (rollback_count) {
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton("Undo")) tag_writer_rollback();
+                    if (ImGui::IsItemHovered()) {
+                        ImGui::SetTooltip("Restore the old tags of the %u files that were saved", rollback_count);
+                    }
+                }
+            }
+        }
         end_status_bar();
     }
     ImGui::End();
@@ -1251,6 +1787,8 @@ void show_ui() {
     }
     //-
     
+    show_batch_tag_editor();
+    
     //-
     // Layout name popup
     ImGui::SetNextWindowSize(ImVec2(400, 0));
@@ -1369,6 +1907,7 @@ void init_ui() {
     {
         auto load_playlist_iterator = 
         [](void *dont_care, const char *path, bool is_folder) -> Recurse_Command {
+            if (is_playlist_journal_file(path)) return RECURSE_CONTINUE;
             u32 index = ui.user_playlists.push();
             Playlist& playlist = ui.user_playlists[index];
             playlist = Playlist{};
@@ -1417,9 +1956,11 @@ void init_ui() {
     ui.window_show_fn[WINDOW_METADATA_EDITOR] = &show_metadata_editor;
     ui.window_show_fn[WINDOW_FILE_INFO] = &show_file_info;
     ui.window_show_fn[WINDOW_FOLDERS] = &show_folders_view;
+    ui.window_show_fn[WINDOW_DUPLICATES] = &show_duplicates_view;
     ui.window_show_fn[WINDOW_V_SPECTRUM] = &show_spectrum_ui;
     ui.window_show_fn[WINDOW_V_PEAK] = &show_channel_peaks_ui;
     ui.window_show_fn[WINDOW_V_WAVE_BAR] = &show_wave_bar;
+    ui.window_show_fn[WINDOW_V_SPECTROGRAM] = &show_spectrogram_ui;
     
     ui.window_flags[WINDOW_METADATA] = ImGuiWindowFlags_AlwaysVerticalScrollbar;
     
@@ -1469,6 +2010,36 @@ static void save_all_state() {
     save_playlist_to_file(ui.queue, QUEUE_PATH);
 }
 
+static void append_playlist_metadata_indices(const Playlist& playlist, Array<Metadata_Index>& indices) {
+    const Metadata_Index *md_indices = library_get_metadata_indices();
+    for (u32 i = 0; i < playlist.tracks.count; ++i) {
+        indices.append(md_indices[playlist.tracks[i] - 1]);
+    }
+}
+
+void ui_save_metadata_cache() {
+    // Only tracks in saved playlists are loaded again on the next run, so
+    // the rest of the metadata would never be used
+    Array<Metadata_Index> live = {};
+    defer(live.free());
+
+    // A scan still running at exit is adding to the playlists, keep
+    // everything in case its tracks were meant to be saved
+    if (ui.track_scan_thread) {
+        const u32 count = get_metadata_columns().count;
+        for (Metadata_Index i = 0; i < count; ++i) live.append(i);
+        save_metadata_cache(MAIN_METADATA_PATH, live.data, live.count);
+        return;
+    }
+
+    append_playlist_metadata_indices(ui.library, live);
+    append_playlist_metadata_indices(ui.queue, live);
+    for (u32 i = 0; i < ui.user_playlists.count; ++i) {
+        append_playlist_metadata_indices(ui.user_playlists[i], live);
+    }
+    save_metadata_cache(MAIN_METADATA_PATH, live.data, live.count);
+}
+
 // Show menu items to add files or folders to a playlist
 bool show_add_files_menu(Playlist *playlist) {
     if (ImGui::MenuItem("Add files")) {
@@ -1541,6 +2112,12 @@ void show_track_context_menu(Playlist& from_playlist, u32 track_index) {
         ui.metadata_editor_track = from_playlist.tracks[track_index];
         bring_window_to_front(WINDOW_METADATA_EDITOR);
     }
+    
+    if (ui.track_selection.count > 1 && ImGui::MenuItem("Edit tags of selection...")) {
+        ui.batch_edit_tracks.clear();
+        ui.track_selection.copy_unique_to(ui.batch_edit_tracks);
+        ui.want_batch_edit_tags = true;
+    }
 }
 
 static bool edit_path(const char *label, char *path, File_Type file_type) {
@@ -1644,6 +2221,49 @@ static void show_prefs_editor() {
             Preferences::WAVEFORM_WINDOW_SIZE_MIN, Preferences::WAVEFORM_WINDOW_SIZE_MAX, "%d ms"
         );
 
+        ImGui::TableNextRow();
+        ImGui::TableSetColumnIndex(0);
+        ImGui::TextUnformatted("Spectrum Bands");
+        ImGui::TableSetColumnIndex(1);
+        apply |= ImGui::SliderInt("##spectrum_bands", &prefs.spectrum_band_count,
+                                  Preferences::SPECTRUM_BANDS_MIN,
+                                  Preferences::SPECTRUM_BANDS_MAX);
+
+        ImGui::SeparatorText("Watched Folders");
+        for (int i = 0; i < prefs.watched_folder_count; ++i) {
+            ImGui::PushID(i);
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            if (ImGui::Button("Remove")) {
+                for (int j = i + 1; j < prefs.watched_folder_count; ++j) {
+                    strcpy(prefs.watched_folders[j-1], prefs.watched_folders[j]);
+                }
+                prefs.watched_folder_count--;
+                apply = true;
+            }
+            ImGui::TableSetColumnIndex(1);
+            if (i < prefs.watched_folder_count) ImGui::TextUnformatted(prefs.watched_folders[i]);
+            ImGui::PopID();
+        }
+
+        ImGui::TableNextRow();
+        ImGui::TableSetColumnIndex(0);
+        if (prefs.watched_folder_count < Preferences::MAX_WATCHED_FOLDERS &&
+            ImGui::Button("Add##watched_folder")) {
+            char *folder = prefs.watched_folders[prefs.watched_folder_count];
+            if (open_folder_select_dialog(FILE_TYPE_AUDIO, folder, PATH_LENGTH)) {
+                prefs.watched_folder_count++;
+                apply = true;
+                // Pick up what's already in the folder
+                if (!ui.track_scan_thread) {
+                    add_tracks_to_async_scan(NULL, folder, true);
+                    begin_add_tracks_async_scan(&ui.library);
+                }
+            }
+        }
+        ImGui::TableSetColumnIndex(1);
+        ImGui::TextDisabled("New and changed files in these folders are added to the library");
+
         ImGui::EndTable();
     }
     if (apply) apply_preferences();
@@ -1716,12 +2336,10 @@ static void show_file_info() {
 }
 
 static void show_wave_bar() {
-    f32 *buffer;
-    u32 calculated;
-    u32 total;
-    if (get_waveform_preview(&buffer, &calculated, &total)) {
+    const Waveform *waveform = get_waveform_preview();
+    if (waveform) {
         f32 position = (float)playback_get_position_millis()/(float)playback_get_duration_millis();
-        if (waveform_preview_widget("##waveform", buffer, calculated, total, &position)) {
+        if (waveform_preview_widget("##waveform", waveform, &position)) {
             i64 position_millis = (f64)playback_get_duration_millis() * position;
             playback_seek_to_millis(position_millis);
         }
@@ -1792,6 +2410,102 @@ static void show_folders_view() {
     }
 }
 
+static void show_duplicates_view() {
+    // Tracks are grouped consecutively, group_starts holds the index of
+    // each group's first track
+    static Playlist playlist;
+    static Array<u32> group_starts;
+    static bool searched;
+
+    if (!playlist.name[0]) playlist.set_name("#Duplicates");
+
+    if (ImGui::Button("Find duplicates") || ui.want_find_duplicates) {
+        find_duplicate_tracks(playlist.tracks, group_starts);
+        ui.want_find_duplicates = false;
+        searched = true;
+    }
+
+    Analysis_Progress progress;
+    analysis_get_progress(&progress);
+    if (progress.completed < progress.total) {
+        ImGui::SameLine();
+        ImGui::TextDisabled("Tracks are still being fingerprinted (%u/%u)", progress.completed, progress.total);
+    }
+
+    if (!searched) return;
+    if (!group_starts.count) {
+        ImGui::TextDisabled("No duplicates found");
+        return;
+    }
+
+    ImGui::Text("%u tracks in %u groups", playlist.tracks.count, group_starts.count);
+
+    ImGuiTableFlags table_flags = ImGuiTableFlags_ScrollY|ImGuiTableFlags_Resizable|
+        ImGuiTableFlags_SizingStretchProp|ImGuiTableFlags_BordersInnerV;
+    if (!ImGui::BeginTable("##duplicates", 4, table_flags)) return;
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Title", 0, 0.3f);
+    ImGui::TableSetupColumn("Artist", 0, 0.2f);
+    ImGui::TableSetupColumn("Duration", 0, 0.1f);
+    ImGui::TableSetupColumn("Path", 0, 0.4f);
+    ImGui::TableHeadersRow();
+
+    u32 group = 0;
+    for (u32 i = 0; i < playlist.tracks.count; ++i) {
+        Track track = playlist.tracks[i];
+        Metadata md;
+        char path[PATH_LENGTH];
+        bool is_selected = is_track_selected(track);
+
+        while (group + 1 < group_starts.count && group_starts[group + 1] <= i) group++;
+
+        library_get_track_metadata(track, &md);
+        library_get_track_path(track, path);
+
+        ImGui::PushID(i);
+        ImGui::TableNextRow();
+
+        // Shade every other group so they can be told apart
+        if (group & 1) {
+            ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, ImGui::GetColorU32(ImGuiCol_TableRowBgAlt));
+        }
+        if (track == ui.current_track) {
+            ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, get_theme_color(THEME_COLOR_PLAYING_INDICATOR));
+        }
+
+        ImGui::TableSetColumnIndex(0);
+        if (ImGui::Selectable(get_string(md.title), is_selected, ImGuiSelectableFlags_SpanAllColumns)) {
+            select_track_in_playlist(playlist, i);
+        }
+
+        if (ImGui::IsItemClicked(ImGuiMouseButton_Middle) || is_imgui_item_double_clicked()) {
+            play_playlist(playlist, &playlist.tracks[i]);
+        }
+
+        if (ImGui::BeginPopupContextItem()) {
+            if (!is_selected) {
+                clear_track_selection();
+                select_track_in_playlist(playlist, i);
+            }
+            show_track_context_menu(playlist, i);
+            ImGui::EndPopup();
+        }
+
+        ImGui::TableSetColumnIndex(1);
+        ImGui::TextUnformatted(get_string(md.artist));
+        ImGui::TableSetColumnIndex(2);
+        char duration[32];
+        format_time(md.duration_seconds, duration, sizeof(duration));
+        ImGui::TextUnformatted(duration);
+        ImGui::TableSetColumnIndex(3);
+        ImGui::TextUnformatted(path);
+
+        ImGui::PopID();
+    }
+
+    ImGui::EndTable();
+}
+
 static u32 get_highest_selection_index_before(const Playlist& playlist, const Track& track) {
     u32 ret = 0;
     
@@ -1906,63 +2620,61 @@ static void show_about() {
     show_license_info();
 }
 
-static Recurse_Command async_file_scan_iterator(void *target_ptr, const char *path, bool is_folder) {
-    Playlist *target = (Playlist*)target_ptr;
+struct Async_Scan_Files {
+    Array<char> string_pool;
+    Array<u32> paths;
+};
 
+static Recurse_Command file_collecting_iterator(void *files_ptr, const char *path, bool is_folder) {
+    Async_Scan_Files *files = (Async_Scan_Files*)files_ptr;
 
     if (is_folder) {
-        for_each_file_in_folder(path, &async_file_scan_iterator, target);
+        for_each_file_in_folder(path, &file_collecting_iterator, files);
     }
-    else {
-        Track track = library_add_track(path);
-        if (!track) {
-            ui.track_scan_progress.errors++;
-            return RECURSE_CONTINUE;
-        }
-
-        target->add_track(track);
-        add_to_albums(track);
-        if (target != &ui.library) {
-            ui.library.add_track(track);
-        }
-        ui.library_altered = true;
-        ui.track_scan_progress.tracks_loaded++;
+    else if (is_supported_file(path)) {
+        u32 length = (u32)strlen(path);
+        u32 offset = files->string_pool.push(length + 1);
+        memcpy(&files->string_pool[offset], path, length + 1);
+        files->paths.append(offset);
     }
 
     return RECURSE_CONTINUE;
 }
 
-static Recurse_Command file_counting_iterator(void *value_ptr, const char *path, bool is_folder) {
-    u32 *value = (u32*)value_ptr;
+static void async_file_scan_add_track(void *target_ptr, Track track) {
+    Playlist *target = (Playlist*)target_ptr;
 
-    if (is_folder) {
-        for_each_file_in_folder(path, &file_counting_iterator, value);
-    }
-    else if (is_supported_file(path)) {
-        *value += 1;
+    if (!track) {
+        ui.track_scan_progress.errors++;
+        return;
     }
 
-    return RECURSE_CONTINUE;
+    target->add_track(track);
+    add_to_albums(track);
+    if (target != &ui.library) {
+        ui.library.add_track(track);
+    }
+    ui.library_altered = true;
+    ui.track_scan_progress.tracks_loaded++;
 }
 
 static int async_file_scan_thread_func(void *target_ptr) {
-    Playlist *target = (Playlist*)target_ptr;
     u32 input_count = ui.track_scan_buffer.paths.count;
-    u32 file_count = 0;
     const Array<char>& path_pool = ui.track_scan_buffer.path_pool;
     const Array<u32>& paths = ui.track_scan_buffer.paths;
+    Async_Scan_Files files = {};
+    defer(files.string_pool.free());
+    defer(files.paths.free());
 
     for (u32 i = 0; i < input_count; ++i) {
         const char *path = &path_pool[paths[i]];
-        file_counting_iterator(&file_count, path, is_path_a_folder(path));
+        file_collecting_iterator(&files, path, is_path_a_folder(path));
     }
 
-    ui.track_scan_progress.total_track_count = file_count;
+    ui.track_scan_progress.total_track_count = files.paths.count;
 
-    for (u32 i = 0; i < input_count; ++i) {
-        const char *path = &path_pool[paths[i]];
-        async_file_scan_iterator(target, path, is_path_a_folder(path));
-    }
+    library_import_files(files.string_pool.data, files.paths.data, files.paths.count,
+                         &async_file_scan_add_track, target_ptr);
 
     ui.track_scan_progress.done = true;
 
@@ -1977,6 +2689,106 @@ void begin_add_tracks_async_scan(Playlist *target) {
     ui.track_scan_thread = thread_create(target, &async_file_scan_thread_func);
 }
 
+static int async_rescan_thread_func(void *dont_care) {
+    library_rescan(&ui.rescan, &async_file_scan_add_track, &ui.library);
+    ui.track_scan_progress.done = true;
+    return 0;
+}
+
+static void begin_library_rescan() {
+    ASSERT(ui.track_scan_progress.done == false);
+    ui.track_scan_progress.total_track_count = 0;
+    ui.track_scan_progress.tracks_loaded = 0;
+    ui.track_scan_progress.errors = 0;
+    ui.rescanning = true;
+    ui.track_scan_thread = thread_create(NULL, &async_rescan_thread_func);
+}
+
+// Takes tracks out of the library and albums
+static void remove_tracks_from_library(const Array<Track>& removed) {
+    Array<bool> is_removed = {};
+    defer(is_removed.free());
+    if (!removed.count) return;
+
+    is_removed.push(library_get_track_count() + 1);
+    memset(is_removed.data, 0, is_removed.count * sizeof(bool));
+    for (Track track : removed) is_removed[track] = true;
+
+    auto filter = [&is_removed](Array<Track>& tracks) {
+        u32 kept = 0;
+        for (u32 i = 0; i < tracks.count; ++i) {
+            if (!is_removed[tracks[i]]) tracks[kept++] = tracks[i];
+        }
+        tracks.count = kept;
+    };
+
+    filter(ui.library.tracks);
+    for (Playlist& album : ui.albums) filter(album.tracks);
+    ui.library_altered = true;
+}
+
+// Takes tracks whose files are gone out of the library, and moves the ones
+// whose tags changed to their new albums
+static void finish_library_rescan() {
+    const Library_Rescan& rescan = ui.rescan;
+    Metadata_Changes changes = {};
+    defer(changes.albums.free());
+    defer(changes.in_library.free());
+
+    remove_tracks_from_library(rescan.missing);
+    for (const Library_Track_Update& update : rescan.updated) {
+        on_metadata_changed(&changes, update.track, &update.old_md, &update.new_md);
+    }
+    apply_metadata_changes(changes);
+
+    show_message_box(MESSAGE_BOX_TYPE_INFO, "Added %u, updated %u and removed %u tracks",
+                     rescan.added_count, rescan.updated.count, rescan.missing.count);
+}
+
+static void apply_folder_changes() {
+    const Library_Changes& changes = ui.folder_changes;
+    Array<Track> removed = {};
+    defer(removed.free());
+
+    if (changes.need_rescan) {
+        log_info("Missed changes in watched folders, rescanning the library\n");
+        begin_library_rescan();
+        return;
+    }
+
+    // The file may have been put back since it was removed
+    for (u32 offset : changes.removed_files) {
+        const char *path = &changes.string_pool[offset];
+        Track track = library_find_track(path);
+        if (track && !does_file_exist(path)) removed.append(track);
+    }
+
+    for (u32 offset : changes.removed_folders) {
+        const char *folder = &changes.string_pool[offset];
+        u32 length = (u32)strlen(folder);
+        char path[PATH_LENGTH];
+
+        for (Track track : ui.library.tracks) {
+            library_get_track_path(track, path);
+            if (!strncmp(path, folder, length) && path[length] == PATH_SEP &&
+                !does_file_exist(path)) {
+                removed.append(track);
+            }
+        }
+    }
+
+    remove_tracks_from_library(removed);
+    library_begin_file_updates(changes.string_pool.data, changes.changed.data, changes.changed.count);
+}
+
+// New file in a watched folder
+static void add_watched_track(void *dont_care, Track track) {
+    if (!track) return;
+    ui.library.add_track(track);
+    add_to_albums(track);
+    ui.library_altered = true;
+}
+
 static void defer_save_playlist(Playlist *playlist, const char *path) {
     ui.deferred_playlist_save.playlist = playlist;
     strncpy0(ui.deferred_playlist_save.path, path, PATH_LENGTH);
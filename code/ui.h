@@ -27,6 +27,8 @@ void ui_play_next_track();
 void ui_play_previous_track();
 Track ui_get_playing_track();
 void ui_push_mini_font();
+// Saves the metadata of the tracks in the library, queue and user playlists
+void ui_save_metadata_cache();
 void ui_pop_mini_font();
 
 #endif //UI_H
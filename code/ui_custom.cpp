@@ -18,6 +18,7 @@
 #include "ui_functions.h"
 #include "theme.h"
 #include "playback_analysis.h"
+#include "waveform.h"
 #include <imgui_internal.h>
 
 // Trim spaces from string
@@ -202,8 +203,7 @@ void peak_meter_widget(const char *str_id, ImVec2 size) {
     ImGui::InvisibleButton(str_id, size);
 }
 
-bool waveform_preview_widget(const char *str_id, f32 *buffer, u32 calculated_samples,
-    u32 total_samples, f32 *p_position, ImVec2 size) {
+bool waveform_preview_widget(const char *str_id, const Waveform *waveform, f32 *p_position, ImVec2 size) {
     ImDrawList *draw_list = ImGui::GetWindowDrawList();
     ImVec2 available_size = ImGui::GetContentRegionAvail();
     ImVec2 cursor = ImGui::GetCursorScreenPos();
@@ -214,24 +214,37 @@ bool waveform_preview_widget(const char *str_id, f32 *buffer, u32 calculated_sam
 
     if (size.x == 0.f || size.y == 0.f) return false;
 
+    // Use the finest level that still has at most one bucket per pixel
+    u32 level = waveform_choose_level(waveform, (u32)size.x);
+    u32 total_samples;
+    const Waveform_Bucket *buckets = waveform_get_level(waveform, level, &total_samples);
+    i32 channels = waveform->channels;
+
     f32 bar_width = size.x / (f32)total_samples;
     f32 bar_height = size.y * 0.5f;
     f32 middle = cursor.y + (size.y * 0.5f);
     f32 x_pos = cursor.x;
     u32 sample_at_position = (f32)total_samples * *p_position;
      
-    for (u32 i = 0; i < calculated_samples; ++i) {
-        f32 peak_height = buffer[i] * bar_height;
+    for (u32 i = 0; i < total_samples; ++i) {
+        const Waveform_Bucket *bucket = &buckets[i * channels];
+        i16 bucket_min = bucket[0].min;
+        i16 bucket_max = bucket[0].max;
         bool up_to_this_sample = i <= sample_at_position;
 
+        for (i32 ch = 1; ch < channels; ++ch) {
+            bucket_min = MIN(bucket_min, bucket[ch].min);
+            bucket_max = MAX(bucket_max, bucket[ch].max);
+        }
+
         ImVec2 min = {
             x_pos,
-            middle - peak_height,
+            middle - (((f32)bucket_max / 32767.f) * bar_height),
         };
 
         ImVec2 max = {
             x_pos + bar_width,
-            middle + peak_height,
+            middle - (((f32)bucket_min / 32767.f) * bar_height),
         };
 
         if (fabsf(min.y - max.y) < 1.f) {
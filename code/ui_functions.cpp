@@ -17,6 +17,7 @@
 */
 #include "ui_functions.h"
 #include "theme.h"
+#include "tempo_key.h"
 #include <imgui.h>
 
 bool show_playlist_selectable(const Playlist& playlist, bool playing, ImGuiSelectableFlags flags) {
@@ -133,6 +134,17 @@ enum {
     TRACK_COLUMN_ARTIST,
     TRACK_COLUMN_ALBUM,
     TRACK_COLUMN_DURATION,
+    TRACK_COLUMN_PEAK,
+    TRACK_COLUMN_RMS,
+    TRACK_COLUMN_LOUDNESS,
+    TRACK_COLUMN_BPM,
+    TRACK_COLUMN_KEY,
+    TRACK_COLUMN_TRACK_NUMBER,
+    TRACK_COLUMN_DISC,
+    TRACK_COLUMN_YEAR,
+    TRACK_COLUMN_GENRE,
+    TRACK_COLUMN_BITRATE,
+    TRACK_COLUMN_SAMPLE_RATE,
 };
 
 const static Track_List_Column TRACK_COLUMNS[] = {
@@ -140,6 +152,17 @@ const static Track_List_Column TRACK_COLUMNS[] = {
     {"Artist", SORT_METRIC_ARTIST, 0, 150.f},
     {"Album", SORT_METRIC_ALBUM, 0, 150.f},
     {"Duration", SORT_METRIC_DURATION, 0, 150.f},
+    {"Peak", SORT_METRIC_PEAK, ImGuiTableColumnFlags_DefaultHide, 80.f},
+    {"RMS", SORT_METRIC_RMS, ImGuiTableColumnFlags_DefaultHide, 80.f},
+    {"Loudness", SORT_METRIC_LOUDNESS, ImGuiTableColumnFlags_DefaultHide, 100.f},
+    {"BPM", SORT_METRIC_BPM, ImGuiTableColumnFlags_DefaultHide, 60.f},
+    {"Key", SORT_METRIC_KEY, ImGuiTableColumnFlags_DefaultHide, 50.f},
+    {"#", SORT_METRIC_TRACK_NUMBER, ImGuiTableColumnFlags_DefaultHide, 40.f},
+    {"Disc", SORT_METRIC_DISC, ImGuiTableColumnFlags_DefaultHide, 40.f},
+    {"Year", SORT_METRIC_YEAR, ImGuiTableColumnFlags_DefaultHide, 50.f},
+    {"Genre", SORT_METRIC_GENRE, ImGuiTableColumnFlags_DefaultHide, 100.f},
+    {"Bitrate", SORT_METRIC_BITRATE, ImGuiTableColumnFlags_DefaultHide, 80.f},
+    {"Sample Rate", SORT_METRIC_SAMPLE_RATE, ImGuiTableColumnFlags_DefaultHide, 90.f},
 };
 
 static void show_track_range(Playlist& playlist, u32 start, 
@@ -156,13 +179,13 @@ static void show_track_range(Playlist& playlist, u32 start,
         const bool is_selected = is_track_selected(track);
         const bool is_playing = current_track == track;
 
-        library_get_track_metadata(track, &metadata);
-        
-        if (playlist.filter[0] && (!metadata_meets_filter(metadata, filter_lowercase)
+        if (playlist.filter[0] && (!track_meets_filter(track, filter_lowercase)
             || !ImGui::IsRectVisible(ImVec2(1, ImGui::GetFrameHeightWithSpacing())))) {
             continue;
         }
         
+        library_get_track_metadata(track, &metadata);
+        
         ImGui::PushID((void*)(uintptr_t)i_track);
         defer(ImGui::PopID());
         ImGui::TableNextRow();
@@ -173,16 +196,16 @@ static void show_track_range(Playlist& playlist, u32 start,
         }
         
         if (ImGui::TableSetColumnIndex(TRACK_COLUMN_ALBUM)) {
-            ImGui::TextUnformatted(metadata.album);
+            ImGui::TextUnformatted(get_string(metadata.album));
         }
         
         if (ImGui::TableSetColumnIndex(TRACK_COLUMN_ARTIST)) {
-            ImGui::TextUnformatted(metadata.artist);
+            ImGui::TextUnformatted(get_string(metadata.artist));
         }
         
         // Select track
         if (ImGui::TableSetColumnIndex(TRACK_COLUMN_TITLE)) {
-            if (ImGui::Selectable(metadata.title, is_selected,
+            if (ImGui::Selectable(get_string(metadata.title), is_selected,
                                   ImGuiSelectableFlags_SpanAllColumns)) {
                 select_track_in_playlist(playlist, i_track);
             }
@@ -227,8 +250,45 @@ static void show_track_range(Playlist& playlist, u32 start,
         
         // Duration
         if (ImGui::TableSetColumnIndex(TRACK_COLUMN_DURATION)) {
-            ImGui::TextUnformatted(metadata.duration_string);
+            char duration[32];
+            format_time(metadata.duration_seconds, duration, sizeof(duration));
+            ImGui::TextUnformatted(duration);
         }
+
+        // Analysis
+        const Track_Analysis& analysis = metadata.analysis;
+        if (analysis.flags & ANALYSIS_FLAG_OPEN_FAILED) {
+            if (ImGui::TableSetColumnIndex(TRACK_COLUMN_PEAK)) ImGui::TextDisabled("Error");
+        }
+        else if (analysis.flags & ANALYSIS_FLAG_LEVELS) {
+            if (ImGui::TableSetColumnIndex(TRACK_COLUMN_PEAK))
+                ImGui::Text("%.1f dB", analysis.peak_db);
+            if (ImGui::TableSetColumnIndex(TRACK_COLUMN_RMS))
+                ImGui::Text("%.1f dB", analysis.rms_db);
+            if (ImGui::TableSetColumnIndex(TRACK_COLUMN_LOUDNESS))
+                ImGui::Text("%.1f LUFS", analysis.loudness);
+        }
+
+        if ((analysis.flags & ANALYSIS_FLAG_TEMPO_KEY) && !(analysis.flags & ANALYSIS_FLAG_OPEN_FAILED)) {
+            if (analysis.bpm > 0.f && ImGui::TableSetColumnIndex(TRACK_COLUMN_BPM))
+                ImGui::Text("%.0f", analysis.bpm);
+            if (ImGui::TableSetColumnIndex(TRACK_COLUMN_KEY))
+                ImGui::TextUnformatted(get_musical_key_name(analysis.key));
+        }
+
+        // Extended tags
+        if (metadata.track_number && ImGui::TableSetColumnIndex(TRACK_COLUMN_TRACK_NUMBER))
+            ImGui::Text("%u", metadata.track_number);
+        if (metadata.disc_number && ImGui::TableSetColumnIndex(TRACK_COLUMN_DISC))
+            ImGui::Text("%u", metadata.disc_number);
+        if (metadata.year && ImGui::TableSetColumnIndex(TRACK_COLUMN_YEAR))
+            ImGui::Text("%u", metadata.year);
+        if (ImGui::TableSetColumnIndex(TRACK_COLUMN_GENRE))
+            ImGui::TextUnformatted(get_string(metadata.genre));
+        if (metadata.bitrate && ImGui::TableSetColumnIndex(TRACK_COLUMN_BITRATE))
+            ImGui::Text("%u kbps", metadata.bitrate);
+        if (metadata.sample_rate && ImGui::TableSetColumnIndex(TRACK_COLUMN_SAMPLE_RATE))
+            ImGui::Text("%.1f kHz", (f32)metadata.sample_rate / 1000.f);
     }
     
     if (want_remove) {
@@ -251,6 +311,17 @@ static bool update_playlist_sort_specs(Playlist& playlist, ImGuiTableSortSpecs *
             case TRACK_COLUMN_ARTIST: metric = SORT_METRIC_ARTIST; break;
             case TRACK_COLUMN_ALBUM: metric = SORT_METRIC_ALBUM; break;
             case TRACK_COLUMN_DURATION: metric = SORT_METRIC_DURATION; break;
+            case TRACK_COLUMN_PEAK: metric = SORT_METRIC_PEAK; break;
+            case TRACK_COLUMN_RMS: metric = SORT_METRIC_RMS; break;
+            case TRACK_COLUMN_LOUDNESS: metric = SORT_METRIC_LOUDNESS; break;
+            case TRACK_COLUMN_BPM: metric = SORT_METRIC_BPM; break;
+            case TRACK_COLUMN_KEY: metric = SORT_METRIC_KEY; break;
+            case TRACK_COLUMN_TRACK_NUMBER: metric = SORT_METRIC_TRACK_NUMBER; break;
+            case TRACK_COLUMN_DISC: metric = SORT_METRIC_DISC; break;
+            case TRACK_COLUMN_YEAR: metric = SORT_METRIC_YEAR; break;
+            case TRACK_COLUMN_GENRE: metric = SORT_METRIC_GENRE; break;
+            case TRACK_COLUMN_BITRATE: metric = SORT_METRIC_BITRATE; break;
+            case TRACK_COLUMN_SAMPLE_RATE: metric = SORT_METRIC_SAMPLE_RATE; break;
         }
         
         if (col_sort->SortDirection == ImGuiSortDirection_Ascending) {
@@ -290,7 +361,7 @@ void show_playlist_track_list(const char *str_id, Playlist& playlist, Track curr
     bool want_scroll_to_playing_track = false;
     i32 index_of_track_to_scroll_to = -1;
     
-    if (ImGui::BeginTable(str_id, 4, table_flags)) {
+    if (ImGui::BeginTable(str_id, ARRAY_LENGTH(TRACK_COLUMNS), table_flags)) {
         focused = ImGui::IsWindowFocused();
         
         if (focused) {
@@ -408,142 +479,3 @@ void show_detailed_metadata_table(const char *str_id, const Detailed_Metadata& m
     }
 }
 
-bool save_playlist_to_file(const Playlist& playlist, const char *filename) {
-    FILE *f = fopen(filename, "w");
-    if (!f) {
-        log_error("Failed to open file %s for writing\n", filename);
-        return false;
-    }
-    defer(fclose(f));
-    
-    fprintf(f, "1\n"); // Version
-    fprintf(f, "%s\n", playlist.name); // Name
-    fprintf(f, "%s\n", sort_metric_to_string(playlist.sort_metric)); // Sort metric
-    fprintf(f, "%s\n", sort_order_to_string(playlist.sort_order)); // Sort order
-    
-    // Track paths
-    for (u32 i = 0; i < playlist.tracks.count; ++i) {
-        char path[PATH_LENGTH];
-        library_get_track_path(playlist.tracks[i], path);
-        fprintf(f, "%s\n", path);
-    }
-    
-    return true;
-}
-
-#if 0
-static size_t read_line(FILE *f, char *buffer, int buffer_size) {
-    if (!fgets(buffer, buffer_size, f)) return 0;
-    size_t length = strlen(buffer);
-    if (buffer[length-1] == '\n') {
-        buffer[length-1] = 0;
-        return length-1;
-    }
-    else {
-        return length;
-    }
-}
-
-bool load_playlist_from_file(const wchar_t *path, Playlist& playlist) {
-    FILE *f = _wfopen(path, L"r");
-    if (!f) {
-        wlog_error(L"Failed to open playlist %s for reading\n", path);
-        return false;
-    }
-    defer(fclose(f));
-    
-    //setvbuf(f, NULL, _IOFBF, 16<<10);
-    
-    char line[1024];
-    
-    // Version
-    if (read_line(f, line, sizeof(line)) == 0) return false;
-    if (atoi(line) > 1) {
-        log_error("Unsupported playlist file version %s\n", line);
-        return false;
-    }
-    
-    // Name
-    if (read_line(f, line, sizeof(line)) == 0) return false;
-    playlist.set_name(line);
-    
-    // Sort metric
-    if (read_line(f, line, sizeof(line)) == 0) return false;
-    playlist.sort_metric = sort_metric_from_string(line);
-    
-    // Sort order
-    if (read_line(f, line, sizeof(line)) == 0) return false;
-    playlist.sort_order = sort_order_from_string(line);
-    
-    // Tracks
-    while (read_line(f, line, sizeof(line)) != 0) {
-        wchar_t track_path[PATH_LENGTH];
-        utf8_to_wchar(line, track_path, PATH_LENGTH);
-        playlist.add_track(track_path);
-    }
-    
-    return true;
-}
-#else
-
-static INLINE bool iscontrol(int c) {
-    return c == '\n' || c == '\r';
-}
-
-static bool read_line(char **memory, char *buffer, int buffer_size) {
-    char *p = *memory;
-    int i = 0;
-    
-    if (*p == 0) return false;
-    
-    while (*p && isspace(*p)) ++p;
-    
-    for (; *p && !iscontrol(*p) && *p != '\n' && (i < (buffer_size-1)); ++p, ++i) {
-        buffer[i] = *p;
-    }
-    
-    buffer[i] = 0;
-    
-    *memory = p;
-    return true;
-}
-
-bool load_playlist_from_file(const char *path, Playlist& playlist) {
-    char *buffer;
-    char *f;
-    if (!read_whole_file(path, (void**)&buffer, true)) return false;
-    defer(free(buffer));
-    
-    f = buffer;
-    
-    char line[1024];
-    
-    // Version
-    if (read_line(&f, line, sizeof(line)) == 0) return false;
-    if (atoi(line) > 1) {
-        log_error("Unsupported playlist file version %s\n", line);
-        return false;
-    }
-    
-    // Name
-    if (read_line(&f, line, sizeof(line)) == 0) return false;
-    playlist.set_name(line);
-    
-    // Sort metric
-    if (read_line(&f, line, sizeof(line)) == 0) return false;
-    playlist.sort_metric = sort_metric_from_string(line);
-    
-    // Sort order
-    if (read_line(&f, line, sizeof(line)) == 0) return false;
-    playlist.sort_order = sort_order_from_string(line);
-    
-    // Tracks
-    while (read_line(&f, line, sizeof(line)) != 0) {
-        playlist.add_track(line);
-    }
-    
-    return true;
-}
-
-#endif
-
@@ -25,6 +25,8 @@
 #include "video.h"
 #include <imgui.h>
 
+struct Waveform;
+
 #define DRAG_DROP_PAYLOAD_TYPE_TRACKS "TRACKS"
 
 enum {
@@ -39,10 +41,12 @@ enum {
     WINDOW_METADATA_EDITOR,
     WINDOW_FILE_INFO,
     WINDOW_FOLDERS,
+    WINDOW_DUPLICATES,
     WINDOW__FIRST_VISUALIZER,
     WINDOW_V_SPECTRUM = WINDOW__FIRST_VISUALIZER,
     WINDOW_V_PEAK,
     WINDOW_V_WAVE_BAR,
+    WINDOW_V_SPECTROGRAM,
     WINDOW__COUNT,
 };
 
@@ -118,15 +122,13 @@ void show_playlist_track_list(const char *str_id, Playlist& playlist, Track curr
 void show_detailed_metadata_table(const char *str_id, const Detailed_Metadata& metadata, Texture *cover_art);
 // Show menu items to add files or folders to a playlist
 bool show_add_files_menu(Playlist *playlist);
-bool save_playlist_to_file(const Playlist& playlist, const char *path);
-bool load_playlist_from_file(const char *path, Playlist& playlist);
 //-
 
 //-
 // From ui_custom.cpp. These all use imgui_internal.h
 bool circle_handle_slider(const char *str_id, float *value, float min, float max, ImVec2 size);
 void peak_meter_widget(const char *str_id, ImVec2 size);
-bool waveform_preview_widget(const char *str_id, f32 *buffer, u32 calculated_samples, u32 total_samples, f32 *p_position, ImVec2 size = ImVec2(0, 0));
+bool waveform_preview_widget(const char *str_id, const Waveform *waveform, f32 *p_position, ImVec2 size = ImVec2(0, 0));
 // Calls ImGui::Begin() so make sure to call ImGui::End() no matter the return value is!
 bool begin_status_bar();
 void end_status_bar();
@@ -35,6 +35,10 @@ void video_invalidate_imgui_objects();
 void video_create_imgui_objects();
 
 Texture *create_texture_from_image(Image *image);
+// Creates an empty R8G8B8A8 texture whose contents are changed with update_texture_region()
+Texture *create_streaming_texture(i32 width, i32 height);
+// Replace a rectangle of a streaming texture with R8G8B8A8 pixels. pitch is in bytes
+void update_texture_region(Texture *texture, i32 x, i32 y, i32 width, i32 height, const void *data, i32 pitch);
 void destroy_texture(Texture **texture);
 
 bool load_image_from_file(const char *filename, Image *image);
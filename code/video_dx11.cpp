@@ -209,6 +209,59 @@ Texture *create_texture_from_image(Image *image) {
     return view;
 }
 
+Texture *create_streaming_texture(i32 width, i32 height) {
+    ID3D11Texture2D *texture = NULL;
+    ID3D11ShaderResourceView *view = NULL;
+
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+    g_device->CreateTexture2D(&desc, NULL, &texture);
+    if (!texture) return NULL;
+    defer(texture->Release());
+
+    // Clear it. Regions are filled in later with UpdateSubresource
+    {
+        u8 *zero = (u8*)calloc((size_t)width * height, 4);
+        if (!zero) return NULL;
+        g_context->UpdateSubresource(texture, 0, NULL, zero, width * 4, 0);
+        free(zero);
+    }
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC sr = {};
+    sr.Format = desc.Format;
+    sr.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    sr.Texture2D.MipLevels = 1;
+    g_device->CreateShaderResourceView(texture, &sr, &view);
+
+    return view;
+}
+
+void update_texture_region(Texture *texture, i32 x, i32 y, i32 width, i32 height, const void *data, i32 pitch) {
+    ID3D11ShaderResourceView *view = (ID3D11ShaderResourceView*)texture;
+    ID3D11Resource *resource = NULL;
+    D3D11_BOX box;
+
+    view->GetResource(&resource);
+    if (!resource) return;
+    defer(resource->Release());
+
+    box.left = x;
+    box.top = y;
+    box.front = 0;
+    box.right = x + width;
+    box.bottom = y + height;
+    box.back = 1;
+    g_context->UpdateSubresource(resource, 0, &box, data, pitch, 0);
+}
+
 void destroy_texture(Texture **texture) {
     if (*texture) ((ID3D11ShaderResourceView*)*texture)->Release();
     *texture = NULL;
@@ -61,6 +61,34 @@ Texture *create_texture_from_image(Image *image) {
     return (Texture*)(uintptr_t)texture;
 }
 
+Texture *create_streaming_texture(i32 width, i32 height) {
+    GLuint texture;
+    u8 *zero = (u8*)calloc((size_t)width * height, 4);
+    if (!zero) return NULL;
+    defer(free(zero));
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, zero);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return (Texture*)(uintptr_t)texture;
+}
+
+void update_texture_region(Texture *texture, i32 x, i32 y, i32 width, i32 height, const void *data, i32 pitch) {
+    GLuint handle = (GLuint)(uintptr_t)texture;
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 void destroy_texture(Texture **texture) {
     GLuint handle = (GLuint)*(uintptr_t*)texture;
     glDeleteTextures(1, &handle);
@@ -0,0 +1,373 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "waveform.h"
+#include "platform.h"
+#include "os.h"
+#include "decoder.h"
+#include "simd.h"
+#include <xxhash.h>
+#include <math.h>
+#include <stdio.h>
+
+#define WAVEFORM_CACHE_MAGIC *(u32*)"WFMC"
+#define WAVEFORM_CACHE_VERSION 1
+
+static INLINE i16 quantize(f32 v) {
+    return (i16)(clamp(v, -1.f, 1.f) * 32767.f);
+}
+
+static INLINE f32 dequantize(i16 v) {
+    return (f32)v / 32767.f;
+}
+
+static void combine_buckets(const Waveform_Bucket *a, const Waveform_Bucket *b, Waveform_Bucket *out) {
+    if (!b) {
+        *out = *a;
+        return;
+    }
+
+    f32 ra = dequantize(a->rms);
+    f32 rb = dequantize(b->rms);
+    out->min = MIN(a->min, b->min);
+    out->max = MAX(a->max, b->max);
+    out->rms = quantize(sqrtf(((ra * ra) + (rb * rb)) * 0.5f));
+}
+
+static u32 find_level(const Waveform *wf, u32 max_buckets) {
+    for (u32 level = 0; level < wf->level_count; ++level) {
+        if (wf->levels[level].bucket_count <= max_buckets) return level;
+    }
+    return wf->level_count ? wf->level_count - 1 : 0;
+}
+
+void waveform_init(Waveform *wf, i32 channels, i32 sample_rate, i64 frame_count) {
+    waveform_free(wf);
+    wf->channels = channels;
+    wf->sample_rate = sample_rate;
+    wf->frame_count = frame_count;
+    wf->frames_per_bucket = (u32)MAX((i64)WAVEFORM_MIN_FRAMES_PER_BUCKET,
+        (frame_count + WAVEFORM_MAX_BUCKETS - 1) / WAVEFORM_MAX_BUCKETS);
+
+    u32 bucket_count = (u32)((frame_count + wf->frames_per_bucket - 1) / wf->frames_per_bucket);
+    u32 offset = 0;
+    wf->level_count = 0;
+
+    while (bucket_count && wf->level_count < WAVEFORM_MAX_LEVELS) {
+        Waveform_Level *level = &wf->levels[wf->level_count++];
+        level->offset = offset;
+        level->bucket_count = bucket_count;
+        offset += bucket_count;
+        if (bucket_count == 1) break;
+        bucket_count = (bucket_count + 1) / 2;
+    }
+
+    wf->buckets.push(offset * channels);
+    zero_array(wf->buckets.data, wf->buckets.count);
+    wf->finest_ready_level = find_level(wf, WAVEFORM_COARSE_BUCKETS);
+}
+
+void waveform_free(Waveform *wf) {
+    wf->buckets.free();
+    wf->level_count = 0;
+    wf->finest_ready_level = 0;
+    wf->complete = false;
+}
+
+static Waveform_Bucket *get_bucket(Waveform *wf, u32 level, u32 index) {
+    return &wf->buckets[(wf->levels[level].offset + index) * wf->channels];
+}
+
+static void calc_bucket(const Waveform *wf, const f32 *samples, u32 frame_count, Waveform_Bucket *out) {
+    f32 min[MAX_AUDIO_CHANNELS], max[MAX_AUDIO_CHANNELS], sumsq[MAX_AUDIO_CHANNELS];
+    simd_interleaved_min_max_sumsq(samples, frame_count, wf->channels, min, max, sumsq);
+
+    // Keep the bucket touching zero so quiet stretches still draw around
+    // the middle line
+    for (i32 ch = 0; ch < wf->channels; ++ch) {
+        out[ch].min = quantize(MIN(min[ch], 0.f));
+        out[ch].max = quantize(MAX(max[ch], 0.f));
+        out[ch].rms = quantize(frame_count ? sqrtf(sumsq[ch] / (f32)frame_count) : 0.f);
+    }
+}
+
+// Recalculates a bucket of a level from the two below it
+static void update_parent_bucket(Waveform *wf, u32 level, u32 index) {
+    const Waveform_Level *child_level = &wf->levels[level-1];
+    const Waveform_Bucket *a = get_bucket(wf, level-1, index*2);
+    const Waveform_Bucket *b = NULL;
+    Waveform_Bucket *out = get_bucket(wf, level, index);
+
+    if ((index*2 + 1) < child_level->bucket_count) b = get_bucket(wf, level-1, index*2 + 1);
+
+    for (i32 ch = 0; ch < wf->channels; ++ch) {
+        combine_buckets(&a[ch], b ? &b[ch] : NULL, &out[ch]);
+    }
+}
+
+// Recalculates every bucket above (level, index) up to the top level
+static void update_parent_chain(Waveform *wf, u32 level, u32 index) {
+    for (++level; level < wf->level_count; ++level) {
+        index >>= 1;
+        update_parent_bucket(wf, level, index);
+    }
+}
+
+const Waveform_Bucket *waveform_get_level(const Waveform *wf, u32 level, u32 *bucket_count) {
+    if (level >= wf->level_count) {
+        *bucket_count = 0;
+        return NULL;
+    }
+
+    *bucket_count = wf->levels[level].bucket_count;
+    return &wf->buckets.data[wf->levels[level].offset * wf->channels];
+}
+
+u32 waveform_choose_level(const Waveform *wf, u32 max_buckets) {
+    return MAX(find_level(wf, max_buckets), (u32)wf->finest_ready_level);
+}
+
+// Decodes up to frame_count frames into buffer and returns the number of
+// frames that were decoded
+static u32 decode_frames(Decoder *dec, f32 *buffer, u32 frame_count) {
+    i64 frame_index = dec->frame_index;
+    if (decoder_decode(dec, buffer, frame_count, dec->info.channels, dec->info.samplerate) == DECODE_STATUS_EOF) {
+        return 0;
+    }
+    return (u32)(dec->frame_index - frame_index);
+}
+
+static void run_coarse_task(Waveform_Generator *gen, Decoder *dec, f32 *buffer, u32 index) {
+    Waveform *wf = gen->waveform;
+    const u32 block_size = 1u << gen->coarse_level;
+    const u32 first = index * block_size;
+    const u32 count = MIN(block_size, wf->levels[0].bucket_count - first);
+    Waveform_Bucket bucket[MAX_AUDIO_CHANNELS];
+
+    // Sample one bucket's worth of audio from the middle of the block
+    if (!decoder_seek_frame(dec, (i64)(first + count/2) * wf->frames_per_bucket)) return;
+    u32 frames = decode_frames(dec, buffer, wf->frames_per_bucket);
+
+    calc_bucket(wf, buffer, frames, bucket);
+    memcpy(get_bucket(wf, gen->coarse_level, index), bucket, sizeof(Waveform_Bucket) * wf->channels);
+    update_parent_chain(wf, gen->coarse_level, index);
+}
+
+static void run_refine_task(Waveform_Generator *gen, Decoder *dec, f32 *buffer, u32 index) {
+    Waveform *wf = gen->waveform;
+    const u32 block_size = 1u << gen->coarse_level;
+    const u32 first = index * block_size;
+    const u32 count = MIN(block_size, wf->levels[0].bucket_count - first);
+    bool decoding = decoder_seek_frame(dec, (i64)first * wf->frames_per_bucket);
+
+    for (u32 i = first; i < first + count; ++i) {
+        u32 frames = decoding ? decode_frames(dec, buffer, wf->frames_per_bucket) : 0;
+        // The frame count reported by the file can be longer than what
+        // actually decodes
+        if (!frames) decoding = false;
+        calc_bucket(wf, buffer, frames, get_bucket(wf, 0, i));
+        if (gen->want_cancel) return;
+    }
+
+    // The block is aligned to its coarse bucket, so every level up to the
+    // coarse level only depends on this block
+    for (u32 level = 1; level <= gen->coarse_level; ++level) {
+        u32 level_first = first >> level;
+        u32 level_last = (first + count - 1) >> level;
+        for (u32 i = level_first; i <= level_last; ++i) update_parent_bucket(wf, level, i);
+    }
+
+    update_parent_chain(wf, gen->coarse_level, index);
+}
+
+static int waveform_worker(void *data) {
+    Waveform_Generator *gen = (Waveform_Generator*)data;
+    Waveform *wf = gen->waveform;
+    const u32 coarse_count = wf->levels[gen->coarse_level].bucket_count;
+    Decoder dec = {};
+    Array<f32> buffer = {};
+
+    if (decoder_open(&dec, gen->path)) {
+        buffer.push(wf->frames_per_bucket * wf->channels);
+
+        while (!gen->want_cancel) {
+            u32 task = gen->next_task++;
+            if (task >= gen->task_count) break;
+
+            if (task < coarse_count) run_coarse_task(gen, &dec, buffer.data, task);
+            else run_refine_task(gen, &dec, buffer.data, task - coarse_count);
+
+            if (!gen->want_cancel) gen->finished_tasks++;
+        }
+
+        decoder_close(&dec);
+    }
+
+    // Last worker out finishes the waveform. Coarse buckets can land after
+    // a refined block has already updated the same bucket, so every level
+    // above 0 is rebuilt from the full resolution data
+    if (--gen->active_workers == 0 && gen->finished_tasks == gen->task_count) {
+        for (u32 level = 1; level < wf->level_count; ++level) {
+            for (u32 i = 0; i < wf->levels[level].bucket_count; ++i) update_parent_bucket(wf, level, i);
+        }
+
+        wf->finest_ready_level = 0;
+        wf->complete = true;
+        waveform_save_to_cache(gen->path, wf);
+    }
+
+    return 0;
+}
+
+bool waveform_generator_start(Waveform_Generator *gen, Waveform *wf, const char *path) {
+    Decoder dec = {};
+    waveform_generator_stop(gen);
+
+    if (!decoder_open(&dec, path)) return false;
+    if (dec.info.channels > MAX_AUDIO_CHANNELS) {
+        decoder_close(&dec);
+        return false;
+    }
+    waveform_init(wf, dec.info.channels, dec.info.samplerate, dec.info.frames);
+    decoder_close(&dec);
+    if (!wf->level_count) return false;
+
+    u32 coarse_count;
+    gen->waveform = wf;
+    strncpy0(gen->path, path, PATH_LENGTH);
+    gen->coarse_level = wf->finest_ready_level;
+    coarse_count = wf->levels[gen->coarse_level].bucket_count;
+    gen->task_count = coarse_count * 2;
+    // Short tracks are refined at coarse resolution straight away
+    gen->next_task = gen->coarse_level ? 0 : coarse_count;
+    gen->finished_tasks = (u32)gen->next_task;
+    gen->want_cancel = false;
+    gen->active_workers = WAVEFORM_WORKER_COUNT;
+
+    for (u32 i = 0; i < WAVEFORM_WORKER_COUNT; ++i) {
+        gen->workers[i] = thread_create(gen, &waveform_worker);
+    }
+
+    return true;
+}
+
+void waveform_generator_stop(Waveform_Generator *gen) {
+    gen->want_cancel = true;
+    for (u32 i = 0; i < WAVEFORM_WORKER_COUNT; ++i) {
+        if (!gen->workers[i]) continue;
+        thread_join(gen->workers[i]);
+        thread_destroy(gen->workers[i]);
+        gen->workers[i] = NULL;
+    }
+    gen->want_cancel = false;
+}
+
+static void get_cache_file_path(const char *path, char *buffer) {
+    snprintf(buffer, PATH_LENGTH-1, "%s" PATH_SEP_STR "waveforms" PATH_SEP_STR "%08x.wfc",
+        PLATFORM_DATA_PATH, hash_string(path));
+}
+
+bool waveform_load_from_cache(const char *path, Waveform *wf) {
+    char cache_path[PATH_LENGTH] = {};
+    char stored_path[PATH_LENGTH] = {};
+    File_Stat stat;
+    u32 magic, version, path_length, bucket_total, frames_per_bucket;
+    u64 size, modified_time;
+    i32 channels, sample_rate;
+    i64 frame_count;
+
+    if (!get_file_stat(path, &stat)) return false;
+    get_cache_file_path(path, cache_path);
+
+    FILE *f = fopen(cache_path, "rb");
+    if (!f) return false;
+    defer(fclose(f));
+
+    if (!fread(&magic, 4, 1, f) || magic != WAVEFORM_CACHE_MAGIC) return false;
+    if (!fread(&version, 4, 1, f) || version != WAVEFORM_CACHE_VERSION) return false;
+    if (!fread(&path_length, 4, 1, f) || path_length >= PATH_LENGTH) return false;
+    if (fread(stored_path, 1, path_length, f) != path_length) return false;
+    // Different file with the same hash
+    if (strcmp(stored_path, path)) return false;
+
+    if (!fread(&size, 8, 1, f) || !fread(&modified_time, 8, 1, f)) return false;
+    if (size != stat.size || modified_time != stat.modified_time) return false;
+
+    if (!fread(&channels, 4, 1, f) || !fread(&sample_rate, 4, 1, f)) return false;
+    if (!fread(&frame_count, 8, 1, f) || !fread(&frames_per_bucket, 4, 1, f)) return false;
+    if (!fread(&bucket_total, 4, 1, f)) return false;
+    if (channels <= 0 || channels > MAX_AUDIO_CHANNELS) return false;
+    if (sample_rate <= 0 || frame_count < 0) return false;
+    if (frames_per_bucket < WAVEFORM_MIN_FRAMES_PER_BUCKET) return false;
+    // Every level after the finest has half as many buckets, so all of them
+    // together are under twice the finest
+    if (bucket_total > 2 * WAVEFORM_MAX_BUCKETS * (u32)channels) return false;
+
+    waveform_init(wf, channels, sample_rate, frame_count);
+    if (wf->frames_per_bucket != frames_per_bucket || wf->buckets.count != bucket_total) {
+        waveform_free(wf);
+        return false;
+    }
+
+    if (fread(wf->buckets.data, sizeof(Waveform_Bucket), bucket_total, f) != bucket_total) {
+        waveform_free(wf);
+        return false;
+    }
+
+    wf->finest_ready_level = 0;
+    wf->complete = true;
+    return true;
+}
+
+void waveform_save_to_cache(const char *path, const Waveform *wf) {
+    char cache_path[PATH_LENGTH] = {};
+    File_Stat stat;
+    u32 magic = WAVEFORM_CACHE_MAGIC;
+    u32 version = WAVEFORM_CACHE_VERSION;
+    u32 path_length = (u32)strlen(path);
+
+    if (!waveform_is_complete(wf)) return;
+    if (!get_file_stat(path, &stat)) return;
+
+    snprintf(cache_path, PATH_LENGTH-1, "%s" PATH_SEP_STR "waveforms", PLATFORM_DATA_PATH);
+    if (!does_file_exist(cache_path)) create_directory(cache_path);
+    get_cache_file_path(path, cache_path);
+
+    // Swapped in once it's on disk, so a failed save doesn't leave a
+    // truncated cache behind
+    char temp_path[PATH_LENGTH];
+    snprintf(temp_path, PATH_LENGTH, "%s.tmp", cache_path);
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) return;
+
+    fwrite(&magic, 4, 1, f);
+    fwrite(&version, 4, 1, f);
+    fwrite(&path_length, 4, 1, f);
+    fwrite(path, 1, path_length, f);
+    fwrite(&stat.size, 8, 1, f);
+    fwrite(&stat.modified_time, 8, 1, f);
+    fwrite(&wf->channels, 4, 1, f);
+    fwrite(&wf->sample_rate, 4, 1, f);
+    fwrite(&wf->frame_count, 8, 1, f);
+    fwrite(&wf->frames_per_bucket, 4, 1, f);
+    fwrite(&wf->buckets.count, 4, 1, f);
+    fwrite(wf->buckets.data, sizeof(Waveform_Bucket), wf->buckets.count, f);
+
+    bool flushed = flush_file(f);
+    fclose(f);
+    if (!flushed || !replace_file(temp_path, cache_path)) delete_file(temp_path);
+}
@@ -0,0 +1,103 @@
+/*
+    ZNO Music Player
+    Copyright (C) 2024  Jamie Dennis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+// Multi-resolution waveform summaries. Level 0 is the finest level,
+// every level above it has half as many buckets as the one below.
+// Buckets are stored level by level, then bucket by bucket, with one
+// entry per channel
+
+#include "defines.h"
+#include "array.h"
+#include "os.h"
+#include <atomic>
+
+#define WAVEFORM_MAX_BUCKETS 65536
+#define WAVEFORM_MIN_FRAMES_PER_BUCKET 256
+#define WAVEFORM_MAX_LEVELS 17
+#define WAVEFORM_WORKER_COUNT 4
+// Resolution of the coarse pass
+#define WAVEFORM_COARSE_BUCKETS 1024
+
+// Quantized to i16. min/max are in -1..1, rms is in 0..1
+struct Waveform_Bucket {
+    i16 min;
+    i16 max;
+    i16 rms;
+};
+
+struct Waveform_Level {
+    // Offset of the level's first bucket in Waveform::buckets, in buckets
+    // (not counting channels)
+    u32 offset;
+    u32 bucket_count;
+};
+
+struct Waveform {
+    i32 channels;
+    i32 sample_rate;
+    i64 frame_count;
+    u32 frames_per_bucket;
+    u32 level_count;
+    Waveform_Level levels[WAVEFORM_MAX_LEVELS];
+    Array<Waveform_Bucket> buckets;
+    // Finest level that can be shown. Buckets that haven't been calculated yet
+    // are zero
+    std::atomic_uint32_t finest_ready_level;
+    std::atomic_bool complete;
+};
+
+// Generates a waveform on a pool of workers. A coarse pass seeks through the
+// file and decodes a short stretch per coarse bucket, then the waveform is
+// refined block by block from the full audio
+struct Waveform_Generator {
+    Waveform *waveform;
+    char path[PATH_LENGTH];
+    Thread workers[WAVEFORM_WORKER_COUNT];
+    u32 coarse_level;
+    // Tasks [0, coarse count) are coarse, the rest refine one coarse bucket each
+    u32 task_count;
+    std::atomic_uint32_t next_task;
+    std::atomic_uint32_t finished_tasks;
+    std::atomic_uint32_t active_workers;
+    std::atomic_bool want_cancel;
+};
+
+// Lays out the levels for a track and allocates storage for them
+void waveform_init(Waveform *wf, i32 channels, i32 sample_rate, i64 frame_count);
+void waveform_free(Waveform *wf);
+// Returns the buckets of a level, channel interleaved
+const Waveform_Bucket *waveform_get_level(const Waveform *wf, u32 level, u32 *bucket_count);
+// Finest ready level that has no more than max_buckets buckets
+u32 waveform_choose_level(const Waveform *wf, u32 max_buckets);
+static inline bool waveform_is_complete(const Waveform *wf) {
+    return wf->complete;
+}
+
+// Starts generating the waveform for the file at path in the background
+bool waveform_generator_start(Waveform_Generator *gen, Waveform *wf, const char *path);
+// Cancels generation if it's still running and waits for the workers to exit
+void waveform_generator_stop(Waveform_Generator *gen);
+
+// Loads the waveform for the file at path from the cache. Fails if the
+// file has changed since the waveform was saved
+bool waveform_load_from_cache(const char *path, Waveform *wf);
+void waveform_save_to_cache(const char *path, const Waveform *wf);
+
+#endif //WAVEFORM_H